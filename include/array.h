@@ -10,6 +10,7 @@ void array_append(array_t *a, void *datum);
 void* array_at(array_t *a, uint64_t index);
 void* array_back(array_t *a);
 void array_set(array_t *a, uint64_t index, void *datum);
+void array_pop(array_t *a);
 const void* array_data(array_t *a);
 size_t array_size(array_t *a);
 void array_copy(array_t *dst, array_t *src);
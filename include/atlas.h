@@ -0,0 +1,19 @@
+#ifndef __ATLAS_H__
+#define __ATLAS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image.h"
+
+// A rectangle in the atlas. x and y are the position of the unpadded image
+typedef struct {
+  uint32_t x, y;
+  uint32_t width, height;
+} atlas_rect_t;
+
+bool atlas_pack(atlas_rect_t *rects, size_t count, uint32_t width, uint32_t height, uint32_t padding);
+void atlas_blit(image_t *atlas, const image_t *src, const atlas_rect_t *rect, uint32_t padding);
+
+#endif // __ATLAS_H__
@@ -0,0 +1,49 @@
+#ifndef __BC_H__
+#define __BC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image.h"
+#include "threadpool.h"
+
+typedef enum {
+  // 4 bits per pixel, opaque RGB
+  BC_FORMAT_BC1,
+
+  // 8 bits per pixel, RGB with interpolated alpha
+  BC_FORMAT_BC3
+} bc_format_t;
+
+// A block compressed image with its mip chain
+typedef struct {
+  bc_format_t format;
+
+  // Dimensions of the full resolution image (level 0)
+  uint32_t width;
+  uint32_t height;
+
+  // Number of mip levels
+  uint32_t levels;
+
+  // The 4x4 blocks of each mip level in row major order, NULL for levels that were not read
+  uint8_t *data[IMAGE_MAX_LEVELS];
+  size_t size[IMAGE_MAX_LEVELS];
+} bc_image_t;
+
+size_t bc_block_size(bc_format_t format);
+size_t bc_level_size(bc_format_t format, uint32_t width, uint32_t height);
+bool bc_image_has_alpha(const image_t *img);
+void bc_encode(bc_image_t *bc, const image_t *img, bc_format_t format, threadpool_t *pool);
+void bc_decode_block(bc_format_t format, const uint8_t *block, uint8_t *pixels);
+float bc_psnr(const bc_image_t *bc, const image_t *img, uint32_t level);
+bool bc_write(const bc_image_t *bc, const char *filename, uint64_t key);
+bool bc_read(bc_image_t *bc, const char *filename, uint64_t key);
+bool bc_read_info(bc_image_t *bc, const char *filename, uint64_t key);
+bool bc_read_levels(bc_image_t *bc, const char *filename, uint64_t key, uint32_t first, uint32_t end);
+bool bc_read_blocks(const char *filename, uint64_t key, uint32_t first, uint8_t *dst);
+void bc_free(bc_image_t *bc);
+bool bc_self_test(uint32_t size, threadpool_t *pool);
+
+#endif // __BC_H__
@@ -0,0 +1,36 @@
+#ifndef __CULL_H__
+#define __CULL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gl_core_4_1.h"
+#include "mat.h"
+
+// Boxes tested per iteration by the SSE2 kernel, the box arrays are padded to a multiple of it
+#define CULL_BATCH 4
+
+// The six planes of a view frustum (left, right, bottom, top, near, far). A point is inside a plane if ax+by+cz+d >= 0
+typedef struct {
+  GLfloat planes[6][4];
+} cull_frustum_t;
+
+// Axis aligned bounding boxes as centers and half extents, in structure of arrays form so a SIMD register loads the same
+// coordinate of several boxes
+typedef struct {
+  size_t count;
+  GLfloat *center[3];
+  GLfloat *extent[3];
+} cull_boxes_t;
+
+void cull_frustum_from_matrix(cull_frustum_t *frustum, const mat4_t *mvp);
+void cull_boxes_create(cull_boxes_t *boxes, size_t count);
+void cull_boxes_set(cull_boxes_t *boxes, size_t index, const GLfloat *lo, const GLfloat *hi);
+void cull_boxes_delete(cull_boxes_t *boxes);
+void cull_transform_box(const mat4_t *mat, const GLfloat *lo, const GLfloat *hi, GLfloat *out_lo, GLfloat *out_hi);
+size_t cull_test(const cull_frustum_t *frustum, const cull_boxes_t *boxes, uint8_t *visible);
+size_t cull_test_scalar(const cull_frustum_t *frustum, const cull_boxes_t *boxes, uint8_t *visible);
+bool cull_self_test(size_t count);
+
+#endif // __CULL_H__
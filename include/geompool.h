@@ -0,0 +1,58 @@
+#ifndef __GEOMPOOL_H__
+#define __GEOMPOOL_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gl_core_4_1.h"
+
+// Vertex streams a pool can have, each in its own buffer with its own VAO
+#define GEOMPOOL_MAX_STREAMS 2
+
+// Attributes a stream can have
+#define GEOMPOOL_MAX_ATTRIBS 4
+
+// Where the geometry of one allocation lives. Indices are relative to first_vertex, which is passed as the base vertex
+// of the draws, and first_index is the offset of the allocation in the index buffer
+typedef struct {
+  GLuint first_vertex;
+  GLuint num_vertices;
+  GLuint first_index;
+  GLuint num_indices;
+} geompool_range_t;
+
+// Use of the vertex or the index arena, in vertices or indices. Fragmentation is the share of the free space outside the
+// largest free block, 0 when all of it could go to one allocation
+typedef struct {
+  size_t capacity;
+  size_t used;
+  size_t free_blocks;
+  size_t largest_free;
+  double occupancy;
+  double fragmentation;
+} geompool_arena_stats_t;
+
+typedef struct {
+  geompool_arena_stats_t vertices;
+  geompool_arena_stats_t indices;
+  size_t allocations;
+  size_t grows;
+} geompool_stats_t;
+
+// Shared vertex and index buffers the geometry of many meshes is suballocated from, so they are all drawn from the
+// same VAO. A pool has one vertex format: one or more streams of vertices allocated together, each with its own VAO
+// over the shared index buffer. The buffers grow when an allocation does not fit
+typedef struct geompool geompool_t;
+
+geompool_t* geompool_create(uint32_t num_streams, const GLsizei *strides, size_t vertices, size_t indices);
+void geompool_attrib(geompool_t *pool, uint32_t stream, GLuint index, GLint size, size_t offset);
+void geompool_alloc(geompool_t *pool, const void *const *streams, size_t num_vertices, const GLuint *indices, size_t num_indices, geompool_range_t *range);
+void geompool_free(geompool_t *pool, const geompool_range_t *range);
+GLuint geompool_vao(geompool_t *pool, uint32_t stream);
+size_t geompool_allocations(geompool_t *pool);
+void geompool_stats(geompool_t *pool, geompool_stats_t *stats);
+void geompool_delete(geompool_t *pool);
+bool geompool_self_test(size_t count);
+
+#endif // __GEOMPOOL_H__
@@ -0,0 +1,39 @@
+#ifndef __GLSTATE_H__
+#define __GLSTATE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gl_core_4_1.h"
+
+// Texture units and indexed uniform buffer binding points whose bindings are shadowed. Binds past these always go through
+#define GLSTATE_MAX_TEXTURE_UNITS 16
+#define GLSTATE_MAX_BUFFER_BINDINGS 16
+
+// State changes since the last reset. Skipped calls are the ones that would have set what was already set
+typedef struct {
+  uint64_t submitted;
+  uint64_t skipped;
+} glstate_stats_t;
+
+void glstate_invalidate();
+void glstate_use_program(GLuint program);
+GLuint glstate_program();
+void glstate_bind_vertex_array(GLuint vao);
+void glstate_bind_buffer(GLenum target, GLuint buffer);
+void glstate_bind_buffer_base(GLenum target, GLuint index, GLuint buffer);
+void glstate_bind_buffer_range(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+void glstate_bind_texture(GLuint unit, GLenum target, GLuint texture);
+void glstate_set_capability(GLenum cap, bool enabled);
+void glstate_blend_func(GLenum sfactor, GLenum dfactor);
+void glstate_depth_func(GLenum func);
+void glstate_depth_mask(GLboolean flag);
+void glstate_color_mask(GLboolean flag);
+void glstate_polygon_mode(GLenum mode);
+void glstate_delete_buffers(GLsizei n, const GLuint *buffers);
+void glstate_delete_vertex_arrays(GLsizei n, const GLuint *vaos);
+void glstate_delete_textures(GLsizei n, const GLuint *textures);
+void glstate_stats(glstate_stats_t *stats);
+void glstate_reset_stats();
+
+#endif // __GLSTATE_H__
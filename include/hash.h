@@ -0,0 +1,12 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HASH_FNV1A_SEED 0xcbf29ce484222325ULL
+
+uint64_t hash_fnv1a(const void *data, size_t size, uint64_t seed);
+uint64_t hash_fnv1a_str(const char *str, uint64_t seed);
+
+#endif // __HASH_H__
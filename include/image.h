@@ -0,0 +1,30 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Enough levels for a 32768x32768 image
+#define IMAGE_MAX_LEVELS 16
+
+// A decoded image with its mip chain. Pixels are 8-bit sRGB encoded RGBA stored in R, G, B, A byte order
+typedef struct {
+  // Dimensions of the full resolution image (level 0)
+  uint32_t width;
+  uint32_t height;
+
+  // Number of valid mip levels, 1 if no mipmaps have been generated
+  uint32_t levels;
+
+  // Pixel data for each mip level, level 0 is the full resolution image
+  uint8_t *pixels[IMAGE_MAX_LEVELS];
+} image_t;
+
+bool image_load(image_t *img, const char *filename);
+uint32_t image_level_width(const image_t *img, uint32_t level);
+uint32_t image_level_height(const image_t *img, uint32_t level);
+uint32_t image_max_levels(uint32_t width, uint32_t height);
+void image_generate_mipmaps(image_t *img);
+void image_free(image_t *img);
+
+#endif // __IMAGE_H__
@@ -0,0 +1,45 @@
+#ifndef __LIGHTGRID_H__
+#define __LIGHTGRID_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gl_core_4_1.h"
+#include "mat.h"
+#include "threadpool.h"
+
+// The view frustum is split into tiles across the screen and exponentially growing slices in depth. Each of these
+// clusters gets the list of point lights that reach into it
+#define LIGHTGRID_TILES_X 16
+#define LIGHTGRID_TILES_Y 9
+#define LIGHTGRID_SLICES 24
+#define LIGHTGRID_CLUSTERS (LIGHTGRID_TILES_X*LIGHTGRID_TILES_Y*LIGHTGRID_SLICES)
+
+// A point light in model space. It does not light anything farther than radius away
+typedef struct {
+  GLfloat position[3];
+  GLfloat radius;
+  GLfloat color[3];
+} point_light_t;
+
+// Work done by the last lightgrid_update
+typedef struct {
+  uint32_t lights;
+  uint32_t visible;
+  uint32_t clusters;
+  uint32_t max_per_cluster;
+  uint64_t indices;
+  double bin_ms;
+} lightgrid_stats_t;
+
+typedef struct lightgrid lightgrid_t;
+
+lightgrid_t* lightgrid_create(const mat4_t *projection, GLfloat near, GLfloat far, GLint width, GLint height, threadpool_t *pool);
+void lightgrid_set_lights(lightgrid_t *grid, const point_light_t *lights, uint32_t count);
+void lightgrid_update(lightgrid_t *grid, const mat4_t *modelview);
+void lightgrid_bind(lightgrid_t *grid, GLuint first_unit);
+void lightgrid_params(lightgrid_t *grid, GLuint *dims, GLfloat *params);
+void lightgrid_stats(lightgrid_t *grid, lightgrid_stats_t *stats);
+void lightgrid_delete(lightgrid_t *grid);
+
+#endif // __LIGHTGRID_H__
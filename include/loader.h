@@ -0,0 +1,16 @@
+#ifndef __LOADER_H__
+#define __LOADER_H__
+
+#include <stdint.h>
+
+#include "mesh.h"
+#include "scene.h"
+#include "threadpool.h"
+
+// Loads the models listed in a scene file and places them in the scene, each as instances of its mesh. The models are
+// parsed and their textures decoded on the worker threads of pool while the calling thread, which owns the GL context,
+// uploads them as they come in. Models listed more than once are loaded once. Returns the num_meshes distinct meshes,
+// NULL if none could be loaded
+mesh_t* loader_load_scene(const char *filename, scene_t *scene, threadpool_t *pool, uint32_t *num_meshes);
+
+#endif // __LOADER_H__
@@ -3,18 +3,15 @@
 
 #include <stdbool.h>
 
-#include <SDL2/SDL_Surface.h>
-
 #include "gl_core_4_1.h"
 #include "array.h"
+#include "texture.h"
+#include "mat.h"
+#include "cull.h"
+#include "geompool.h"
 
-typedef struct {
-  // Handle to the texture unit
-  GLuint texID;
-
-  // True if texture is bound
-  GLuint use_texture;
-} texture_t;
+// First attribute location of the per-instance model matrix, a mat4 takes one location per column
+#define MESH_INSTANCE_ATTRIB 3
 
 typedef struct {
   GLfloat diffuse[3];
@@ -25,10 +22,30 @@ typedef struct {
   GLfloat shininess;
   GLfloat transparency;
 
-  // The texture data if needed
-  texture_t tex;
+  // The texture data if needed, shared with other materials using the same image
+  texture_t *tex;
+
+  // True if texture is bound
+  GLuint use_texture;
+
+  // Layer of the image in tex if tex is a texture array, -1 otherwise
+  GLint layer;
 } material_t;
 
+// A material as laid out in the MaterialBlock uniform block of the shaders (std140)
+typedef struct {
+  GLfloat diffuse[3];
+  GLfloat pad0;
+  GLfloat ambient[3];
+  GLfloat pad1;
+  GLfloat specular[3];
+  GLfloat shininess;
+  GLfloat transparency;
+  GLuint use_texture;
+  GLint layer;
+  GLfloat pad2;
+} material_block_t;
+
 // A group of faces using the same material
 typedef struct {
   // The material used for this group of faces
@@ -37,30 +54,80 @@ typedef struct {
   // The offset into the index list and the # of indices used by the material group
   GLuint offset;
   GLuint count;
+
+  // Bounding sphere and bounding box of the faces in model space
+  GLfloat center[3];
+  GLfloat radius;
+  GLfloat lo[3], hi[3];
+
+  // Offset of the group's material_block_t in the mesh's material buffer
+  GLintptr block_offset;
+
+  // Texture coordinate units per model space unit over the faces, how densely the texture is mapped onto them
+  GLfloat uv_density;
 } material_group_t;
 
 typedef struct {
-  // Handle to the OpenGL vertex array object
+  // The vertex array object of the shared geometry pool, the same for every mesh
   GLuint vao;
 
-  // Handle to the OpenGL vertex buffer object (vertex attribute data)
-  GLuint vbo;
-  
   // List of vertex attributes (position, texture, normals)
   array_t *vattributes;
 
-  // Handle to the OpenGL index buffer object
-  GLuint ibo;
+  // Where the vertices and indices of the mesh are in the geometry pool. The indices are drawn from
+  // geometry.first_index with geometry.first_vertex as the base vertex
+  geompool_range_t geometry;
+
+  // Position only VAO of the geometry pool for the depth pre-pass
+  GLuint depth_vao;
 
   // List of indices into the vertex attribute array
   array_t *indices;
 
+  // Handle to the uniform buffer holding the material of every group
+  GLuint mtl_ubo;
+
   // List of face groups
   array_t *mtl_grps;
   size_t num_faces;
+
+  // True if the file has vertex normals
+  bool has_normals;
+
+  // Bounding box of the whole mesh and of every group in model space, for frustum culling
+  GLfloat lo[3], hi[3];
+  cull_boxes_t group_boxes;
+
+  // The largest faces of the mesh as unindexed triangles, rasterized by the occlusion culling
+  GLfloat *occluder;
+  size_t occluder_triangles;
+
+  // Per-instance model matrices, every group is drawn once per instance. 0 instances if the mesh is not instanced.
+  // The shared VAO is pointed at the buffer when an instanced group of the mesh is drawn
+  GLuint instance_vbo;
+  uint32_t num_instances;
+
+  // Bounding sphere of the instance origins
+  GLfloat instance_center[3];
+  GLfloat instance_radius;
+
+  // CPU copy of the model matrices, the bounding box of the mesh placed by each of them, and the models of the visible
+  // instances packed together. num_uploaded_instances is how many models the instance buffer holds in order
+  mat4_t *instance_models;
+  cull_boxes_t instance_boxes;
+  mat4_t *visible_models;
+  uint32_t num_uploaded_instances;
 } mesh_t;
 
+void mesh_enable_atlas(bool enable);
+void mesh_enable_texture_arrays(bool enable);
 bool mesh_load(mesh_t *mesh, const char *objfile);
+bool mesh_parse(mesh_t *mesh, const char *objfile);
+void mesh_upload(mesh_t *mesh, const char *objfile);
+void mesh_set_instances(mesh_t *mesh, const mat4_t *models, uint32_t count);
+void mesh_update_instances(mesh_t *mesh, const uint32_t *instances, const mat4_t *models, uint32_t count);
+uint32_t mesh_upload_visible_instances(mesh_t *mesh, const uint8_t *visible, uint32_t num_visible);
+void mesh_geometry_stats(geompool_stats_t *stats);
 void mesh_bind(mesh_t *mesh);
 void mesh_unbind();
 void mesh_delete(mesh_t *mesh);
@@ -0,0 +1,38 @@
+#ifndef __OCCLUSION_H__
+#define __OCCLUSION_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gl_core_4_1.h"
+#include "mat.h"
+#include "cull.h"
+#include "threadpool.h"
+
+// Side of the square tiles of the depth buffer rasterized in parallel, a multiple of the 4 pixels done per SIMD iteration
+#define OCCLUSION_TILE_SIZE 16
+
+// Work done since the last occlusion_clear
+typedef struct {
+  uint64_t triangles;
+  uint64_t tested;
+  uint64_t occluded;
+  double raster_ms;
+  double test_ms;
+} occlusion_stats_t;
+
+// A low resolution depth buffer of occluders rasterized on the CPU
+typedef struct occlusion occlusion_t;
+
+occlusion_t* occlusion_create(uint32_t width, uint32_t height, threadpool_t *pool);
+void occlusion_clear(occlusion_t *occ);
+void occlusion_add_triangles(occlusion_t *occ, const mat4_t *mvp, const GLfloat *positions, size_t num_triangles);
+void occlusion_rasterize(occlusion_t *occ);
+bool occlusion_test_box(occlusion_t *occ, const mat4_t *mvp, const GLfloat *center, const GLfloat *extent);
+size_t occlusion_test_boxes(occlusion_t *occ, const mat4_t *mvp, const cull_boxes_t *boxes, uint8_t *visible);
+void occlusion_stats(occlusion_t *occ, occlusion_stats_t *stats);
+void occlusion_delete(occlusion_t *occ);
+bool occlusion_self_test(threadpool_t *pool);
+
+#endif // __OCCLUSION_H__
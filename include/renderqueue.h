@@ -0,0 +1,77 @@
+#ifndef __RENDERQUEUE_H__
+#define __RENDERQUEUE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gl_core_4_1.h"
+#include "shader.h"
+
+// Passes are drawn in this order. Opaque items are drawn with blending off and depth writes on, transparent ones are
+// blended with depth writes off
+typedef enum {
+  RENDERQUEUE_PASS_OPAQUE,
+  RENDERQUEUE_PASS_TRANSPARENT
+} renderqueue_pass_t;
+
+// Everything needed to draw a range of the indices of a mesh
+typedef struct {
+  renderqueue_pass_t pass;
+  shader_t program;
+  GLuint vao;
+
+  // Position only VAO for the depth pre-pass, 0 to use vao
+  GLuint depth_vao;
+
+  // 0 for untextured items
+  GLuint texture;
+  GLenum target;
+  GLuint unit;
+
+  // Range of the buffer bound to the material block binding point
+  GLuint ubo;
+  GLintptr ubo_offset;
+  GLsizeiptr ubo_size;
+
+  // Range of the index buffer of the VAO, the indices are relative to base_vertex
+  GLuint offset;
+  GLuint count;
+  GLint base_vertex;
+
+  // Number of instances drawn with glDrawElementsInstanced, 0 for a plain draw. The per-instance model matrices are
+  // read from instance_buffer
+  GLuint instances;
+  GLuint instance_buffer;
+
+  // Distance from the camera, opaque items are drawn front to back and transparent ones back to front
+  GLfloat depth;
+} renderqueue_item_t;
+
+// Work done by the last renderqueue_sort and renderqueue_draw
+typedef struct {
+  uint64_t items;
+  uint64_t transparent;
+  uint64_t draws;
+  uint64_t instances;
+  uint64_t prepass_draws;
+  uint32_t states;
+  uint32_t key_bits;
+  uint32_t sort_passes;
+  double sort_ms;
+} renderqueue_stats_t;
+
+typedef struct renderqueue renderqueue_t;
+
+renderqueue_t* renderqueue_create(GLuint material_binding);
+void renderqueue_set_depth_range(renderqueue_t *queue, GLfloat near, GLfloat far);
+void renderqueue_set_depth_prepass(renderqueue_t *queue, shader_t program, shader_t instanced_program);
+void renderqueue_clear(renderqueue_t *queue);
+void renderqueue_push(renderqueue_t *queue, const renderqueue_item_t *item);
+size_t renderqueue_size(renderqueue_t *queue);
+void renderqueue_sort(renderqueue_t *queue);
+void renderqueue_draw(renderqueue_t *queue);
+void renderqueue_stats(renderqueue_t *queue, renderqueue_stats_t *stats);
+void renderqueue_delete(renderqueue_t *queue);
+bool renderqueue_self_test(size_t count);
+
+#endif // __RENDERQUEUE_H__
@@ -0,0 +1,46 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gl_core_4_1.h"
+#include "mat.h"
+#include "mesh.h"
+
+typedef uint32_t scene_node_t;
+
+// Parent of the root nodes and instance of the nodes not drawing a particular instance of their mesh
+#define SCENE_NONE UINT32_MAX
+
+// Work done by the last scene_update
+typedef struct {
+  size_t nodes;
+  size_t updated;
+  size_t ranges;
+  double update_ms;
+} scene_stats_t;
+
+// A hierarchy of nodes, each with a transform relative to its parent and optionally a mesh or an instance of one. A
+// node can only be added under one that already exists, so parents always come before their children
+typedef struct scene scene_t;
+
+scene_t* scene_create(size_t capacity);
+scene_node_t scene_add_node(scene_t *scene, scene_node_t parent);
+size_t scene_size(scene_t *scene);
+scene_node_t scene_parent(scene_t *scene, scene_node_t node);
+void scene_set_translation(scene_t *scene, scene_node_t node, GLfloat x, GLfloat y, GLfloat z);
+void scene_set_rotation(scene_t *scene, scene_node_t node, GLfloat angle, GLfloat x, GLfloat y, GLfloat z);
+void scene_set_scale(scene_t *scene, scene_node_t node, GLfloat x, GLfloat y, GLfloat z);
+void scene_set_mesh(scene_t *scene, scene_node_t node, mesh_t *mesh, uint32_t instance);
+mesh_t* scene_mesh(scene_t *scene, scene_node_t node);
+uint32_t scene_instance(scene_t *scene, scene_node_t node);
+size_t scene_update(scene_t *scene);
+size_t scene_recomputed(scene_t *scene, const scene_node_t **nodes);
+void scene_world_matrix(scene_t *scene, scene_node_t node, mat4_t *mat);
+void scene_stats(scene_t *scene, scene_stats_t *stats);
+void scene_delete(scene_t *scene);
+bool scene_self_test(size_t count);
+
+#endif // __SCENE_H__
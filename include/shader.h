@@ -2,11 +2,31 @@
 #define __SHADER_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "gl_core_4_1.h"
 
+// Directory holding the linked program binaries
+#define SHADER_CACHE_DIR "cache"
+
+// Declarations shared by every shader, inserted after the #version line
+#define SHADER_COMMON_FILE "shaders/common.glsl"
+
 typedef GLuint shader_t;
 
+// Features a shader variant is specialized for. Each one is #defined in both stages of the variant
+typedef enum {
+  SHADER_FEATURE_TEXTURED = 1 << 0,
+  SHADER_FEATURE_TEXTURE_ARRAY = 1 << 1,
+  SHADER_FEATURE_HAS_NORMALS = 1 << 2,
+  SHADER_FEATURE_GAMMA = 1 << 3,
+  SHADER_FEATURE_INSTANCED = 1 << 4,
+  SHADER_FEATURE_CLUSTERED = 1 << 5
+} shader_feature_t;
+
+#define SHADER_NUM_FEATURES 6
+#define SHADER_NUM_VARIANTS (1 << SHADER_NUM_FEATURES)
+
 typedef enum {
   SHADER_UNIFORM_MAT4,
   SHADER_UNIFORM_VEC3,
@@ -15,9 +35,30 @@ typedef enum {
   SHADER_UNIFORM_INT
 } shader_uniform_type_t;
 
-shader_t shader_load(const char *vertfile, const char *fragfile);
+// Handle to a uniform of a linked program. SHADER_UNIFORM_NONE for uniforms the program does not have, setting those does nothing
+typedef uint32_t shader_uniform_t;
+#define SHADER_UNIFORM_NONE 0
+
+// Uniform traffic since the last reset. Without the location table and the CPU copies every set cost a glUseProgram,
+// a glGetUniformLocation and a glUniform call
+typedef struct {
+  uint64_t sets;
+  uint64_t uploads;
+  uint64_t program_binds;
+} shader_stats_t;
+
+// shader_submit hands a program to the driver without waiting for it to compile. It is not usable until shader_finish has
+// checked the result, shader_load does both
+shader_t shader_submit(const char *vertfile, const char *fragfile, uint32_t features);
+bool shader_finish(shader_t s_id);
+shader_t shader_load(const char *vertfile, const char *fragfile, uint32_t features);
 void shader_bind(shader_t s_id);
+void shader_bind_block(shader_t s_id, const char *block_name, GLuint binding);
+shader_uniform_t shader_uniform(shader_t s_id, const char *uniform_name);
+void shader_set(shader_uniform_t uniform, shader_uniform_type_t uniform_type, const void *data);
 void shader_set_uniform(shader_t s_id, const char *uniform_name, shader_uniform_type_t uniform_type, void *data);
+void shader_stats(shader_stats_t *stats);
+void shader_reset_stats();
 void shader_unbind();
 void shader_delete(shader_t s_id);
 
@@ -0,0 +1,126 @@
+#ifndef __TEXTURE_H__
+#define __TEXTURE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gl_core_4_1.h"
+#include "image.h"
+#include "bc.h"
+
+// Directory holding the block compressed versions of textures
+#define TEXTURE_CACHE_DIR "cache"
+
+// Streaming state of a texture whose finer levels are loaded on demand
+typedef struct texture_stream texture_stream_t;
+
+// Decoded levels of a texture waiting for the GL
+typedef struct texture_pending texture_pending_t;
+
+// A texture shared by every material that references the same image file
+typedef struct {
+  // Handle to the texture unit
+  GLuint texID;
+
+  // GL_TEXTURE_2D, or GL_TEXTURE_2D_ARRAY for textures holding several images of the same size as layers
+  GLenum target;
+  uint32_t layers;
+
+  // Dimensions and number of levels of the full mip chain
+  uint32_t width;
+  uint32_t height;
+  uint32_t levels;
+
+  // Finest level of the chain held by the GL texture, which stores it as its level 0 followed by the coarser ones
+  uint32_t first;
+
+  // Video memory used by the levels held by the GL texture
+  size_t bytes;
+
+  // NULL if the texture is always fully resident
+  texture_stream_t *stream;
+
+  // Canonical path of the image file, the key into the texture registry
+  char *path;
+
+  // Number of materials referencing the texture
+  uint32_t refs;
+
+  // Textures loaded from an image file can be evicted and loaded again, last_used is the frame that last drew them
+  bool reloadable;
+  uint64_t last_used;
+
+  // Set while a thread decodes the image, other threads acquiring it wait for that load. While uploads are deferred
+  // the decoded levels stay in pending until texture_flush_uploads
+  bool loading;
+  bool failed;
+  texture_pending_t *pending;
+} texture_t;
+
+// Counters for the pixel buffer object upload path
+typedef struct {
+  // Number of levels uploaded and their total size
+  uint64_t uploads;
+  uint64_t bytes;
+
+  // Staging batches, usually a whole texture each, whose transfer completed while the CPU kept working versus
+  // batches the CPU had to wait for before reusing their staging buffer
+  uint64_t overlapped;
+  uint64_t stalls;
+  double stall_ms;
+} texture_upload_stats_t;
+
+// Memory use of a texture, as reported by texture_memory
+typedef struct {
+  const char *path;
+  size_t bytes;
+
+  // Finest level in video memory, finest level needed by the last frame and number of levels in the chain
+  uint32_t resident;
+  uint32_t needed;
+  uint32_t levels;
+
+  bool streamed;
+} texture_memory_t;
+
+// Counters for the texture residency manager
+typedef struct {
+  // Uses of a texture that was resident versus one that had to be loaded again after an eviction
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+
+  // Time spent loading evicted textures again
+  double reload_ms;
+  double reload_max_ms;
+} texture_residency_stats_t;
+
+void texture_enable_compression(bool enable);
+void texture_enable_streaming(size_t budget);
+void texture_enable_residency(size_t budget);
+void texture_defer_uploads(bool defer);
+size_t texture_flush_uploads();
+texture_t* texture_acquire(const char *filename);
+texture_t* texture_create(const char *name, const image_t *img);
+texture_t* texture_create_array(const char *name, const image_t *images, uint32_t count);
+void texture_retain(texture_t *tex);
+void texture_release(texture_t *tex);
+bool texture_load(texture_t *tex, const char *filename);
+void texture_upload(texture_t *tex, const image_t *img);
+void texture_upload_compressed(texture_t *tex, const bc_image_t *bc);
+void texture_upload_array(texture_t *tex, const image_t *images, uint32_t count);
+void texture_upload_compressed_array(texture_t *tex, const bc_image_t *bcs, uint32_t count);
+void texture_delete(texture_t *tex);
+void texture_upload_stats(texture_upload_stats_t *stats);
+void texture_request(texture_t *tex, float uv_per_pixel);
+void texture_stream_update();
+void texture_use(texture_t *tex);
+void texture_residency_update();
+void texture_residency_stats(texture_residency_stats_t *stats);
+size_t texture_count();
+void texture_memory(uint64_t index, texture_memory_t *mem);
+void texture_memory_report();
+void texture_shutdown();
+
+#endif // __TEXTURE_H__
@@ -0,0 +1,19 @@
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <stdint.h>
+
+// A job function. index is the iteration index for parallel_for jobs and 0 for submitted jobs
+typedef void (*threadpool_func_t)(void *ctx, uint64_t index);
+
+typedef struct threadpool threadpool_t;
+
+threadpool_t* threadpool_create(uint32_t num_threads);
+threadpool_t* threadpool_default();
+uint32_t threadpool_size(threadpool_t *pool);
+void threadpool_submit(threadpool_t *pool, threadpool_func_t func, void *ctx);
+void threadpool_parallel_for(threadpool_t *pool, uint64_t count, threadpool_func_t func, void *ctx);
+void threadpool_wait(threadpool_t *pool);
+void threadpool_delete(threadpool_t *pool);
+
+#endif // __THREADPOOL_H__
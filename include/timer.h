@@ -0,0 +1,10 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+// Milliseconds in a number of SDL_GetPerformanceCounter ticks, and since a counter value
+double timer_ms(uint64_t ticks);
+double timer_elapsed_ms(uint64_t start);
+
+#endif // __TIMER_H__
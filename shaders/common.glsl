@@ -0,0 +1,122 @@
+// Declarations shared by all the shaders. shader_load inserts this file after the #version line, the stage define
+// (VERTEX_SHADER or FRAGMENT_SHADER) and the feature defines (TEXTURED, TEXTURE_ARRAY, HAS_NORMALS, GAMMA, INSTANCED,
+// CLUSTERED) of the variant being compiled
+
+struct LightSource {
+  vec3 position;
+  vec3 intensities;
+  vec3 gamma;
+  float attenuation;
+  float ambient_coefficient;
+};
+
+struct Material {
+  vec3 diffuse;
+  vec3 ambient;
+  vec3 specular;
+  float shininess;
+  float transparency;
+  bool use_texture;
+  int layer;
+};
+
+struct Camera {
+  vec3 position;
+};
+
+struct PointLight {
+  vec3 position;
+  float radius;
+  vec3 color;
+};
+
+// Per-frame values, shared by all the material groups (std140 layout, see frame_block_t)
+layout(std140) uniform FrameBlock {
+  mat4 modelviewprojection;
+  mat4 modelview;
+  mat4 normalmodelview;
+  LightSource light;
+
+  // Tiles across, tiles down and depth slices of the light clusters. Then the scale and bias turning the log of a
+  // distance from the camera into a slice, and the size of a tile in pixels
+  uvec4 cluster_dims;
+  vec4 cluster_params;
+};
+
+// Values of the material group being drawn, a range of the mesh's material buffer (std140 layout, see material_block_t)
+layout(std140) uniform MaterialBlock {
+  Material mtl;
+};
+
+// Texture arrays are bound to texture unit 1, 2D textures to unit 0
+#if defined(TEXTURE_ARRAY)
+uniform sampler2DArray tex_array;
+#elif defined(TEXTURED)
+uniform sampler2D tex;
+#endif
+
+// The unlit color of the surface at a texture coordinate
+vec4 material_color(vec2 uv)
+{
+#if defined(TEXTURE_ARRAY)
+  return texture(tex_array, vec3(uv, float(mtl.layer)));
+#elif defined(TEXTURED)
+  return texture(tex, uv);
+#else
+  return vec4(mtl.diffuse, 1.0);
+#endif
+}
+
+#if defined(FRAGMENT_SHADER) && defined(CLUSTERED)
+// Point lights in eye space, two texels each (position and radius, then color). The offset and count of the lights of
+// each cluster index into the light index list. Bound to texture units 2, 3 and 4
+uniform samplerBuffer light_data;
+uniform usamplerBuffer light_grid;
+uniform usamplerBuffer light_indices;
+
+// The range of the light index list holding the lights that reach the cluster of an eye space position on this pixel
+uvec2 cluster_lights(vec3 eye_position)
+{
+  float slice = log(-eye_position.z)*cluster_params.x+cluster_params.y;
+  uvec3 cluster = min(uvec3(uvec2(gl_FragCoord.xy/cluster_params.zw), uint(max(slice, 0.0))), cluster_dims.xyz-1u);
+  return texelFetch(light_grid, int(cluster.x+cluster_dims.x*(cluster.y+cluster_dims.y*cluster.z))).xy;
+}
+
+PointLight cluster_light(uint index)
+{
+  int light_index = int(texelFetch(light_indices, int(index)).x);
+  vec4 position_radius = texelFetch(light_data, 2*light_index);
+  return PointLight(position_radius.xyz, position_radius.w, texelFetch(light_data, 2*light_index+1).rgb);
+}
+#endif
+
+#ifdef VERTEX_SHADER
+#ifdef INSTANCED
+// Model matrix of the instance being drawn, advanced once per instance. Takes locations 3 to 6, see MESH_INSTANCE_ATTRIB
+layout(location = 3) in mat4 in_Model;
+#endif
+
+// A model space position, placed by the instance's model matrix in instanced variants
+vec4 model_position(vec3 position)
+{
+#ifdef INSTANCED
+  return in_Model*vec4(position, 1.0);
+#else
+  return vec4(position, 1.0);
+#endif
+}
+
+// A model space normal, turned by the instance's model matrix in instanced variants. The cofactor matrix is the inverse
+// transpose times the determinant, so it keeps normals square to unevenly scaled surfaces. Not normalized
+vec3 model_normal(vec3 normal)
+{
+#ifdef INSTANCED
+  mat3 model = mat3(in_Model);
+  mat3 cofactor = mat3(cross(model[1], model[2]), cross(model[2], model[0]), cross(model[0], model[1]));
+  // A mirroring matrix has a negative determinant, which would turn the normals inside out
+  return sign(dot(model[0], cofactor[0]))*(cofactor*normal);
+#else
+  return normal;
+#endif
+}
+#endif
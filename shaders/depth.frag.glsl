@@ -0,0 +1,7 @@
+#version 410 core
+
+// This shader only writes depth, for the depth pre-pass. Color writes are masked off
+
+void main()
+{
+}
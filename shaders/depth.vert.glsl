@@ -0,0 +1,13 @@
+#version 410 core
+
+// This shader only writes depth, for the depth pre-pass
+
+layout(location = 0) in vec3 in_Position;
+
+// Must match the position computed by the shading pass exactly
+invariant gl_Position;
+
+void main()
+{
+  gl_Position = modelviewprojection*model_position(in_Position);
+}
@@ -2,62 +2,44 @@
 
 // This shader computes diffuse lighting based on the Goraud per-vertex lighting model
 
-struct LightSource {
-  vec3 position;
-  vec3 intensities;
-  vec3 gamma;
-  float attenuation;
-  float ambient_coefficient;
-};
-
-struct Material {
-  vec3 diffuse;
-  vec3 ambient;
-  vec3 specular;
-  float shininess;
-  float transparency;
-  bool use_texture;
-};
-
-struct Camera {
-  vec3 position;
-};
-
-uniform mat4 modelviewprojection;
-uniform mat4 modelview;
-uniform mat4 normalmodelview;
-uniform LightSource light = LightSource(vec3(0.0, 0.0, 0.0), vec3(1.0, 1.0, 1.0), vec3(1.0, 1.0, 1.0), 0.005, 0.04);
-uniform Material mtl = Material(vec3(0.75, 0.75, 0.75), vec3(1.0, 1.0, 1.0), vec3(1.0, 1.0, 1.0), 80.0, 1.0, false);
 uniform Camera cam = Camera(vec3(0.0, 0.0, 0.0));
-uniform sampler2D tex;
 
 layout(location = 0) in vec3 in_Position;
 layout(location = 1) in vec3 in_TexCoord;
 layout(location = 2) in vec3 in_Normal; 
 
+// The depth pre-pass computes the same position, GL_EQUAL depth testing needs the results to match exactly
+invariant gl_Position;
+
 // The per-vertex color is interpolated over the pixels
 smooth out vec4 f_Color;
 
 void main()
 {
-  // transform normal in world coordinates
-  vec3 normal = normalize(mat3(normalmodelview)*in_Normal);
-
   // Calculate position of this vertex in world space
-  vec3 vert_pos = vec3(modelview * vec4(in_Position, 1));
+  vec3 vert_pos = vec3(modelview * model_position(in_Position));
 
-  // Determine whether use texture or diffuse material color
-  vec4 surface_color = (mtl.use_texture) ? texture(tex, vec2(in_TexCoord)) : vec4(mtl.diffuse, 1.0);
+  // Texture or diffuse material color, depending on the variant
+  vec4 surface_color = material_color(vec2(in_TexCoord));
 
   // Calculate vector from this vertex to light source
   vec3 vert_to_light = light.position - vert_pos;
   
+#ifdef HAS_NORMALS
+  // transform normal in world coordinates
+  vec3 normal = normalize(mat3(normalmodelview)*model_normal(in_Normal));
+
   // Calculate the angle of incidence brightness
   float brightness = max(0.0, dot(normal, normalize(vert_to_light)));
+#else
+  // Without normals there is no angle of incidence, the surface is lit evenly
+  float brightness = 1.0;
+#endif
 
   // Calculate the diffuse component
   vec3 diffuse = brightness * surface_color.rgb * light.intensities;
 
+#ifdef HAS_NORMALS
   // Calculate the angle of reflectance.
   // The surf_to_light needs to go in the opposite direction in order to represent the angle of incidence
   vec3 incidence = normalize(-vert_to_light);
@@ -65,6 +47,10 @@ void main()
   vec3 vert_to_cam = normalize(cam.position - vert_pos);
   float specular_brightness = max(0.0, dot(vert_to_cam, reflection));
   float specular_coefficient = (brightness > 0.0) ? pow(specular_brightness, mtl.shininess) : 0.0;
+#else
+  // No highlights without normals
+  float specular_coefficient = 0.0;
+#endif
 
   // Calculate the specular component
   vec3 specular = specular_coefficient * mtl.specular * light.intensities;
@@ -82,8 +68,12 @@ void main()
   // 4. The distance from light source (attenuation)
   // 5. Gamma correction (if needed)
   vec3 linear_color = max(ambient, attenuation * (diffuse + specular));
+#ifdef GAMMA
   f_Color = vec4(pow(linear_color, light.gamma), mtl.transparency);
+#else
+  f_Color = vec4(linear_color, mtl.transparency);
+#endif
 
-  gl_Position = modelviewprojection*vec4(in_Position, 1.0);
+  gl_Position = modelviewprojection*model_position(in_Position);
 }
 
@@ -2,33 +2,7 @@
 
 // This shader computes diffuse lighting based on the Phong per-pixel lighting model
 
-struct LightSource {
-  vec3 position;
-  vec3 intensities;
-  vec3 gamma;
-  float attenuation;
-  float ambient_coefficient;
-};
-
-struct Material {
-  vec3 diffuse;
-  vec3 ambient;
-  vec3 specular;
-  float shininess;
-  float transparency;
-  bool use_texture;
-};
-
-struct Camera {
-  vec3 position;
-};
-
-uniform mat4 modelview;
-uniform mat4 normalmodelview;
-uniform LightSource light = LightSource(vec3(0.0, 0.0, 0.0), vec3(1.0, 1.0, 1.0), vec3(1.0, 1.0, 1.0), 0.005, 0.04);
-uniform Material mtl = Material(vec3(0.75, 0.75, 0.75), vec3(1.0, 1.0, 1.0), vec3(1.0, 1.0, 1.0), 80.0, 1.0, false);
 uniform Camera cam = Camera(vec3(0.0, 0.0, 0.0));
-uniform sampler2D tex;
 
 // The normals and positions are interpolated for each pixel
 smooth in vec3 o_Position;
@@ -42,8 +16,8 @@ void main()
   // Calculate vector from this pixel's surface to light source
   vec3 surf_to_light = vec3(modelview*vec4(light.position, 1.0)) - o_Position;
 
-  // Determine whether use texture or diffuse material color
-  vec4 surface_color = (mtl.use_texture) ? texture(tex, vec2(o_TexCoord)) : vec4(mtl.diffuse, 1.0);
+  // Texture or diffuse material color, depending on the variant
+  vec4 surface_color = material_color(vec2(o_TexCoord));
   //if(mtl.use_texture) {
     //vec4 tex_color = texture(tex, vec2(o_TexCoord));
     //surface_color.rgb = (-surface_color.rgb - (1-tex_color.a)) * mtl.diffuse + tex_color.a * tex_color.rgb;
@@ -53,11 +27,17 @@ void main()
   // Calculate the cosine of the angle of incidence (brightness)
   // (no need to divide the dot product by the product of the lengths of the vectors since they have been normalized)
   // Brightness must be clamped between 0 and 1 (anything less than 0 means 0 brightness)
+#ifdef HAS_NORMALS
   float brightness = max(0.0, dot(o_Normal, normalize(surf_to_light)));
+#else
+  // Without normals there is no angle of incidence, the surface is lit evenly
+  float brightness = 1.0;
+#endif
 
   // Calculate the diffuse component
   vec3 diffuse = brightness * surface_color.rgb * light.intensities;
 
+#ifdef HAS_NORMALS
   // Calculate the angle of reflectance.
   // The surf_to_light needs to go in the opposite direction in order to represent the angle of incidence
   vec3 incidence = normalize(-surf_to_light);
@@ -65,6 +45,10 @@ void main()
   vec3 surf_to_cam = normalize(cam.position - o_Position);
   float specular_brightness = max(0.0, dot(surf_to_cam, reflection));
   float specular_coefficient = (brightness > 0.0) ? pow(specular_brightness, mtl.shininess) : 0.0;
+#else
+  // No highlights without normals
+  float specular_coefficient = 0.0;
+#endif
 
   // Calculate the specular component
   vec3 specular = specular_coefficient * mtl.specular * light.intensities;
@@ -82,6 +66,25 @@ void main()
   // 4. The distance from the light source (attenuation)
   // 5. Gamma correction (if needed)
   vec3 linear_color = (ambient + attenuation * (diffuse + specular));
+
+#ifdef CLUSTERED
+  // Add the point lights reaching into this pixel's cluster. They fade out to nothing at their radius
+  uvec2 lights = cluster_lights(o_Position);
+  for(uint i = lights.x; i < lights.x + lights.y; i++) {
+    PointLight point = cluster_light(i);
+    vec3 to_light = point.position - o_Position;
+    float falloff = clamp(1.0 - dot(to_light, to_light) / (point.radius * point.radius), 0.0, 1.0);
+#ifdef HAS_NORMALS
+    vec3 to_light_dir = normalize(to_light);
+    float point_brightness = max(0.0, dot(o_Normal, to_light_dir));
+    float point_specular = (point_brightness > 0.0) ? pow(max(0.0, dot(normalize(cam.position - o_Position), reflect(-to_light_dir, o_Normal))), mtl.shininess) : 0.0;
+#else
+    float point_brightness = 1.0;
+    float point_specular = 0.0;
+#endif
+    linear_color += falloff * falloff * (point_brightness * surface_color.rgb + point_specular * mtl.specular) * point.color;
+  }
+#endif
   //f_Color = vec4(pow(linear_color, light.gamma), mtl.transparency);
   f_Color = vec4(linear_color, mtl.transparency);
 }
@@ -2,12 +2,13 @@
 
 // This shader colors the model uniformly, no lighting
 
-uniform mat4 modelviewprojection;
-
 layout(location = 0) in vec3 in_Position;
 
+// The depth pre-pass computes the same position, GL_EQUAL depth testing needs the results to match exactly
+invariant gl_Position;
+
 void main()
 {
-  gl_Position = modelviewprojection*vec4(in_Position, 1);
+  gl_Position = modelviewprojection*model_position(in_Position);
 }
 
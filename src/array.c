@@ -86,6 +86,14 @@ void array_set(array_t *a, uint64_t index, void *datum) {
   memcpy((char*)a->data+(a->elem_size*index), datum, a->elem_size);
 }
 
+void array_pop(array_t *a) {
+  assert(a != NULL && a->size > 0);
+
+  // Clear the removed element so the unused capacity stays zeroed
+  a->size--;
+  memset((char*)a->data+(a->elem_size*a->size), 0, a->elem_size);
+}
+
 const void* array_data(array_t *a) {
   assert(a != NULL);
   return a->data;
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "atlas.h"
+#include "array.h"
+
+// A horizontal segment of the skyline, the top edge of everything packed below it
+typedef struct {
+  uint32_t x, y;
+  uint32_t width;
+} atlas_skyline_t;
+
+// Returns the lowest y a rect of the given size can sit at if placed at the start of node i, or UINT32_MAX if it does not fit
+uint32_t _atlas_fit(array_t *skyline, uint64_t i, uint32_t width, uint32_t height, uint32_t atlas_width, uint32_t atlas_height) {
+  atlas_skyline_t *node = (atlas_skyline_t*)array_at(skyline, i);
+  if(node->x+width > atlas_width) return UINT32_MAX;
+
+  // The rect rests on the highest of the nodes it spans
+  uint32_t y = 0, remaining = width;
+  for(; i < array_size(skyline) && remaining > 0; i++) {
+    node = (atlas_skyline_t*)array_at(skyline, i);
+    if(node->y > y) y = node->y;
+    remaining = (node->width < remaining) ? remaining-node->width : 0;
+  }
+
+  return (y+height <= atlas_height) ? y : UINT32_MAX;
+}
+
+// Raise the skyline over the rect placed at (x, y)
+void _atlas_place(array_t *skyline, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+  array_t *next = array_create(array_size(skyline)+2, sizeof(atlas_skyline_t));
+  atlas_skyline_t placed = {x, y+height, width};
+  bool inserted = false;
+
+  for(uint64_t i = 0; i < array_size(skyline); i++) {
+    atlas_skyline_t node = *((atlas_skyline_t*)array_at(skyline, i));
+    uint32_t end = node.x+node.width;
+
+    // Keep the part of the node left of the rect
+    if(node.x < x) {
+      atlas_skyline_t left = {node.x, node.y, ((end < x) ? end : x)-node.x};
+      array_append(next, &left);
+    }
+
+    if(!inserted && end > x) {
+      array_append(next, &placed);
+      inserted = true;
+    }
+
+    // Keep the part of the node right of the rect
+    if(end > x+width) {
+      uint32_t start = (node.x > x+width) ? node.x : x+width;
+      atlas_skyline_t right = {start, node.y, end-start};
+      array_append(next, &right);
+    }
+  }
+
+  // Merge neighbouring nodes at the same height
+  array_clear(skyline);
+  for(uint64_t i = 0; i < array_size(next); i++) {
+    atlas_skyline_t *node = (atlas_skyline_t*)array_at(next, i);
+    if(array_size(skyline) > 0) {
+      atlas_skyline_t *last = (atlas_skyline_t*)array_back(skyline);
+      if(last->y == node->y) {
+        last->width += node->width;
+        continue;
+      }
+    }
+    array_append(skyline, node);
+  }
+
+  array_delete(next);
+}
+
+bool atlas_pack(atlas_rect_t *rects, size_t count, uint32_t width, uint32_t height, uint32_t padding) {
+  // Place the tallest rects first, which keeps the skyline flat
+  size_t *order = (size_t*)malloc(sizeof(size_t)*(count+1));
+  for(size_t i = 0; i < count; i++) order[i] = i;
+  for(size_t i = 1; i < count; i++) {
+    size_t j = i, k = order[i];
+    for(; j > 0 && rects[order[j-1]].height < rects[k].height; j--) order[j] = order[j-1];
+    order[j] = k;
+  }
+
+  array_t *skyline = array_create(16, sizeof(atlas_skyline_t));
+  atlas_skyline_t root = {0, 0, width};
+  array_append(skyline, &root);
+
+  bool packed = true;
+  for(size_t r = 0; r < count && packed; r++) {
+    atlas_rect_t *rect = &rects[order[r]];
+    uint32_t w = rect->width+2*padding, h = rect->height+2*padding;
+
+    // Bottom-left heuristic: the lowest position, ties go to the leftmost one
+    uint32_t best_y = UINT32_MAX, best_x = 0;
+    for(uint64_t i = 0; i < array_size(skyline); i++) {
+      uint32_t y = _atlas_fit(skyline, i, w, h, width, height);
+      if(y < best_y) {
+        best_y = y;
+        best_x = ((atlas_skyline_t*)array_at(skyline, i))->x;
+      }
+    }
+
+    if(best_y == UINT32_MAX) {
+      packed = false;
+      break;
+    }
+
+    _atlas_place(skyline, best_x, best_y, w, h);
+    rect->x = best_x+padding;
+    rect->y = best_y+padding;
+  }
+
+  array_delete(skyline);
+  free(order);
+
+  return packed;
+}
+
+void atlas_blit(image_t *atlas, const image_t *src, const atlas_rect_t *rect, uint32_t padding) {
+  // Copy the image and extend its edge pixels into the padding so filtering and mipmapping near the border
+  // does not pick up the neighbouring images
+  for(uint32_t y = 0; y < rect->height+2*padding; y++) {
+    uint32_t sy = (y < padding) ? 0 : ((y-padding < src->height) ? y-padding : src->height-1);
+    uint8_t *dst = atlas->pixels[0]+((size_t)(rect->y-padding+y)*atlas->width+rect->x-padding)*4;
+    const uint8_t *row = src->pixels[0]+(size_t)sy*src->width*4;
+
+    for(uint32_t x = 0; x < padding; x++) memcpy(dst+x*4, row, 4);
+    memcpy(dst+padding*4, row, (size_t)src->width*4);
+    for(uint32_t x = 0; x < padding; x++) memcpy(dst+(padding+src->width+x)*4, row+(size_t)(src->width-1)*4, 4);
+  }
+}
@@ -0,0 +1,525 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include "bc.h"
+#include "timer.h"
+
+// "BCT1" in little endian
+#define BC_FILE_MAGIC 0x31544342u
+
+// The header of a block compressed image file, followed by the blocks of each level
+typedef struct {
+  uint32_t magic;
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t levels;
+  uint32_t reserved;
+
+  // Caller defined key identifying the source the blocks were encoded from
+  uint64_t key;
+} bc_file_header_t;
+
+// Everything a worker needs to encode a row of blocks of one mip level
+typedef struct {
+  const uint8_t *pixels;
+  uint32_t width;
+  uint32_t height;
+  uint32_t blocks_x;
+  bc_format_t format;
+  uint8_t *out;
+} bc_encode_job_t;
+
+uint32_t _bc_level_dim(uint32_t dim, uint32_t level) {
+  dim >>= level;
+  return (dim > 0) ? dim : 1;
+}
+
+// Copy a 4x4 block out of the image, repeating the edge pixels for blocks that overhang it
+void _bc_fetch_block(const uint8_t *pixels, uint32_t width, uint32_t height, uint32_t bx, uint32_t by, uint8_t *block) {
+  for(uint32_t y = 0; y < 4; y++) {
+    uint32_t sy = (by*4+y < height) ? by*4+y : height-1;
+    for(uint32_t x = 0; x < 4; x++) {
+      uint32_t sx = (bx*4+x < width) ? bx*4+x : width-1;
+      memcpy(block+(y*4+x)*4, pixels+((size_t)sy*width+sx)*4, 4);
+    }
+  }
+}
+
+uint16_t _bc_pack565(const uint8_t *c) {
+  return (uint16_t)(((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3));
+}
+
+void _bc_unpack565(uint16_t v, uint8_t *c) {
+  uint8_t r = (uint8_t)((v >> 11) & 0x1f), g = (uint8_t)((v >> 5) & 0x3f), b = (uint8_t)(v & 0x1f);
+  c[0] = (uint8_t)((r << 3) | (r >> 2));
+  c[1] = (uint8_t)((g << 2) | (g >> 4));
+  c[2] = (uint8_t)((b << 3) | (b >> 2));
+  c[3] = 255;
+}
+
+// Per channel minimum and maximum of the 16 pixels in the block
+void _bc_block_bounds(const uint8_t *block, uint8_t *mn, uint8_t *mx) {
+#ifdef __SSE2__
+  __m128i p0 = _mm_loadu_si128((const __m128i*)(const void*)(block+0));
+  __m128i p1 = _mm_loadu_si128((const __m128i*)(const void*)(block+16));
+  __m128i p2 = _mm_loadu_si128((const __m128i*)(const void*)(block+32));
+  __m128i p3 = _mm_loadu_si128((const __m128i*)(const void*)(block+48));
+  __m128i lo = _mm_min_epu8(_mm_min_epu8(p0, p1), _mm_min_epu8(p2, p3));
+  __m128i hi = _mm_max_epu8(_mm_max_epu8(p0, p1), _mm_max_epu8(p2, p3));
+
+  // Reduce the four pixels left in each register down to one
+  lo = _mm_min_epu8(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+  lo = _mm_min_epu8(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+  hi = _mm_max_epu8(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+  hi = _mm_max_epu8(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+
+  int32_t l = _mm_cvtsi128_si32(lo), h = _mm_cvtsi128_si32(hi);
+  memcpy(mn, &l, 4);
+  memcpy(mx, &h, 4);
+#else
+  memcpy(mn, block, 4);
+  memcpy(mx, block, 4);
+  for(uint32_t i = 1; i < 16; i++) {
+    for(uint32_t c = 0; c < 4; c++) {
+      uint8_t v = block[i*4+c];
+      if(v < mn[c]) mn[c] = v;
+      if(v > mx[c]) mx[c] = v;
+    }
+  }
+#endif
+}
+
+// Picks the closest palette entry for each pixel by the sum of absolute differences of R, G and B
+// Returns the indices packed 2 bits per pixel
+uint32_t _bc_color_indices(const uint8_t *block, uint8_t palette[4][4]) {
+  uint32_t indices = 0;
+
+#ifdef __SSE2__
+  const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i zero = _mm_setzero_si128();
+
+  __m128i pal[4];
+  for(uint32_t i = 0; i < 4; i++) {
+    int32_t c;
+    memcpy(&c, palette[i], 4);
+    pal[i] = _mm_and_si128(_mm_set1_epi32(c), rgb_mask);
+  }
+
+  // One row of four pixels per iteration
+  for(uint32_t row = 0; row < 4; row++) {
+    __m128i px = _mm_and_si128(_mm_loadu_si128((const __m128i*)(const void*)(block+row*16)), rgb_mask);
+    __m128i best = _mm_set1_epi32(0x7fffffff), best_index = zero;
+
+    for(uint32_t i = 0; i < 4; i++) {
+      __m128i d = _mm_or_si128(_mm_subs_epu8(px, pal[i]), _mm_subs_epu8(pal[i], px));
+
+      // Widen to 16 bits and add the channels pairwise, then add the pairs of each pixel
+      __m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(d, zero), ones));
+      __m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(d, zero), ones));
+      __m128i dist = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))), _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1))));
+
+      __m128i closer = _mm_cmplt_epi32(dist, best);
+      best = _mm_or_si128(_mm_and_si128(closer, dist), _mm_andnot_si128(closer, best));
+      best_index = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32((int32_t)i)), _mm_andnot_si128(closer, best_index));
+    }
+
+    int32_t idx[4];
+    _mm_storeu_si128((__m128i*)(void*)idx, best_index);
+    for(uint32_t x = 0; x < 4; x++) indices |= (uint32_t)idx[x] << (2*(row*4+x));
+  }
+#else
+  for(uint32_t i = 0; i < 16; i++) {
+    uint32_t best = UINT32_MAX, best_index = 0;
+    for(uint32_t p = 0; p < 4; p++) {
+      uint32_t dist = 0;
+      for(uint32_t c = 0; c < 3; c++) dist += (uint32_t)abs(block[i*4+c]-palette[p][c]);
+      if(dist < best) best = dist, best_index = p;
+    }
+    indices |= best_index << (2*i);
+  }
+#endif
+
+  return indices;
+}
+
+// Encodes the colour of a block as two 565 endpoints and 2-bit indices
+void _bc_encode_color(const uint8_t *block, uint8_t *out) {
+  uint8_t mn[4], mx[4];
+  _bc_block_bounds(block, mn, mx);
+
+  // Inset the bounding box by 1/16th of its extent, which reduces the error introduced by the endpoint quantization
+  for(uint32_t c = 0; c < 3; c++) {
+    uint8_t inset = (uint8_t)((mx[c]-mn[c]) >> 4);
+    mn[c] = (uint8_t)(mn[c]+inset);
+    mx[c] = (uint8_t)(mx[c]-inset);
+  }
+
+  // Since max >= min in every channel, c0 >= c1 which selects the 4 colour mode unless the block is a single colour
+  uint16_t c0 = _bc_pack565(mx), c1 = _bc_pack565(mn);
+  uint32_t indices = 0;
+
+  if(c0 != c1) {
+    uint8_t palette[4][4];
+    _bc_unpack565(c0, palette[0]);
+    _bc_unpack565(c1, palette[1]);
+    for(uint32_t c = 0; c < 4; c++) {
+      palette[2][c] = (uint8_t)((2*palette[0][c]+palette[1][c])/3);
+      palette[3][c] = (uint8_t)((palette[0][c]+2*palette[1][c])/3);
+    }
+    indices = _bc_color_indices(block, palette);
+  }
+
+  out[0] = (uint8_t)(c0 & 0xff), out[1] = (uint8_t)(c0 >> 8);
+  out[2] = (uint8_t)(c1 & 0xff), out[3] = (uint8_t)(c1 >> 8);
+  for(uint32_t i = 0; i < 4; i++) out[4+i] = (uint8_t)(indices >> (8*i));
+}
+
+// Encodes the alpha of a block as two 8-bit endpoints and 3-bit indices using the 8 value interpolation mode
+void _bc_encode_alpha(const uint8_t *block, uint8_t *out) {
+  uint8_t amin = 255, amax = 0;
+  for(uint32_t i = 0; i < 16; i++) {
+    if(block[i*4+3] < amin) amin = block[i*4+3];
+    if(block[i*4+3] > amax) amax = block[i*4+3];
+  }
+
+  uint64_t bits = 0;
+  if(amax > amin) {
+    uint32_t range = (uint32_t)(amax-amin);
+    for(uint32_t i = 0; i < 16; i++) {
+      // Distance from amax in sevenths of the range. Code 0 is amax, code 1 is amin and codes 2-7 are the interpolants
+      uint32_t t = ((uint32_t)(amax-block[i*4+3])*7+range/2)/range;
+      uint64_t code = (t == 0) ? 0 : ((t == 7) ? 1 : t+1);
+      bits |= code << (3*i);
+    }
+  }
+
+  out[0] = amax, out[1] = amin;
+  for(uint32_t i = 0; i < 6; i++) out[2+i] = (uint8_t)(bits >> (8*i));
+}
+
+void _bc_encode_row(void *ctx, uint64_t by) {
+  bc_encode_job_t *job = (bc_encode_job_t*)ctx;
+  size_t block_size = bc_block_size(job->format);
+  uint8_t *out = job->out+by*job->blocks_x*block_size;
+  uint8_t block[64];
+
+  for(uint32_t bx = 0; bx < job->blocks_x; bx++, out += block_size) {
+    _bc_fetch_block(job->pixels, job->width, job->height, bx, (uint32_t)by, block);
+
+    if(job->format == BC_FORMAT_BC3) {
+      _bc_encode_alpha(block, out);
+      _bc_encode_color(block, out+8);
+    } else {
+      _bc_encode_color(block, out);
+    }
+  }
+}
+
+size_t bc_block_size(bc_format_t format) {
+  return (format == BC_FORMAT_BC1) ? 8 : 16;
+}
+
+size_t bc_level_size(bc_format_t format, uint32_t width, uint32_t height) {
+  return (size_t)((width+3)/4)*((height+3)/4)*bc_block_size(format);
+}
+
+bool bc_image_has_alpha(const image_t *img) {
+  size_t count = (size_t)img->width*img->height;
+  for(size_t i = 0; i < count; i++) {
+    if(img->pixels[0][i*4+3] != 255) return true;
+  }
+  return false;
+}
+
+void bc_encode(bc_image_t *bc, const image_t *img, bc_format_t format, threadpool_t *pool) {
+  memset(bc, 0, sizeof(bc_image_t));
+  bc->format = format;
+  bc->width = img->width;
+  bc->height = img->height;
+  bc->levels = img->levels;
+
+  // Each level is split into rows of blocks which are encoded in parallel
+  for(uint32_t level = 0; level < img->levels; level++) {
+    uint32_t width = image_level_width(img, level), height = image_level_height(img, level);
+
+    bc->size[level] = bc_level_size(format, width, height);
+    bc->data[level] = (uint8_t*)malloc(bc->size[level]);
+
+    bc_encode_job_t job = {img->pixels[level], width, height, (width+3)/4, format, bc->data[level]};
+    threadpool_parallel_for(pool, (height+3)/4, _bc_encode_row, &job);
+  }
+}
+
+void bc_decode_block(bc_format_t format, const uint8_t *block, uint8_t *pixels) {
+  const uint8_t *color = block;
+  uint8_t alpha[16];
+  memset(alpha, 255, sizeof(alpha));
+
+  if(format == BC_FORMAT_BC3) {
+    // Rebuild the alpha palette for either interpolation mode
+    uint8_t a[8] = {block[0], block[1], 0, 0, 0, 0, 0, 255};
+    if(a[0] > a[1]) {
+      for(uint32_t k = 2; k < 8; k++) a[k] = (uint8_t)(((8-k)*a[0]+(k-1)*a[1])/7);
+    } else {
+      for(uint32_t k = 2; k < 6; k++) a[k] = (uint8_t)(((6-k)*a[0]+(k-1)*a[1])/5);
+    }
+
+    uint64_t bits = 0;
+    for(uint32_t i = 0; i < 6; i++) bits |= (uint64_t)block[2+i] << (8*i);
+    for(uint32_t i = 0; i < 16; i++) alpha[i] = a[(bits >> (3*i)) & 7];
+
+    color = block+8;
+  }
+
+  uint16_t c0 = (uint16_t)(color[0] | (color[1] << 8)), c1 = (uint16_t)(color[2] | (color[3] << 8));
+  uint8_t palette[4][4];
+  _bc_unpack565(c0, palette[0]);
+  _bc_unpack565(c1, palette[1]);
+
+  // BC1 uses the 3 colour + transparent black mode when c0 <= c1, BC3 always uses 4 colours
+  if(c0 > c1 || format == BC_FORMAT_BC3) {
+    for(uint32_t c = 0; c < 4; c++) {
+      palette[2][c] = (uint8_t)((2*palette[0][c]+palette[1][c])/3);
+      palette[3][c] = (uint8_t)((palette[0][c]+2*palette[1][c])/3);
+    }
+  } else {
+    for(uint32_t c = 0; c < 4; c++) {
+      palette[2][c] = (uint8_t)((palette[0][c]+palette[1][c])/2);
+      palette[3][c] = 0;
+    }
+  }
+
+  uint32_t indices = (uint32_t)color[4] | ((uint32_t)color[5] << 8) | ((uint32_t)color[6] << 16) | ((uint32_t)color[7] << 24);
+  for(uint32_t i = 0; i < 16; i++) {
+    memcpy(pixels+i*4, palette[(indices >> (2*i)) & 3], 4);
+    if(format == BC_FORMAT_BC3) pixels[i*4+3] = alpha[i];
+  }
+}
+
+float bc_psnr(const bc_image_t *bc, const image_t *img, uint32_t level) {
+  uint32_t width = image_level_width(img, level), height = image_level_height(img, level);
+  uint32_t blocks_x = (width+3)/4, blocks_y = (height+3)/4;
+  uint32_t channels = (bc->format == BC_FORMAT_BC1) ? 3 : 4;
+  size_t block_size = bc_block_size(bc->format);
+
+  // Sum of squared errors over every pixel covered by the image
+  double sse = 0.0;
+  uint8_t decoded[64];
+  for(uint32_t by = 0; by < blocks_y; by++) {
+    for(uint32_t bx = 0; bx < blocks_x; bx++) {
+      bc_decode_block(bc->format, bc->data[level]+((size_t)by*blocks_x+bx)*block_size, decoded);
+
+      for(uint32_t y = 0; y < 4 && by*4+y < height; y++) {
+        for(uint32_t x = 0; x < 4 && bx*4+x < width; x++) {
+          const uint8_t *src = img->pixels[level]+((size_t)(by*4+y)*width+bx*4+x)*4;
+          for(uint32_t c = 0; c < channels; c++) {
+            double d = (double)src[c]-(double)decoded[(y*4+x)*4+c];
+            sse += d*d;
+          }
+        }
+      }
+    }
+  }
+
+  double mse = sse/((double)width*height*channels);
+  if(mse <= 0.0) return INFINITY;
+
+  return (float)(10.0*log10(255.0*255.0/mse));
+}
+
+bool bc_write(const bc_image_t *bc, const char *filename, uint64_t key) {
+  FILE *f = fopen(filename, "wb");
+
+  // Make sure the file was opened
+  if(f == NULL) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not open file: %s\n", filename);
+    return false;
+  }
+
+  bc_file_header_t header = {BC_FILE_MAGIC, (uint32_t)bc->format, bc->width, bc->height, bc->levels, 0, key};
+  bool ok = (fwrite(&header, sizeof(bc_file_header_t), 1, f) == 1);
+  for(uint32_t level = 0; ok && level < bc->levels; level++) {
+    ok = (fwrite(bc->data[level], bc->size[level], 1, f) == 1);
+  }
+
+  fclose(f);
+
+  if(!ok) SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not write file: %s\n", filename);
+
+  return ok;
+}
+
+// Opens the cache file and validates its header, returns NULL if the file is missing, stale or corrupt
+FILE* _bc_open(bc_image_t *bc, const char *filename, uint64_t key) {
+  memset(bc, 0, sizeof(bc_image_t));
+
+  // A missing file is not an error, the caller just has to encode the image
+  FILE *f = fopen(filename, "rb");
+  if(f == NULL) return NULL;
+
+  // Reject files from another version of the source image or that are corrupt
+  bc_file_header_t header;
+  if(fread(&header, sizeof(bc_file_header_t), 1, f) != 1 || header.magic != BC_FILE_MAGIC || header.key != key ||
+     header.format > BC_FORMAT_BC3 || header.levels == 0 || header.levels > IMAGE_MAX_LEVELS) {
+    fclose(f);
+    return NULL;
+  }
+
+  bc->format = (bc_format_t)header.format;
+  bc->width = header.width;
+  bc->height = header.height;
+  bc->levels = header.levels;
+
+  for(uint32_t level = 0; level < bc->levels; level++) {
+    bc->size[level] = bc_level_size(bc->format, _bc_level_dim(bc->width, level), _bc_level_dim(bc->height, level));
+  }
+
+  return f;
+}
+
+bool bc_read_info(bc_image_t *bc, const char *filename, uint64_t key) {
+  FILE *f = _bc_open(bc, filename, key);
+  if(f == NULL) return false;
+
+  fclose(f);
+
+  return true;
+}
+
+bool bc_read_levels(bc_image_t *bc, const char *filename, uint64_t key, uint32_t first, uint32_t end) {
+  FILE *f = _bc_open(bc, filename, key);
+  if(f == NULL) return false;
+
+  // At least one level is read, an end past the chain reads down to the coarsest level
+  if(first >= bc->levels) first = bc->levels-1;
+  if(end > bc->levels) end = bc->levels;
+  if(end <= first) end = first+1;
+
+  // Skip over the finer levels, they stay NULL
+  long skip = 0;
+  for(uint32_t level = 0; level < first; level++) skip += (long)bc->size[level];
+
+  bool ok = (fseek(f, skip, SEEK_CUR) == 0);
+  for(uint32_t level = first; ok && level < end; level++) {
+    bc->data[level] = (uint8_t*)malloc(bc->size[level]);
+    ok = (fread(bc->data[level], bc->size[level], 1, f) == 1);
+  }
+
+  fclose(f);
+
+  if(!ok) bc_free(bc);
+
+  return ok;
+}
+
+// Reads the blocks of the levels from first down to the coarsest one back to back into dst, which holds the sum of
+// their sizes as given by bc_read_info. For callers that already have the destination memory, like a mapped buffer
+bool bc_read_blocks(const char *filename, uint64_t key, uint32_t first, uint8_t *dst) {
+  bc_image_t bc;
+  FILE *f = _bc_open(&bc, filename, key);
+  if(f == NULL) return false;
+
+  if(first >= bc.levels) first = bc.levels-1;
+
+  long skip = 0;
+  for(uint32_t level = 0; level < first; level++) skip += (long)bc.size[level];
+
+  bool ok = (fseek(f, skip, SEEK_CUR) == 0);
+  for(uint32_t level = first; ok && level < bc.levels; level++) {
+    ok = (fread(dst, bc.size[level], 1, f) == 1);
+    dst += bc.size[level];
+  }
+
+  fclose(f);
+
+  return ok;
+}
+
+bool bc_read(bc_image_t *bc, const char *filename, uint64_t key) {
+  return bc_read_levels(bc, filename, key, 0, IMAGE_MAX_LEVELS);
+}
+
+void bc_free(bc_image_t *bc) {
+  for(uint32_t level = 0; level < bc->levels; level++) free(bc->data[level]);
+  memset(bc, 0, sizeof(bc_image_t));
+}
+
+// Synthetic test images: the pixel at x, y of each kind
+void _bc_test_pixel(uint32_t kind, uint32_t x, uint32_t y, uint32_t size, uint8_t *p) {
+  uint32_t fx = x*255/(size-1), fy = y*255/(size-1);
+  switch(kind) {
+  case 0:
+    // A single colour that 565 holds exactly
+    p[0] = 255, p[1] = 0, p[2] = 0, p[3] = 255;
+    break;
+  case 1:
+    // Smooth gradients, the usual content of a texture
+    p[0] = (uint8_t)fx, p[1] = (uint8_t)fy, p[2] = (uint8_t)((fx+fy)/2), p[3] = 255;
+    break;
+  case 2:
+    // The same gradients under a gradient of alpha
+    p[0] = (uint8_t)fx, p[1] = (uint8_t)fy, p[2] = (uint8_t)((fx+fy)/2), p[3] = (uint8_t)(255-fx);
+    break;
+  default:
+    // Noise, the worst case for 4x4 endpoint pairs
+    p[0] = (uint8_t)rand(), p[1] = (uint8_t)rand(), p[2] = (uint8_t)rand(), p[3] = 255;
+    break;
+  }
+}
+
+// Encodes synthetic images of size x size pixels with their mip chains, prints the quality of the top level and the
+// encoder throughput, and checks the format picked and the quality against what each kind of image should reach
+bool bc_self_test(uint32_t size, threadpool_t *pool) {
+  const char *names[4] = {"solid", "gradient", "alpha gradient", "noise"};
+  const float min_psnr[4] = {INFINITY, 30.0f, 30.0f, 10.0f};
+  const bc_format_t formats[4] = {BC_FORMAT_BC1, BC_FORMAT_BC1, BC_FORMAT_BC3, BC_FORMAT_BC1};
+  // The gradient thresholds assume neighbouring pixels differ by about one step, as in a real texture
+  if(size < 256) size = 256;
+
+  bool ok = true;
+  srand(7);
+  for(uint32_t kind = 0; kind < 4; kind++) {
+    image_t img;
+    memset(&img, 0, sizeof(image_t));
+    img.width = img.height = size;
+    img.levels = 1;
+    img.pixels[0] = (uint8_t*)malloc((size_t)size*size*4);
+    for(uint32_t y = 0; y < size; y++) {
+      for(uint32_t x = 0; x < size; x++) _bc_test_pixel(kind, x, y, size, img.pixels[0]+((size_t)y*size+x)*4);
+    }
+    image_generate_mipmaps(&img);
+
+    bc_format_t format = bc_image_has_alpha(&img) ? BC_FORMAT_BC3 : BC_FORMAT_BC1;
+
+    bc_image_t bc;
+    uint64_t start = SDL_GetPerformanceCounter();
+    bc_encode(&bc, &img, format, pool);
+    double ms = timer_elapsed_ms(start);
+
+    double pixels = 0.0;
+    for(uint32_t level = 0; level < img.levels; level++) {
+      uint32_t texels = image_level_width(&img, level)*image_level_height(&img, level);
+      pixels += (double)texels;
+    }
+    float psnr = bc_psnr(&bc, &img, 0);
+    bool passed = (format == formats[kind] && psnr >= min_psnr[kind]);
+    ok = ok && passed;
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "BC test %s: %s, PSNR %.2f dB, %.2f ms (%.1f Mpixels/s) on %u worker threads, %s\n", names[kind], (format == BC_FORMAT_BC1) ? "BC1" : "BC3", (double)psnr, ms, pixels/ms/1000.0, threadpool_size(pool), passed ? "passed" : "FAILED");
+
+    bc_free(&bc);
+    image_free(&img);
+  }
+
+  return ok;
+}
@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include "cull.h"
+#include "timer.h"
+
+// A box is outside a plane if even its corner furthest along the plane normal is behind it. With the box as a center c
+// and half extents e that corner is at distance n.c + |n|.e + d. Every kernel evaluates it in this order so they agree
+// to the bit with the scalar reference
+
+void cull_frustum_from_matrix(cull_frustum_t *frustum, const mat4_t *mvp) {
+  // Gribb/Hartmann: the planes are sums and differences of the rows of the matrix. The matrix is column major
+  const GLfloat *m = mvp->m;
+  for(uint32_t c = 0; c < 4; c++) {
+    GLfloat r0 = m[c*4+0], r1 = m[c*4+1], r2 = m[c*4+2], r3 = m[c*4+3];
+    frustum->planes[0][c] = r3+r0;
+    frustum->planes[1][c] = r3-r0;
+    frustum->planes[2][c] = r3+r1;
+    frustum->planes[3][c] = r3-r1;
+    frustum->planes[4][c] = r3+r2;
+    frustum->planes[5][c] = r3-r2;
+  }
+}
+
+void cull_boxes_create(cull_boxes_t *boxes, size_t count) {
+  // Padding boxes are empty boxes at the origin, their results are never read
+  size_t padded = (count+CULL_BATCH-1)/CULL_BATCH*CULL_BATCH;
+  if(padded == 0) padded = CULL_BATCH;
+
+  boxes->count = count;
+  for(uint32_t k = 0; k < 3; k++) {
+    boxes->center[k] = (GLfloat*)calloc(padded, sizeof(GLfloat));
+    boxes->extent[k] = (GLfloat*)calloc(padded, sizeof(GLfloat));
+  }
+}
+
+void cull_boxes_set(cull_boxes_t *boxes, size_t index, const GLfloat *lo, const GLfloat *hi) {
+  for(uint32_t k = 0; k < 3; k++) {
+    boxes->center[k][index] = 0.5f*(lo[k]+hi[k]);
+    boxes->extent[k][index] = 0.5f*(hi[k]-lo[k]);
+  }
+}
+
+void cull_boxes_delete(cull_boxes_t *boxes) {
+  for(uint32_t k = 0; k < 3; k++) {
+    free(boxes->center[k]);
+    free(boxes->extent[k]);
+    boxes->center[k] = NULL;
+    boxes->extent[k] = NULL;
+  }
+  boxes->count = 0;
+}
+
+void cull_transform_box(const mat4_t *mat, const GLfloat *lo, const GLfloat *hi, GLfloat *out_lo, GLfloat *out_hi) {
+  // Arvo: each output axis is the translation plus the smaller and the larger product of every input axis
+  for(uint32_t r = 0; r < 3; r++) {
+    out_lo[r] = out_hi[r] = mat->m[12+r];
+    for(uint32_t c = 0; c < 3; c++) {
+      GLfloat a = mat->m[c*4+r]*lo[c], b = mat->m[c*4+r]*hi[c];
+      out_lo[r] += (a < b) ? a : b;
+      out_hi[r] += (a < b) ? b : a;
+    }
+  }
+}
+
+size_t cull_test_scalar(const cull_frustum_t *frustum, const cull_boxes_t *boxes, uint8_t *visible) {
+  size_t num_visible = 0;
+  for(size_t i = 0; i < boxes->count; i++) {
+    bool outside = false;
+    for(uint32_t p = 0; p < 6; p++) {
+      const GLfloat *n = frustum->planes[p];
+      GLfloat dist = n[0]*boxes->center[0][i]+n[1]*boxes->center[1][i]+n[2]*boxes->center[2][i]+n[3];
+      GLfloat radius = fabsf(n[0])*boxes->extent[0][i]+fabsf(n[1])*boxes->extent[1][i]+fabsf(n[2])*boxes->extent[2][i];
+      outside = outside || (dist+radius < 0.0f);
+    }
+
+    visible[i] = !outside;
+    num_visible += !outside;
+  }
+
+  return num_visible;
+}
+
+size_t cull_test(const cull_frustum_t *frustum, const cull_boxes_t *boxes, uint8_t *visible) {
+#if defined(__SSE2__)
+  size_t num_visible = 0;
+  for(size_t i = 0; i < boxes->count; i += 4) {
+    __m128 cx = _mm_loadu_ps(boxes->center[0]+i), cy = _mm_loadu_ps(boxes->center[1]+i), cz = _mm_loadu_ps(boxes->center[2]+i);
+    __m128 ex = _mm_loadu_ps(boxes->extent[0]+i), ey = _mm_loadu_ps(boxes->extent[1]+i), ez = _mm_loadu_ps(boxes->extent[2]+i);
+
+    __m128 outside = _mm_setzero_ps();
+    for(uint32_t p = 0; p < 6; p++) {
+      const GLfloat *n = frustum->planes[p];
+      __m128 dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(n[0]), cx), _mm_mul_ps(_mm_set1_ps(n[1]), cy)), _mm_mul_ps(_mm_set1_ps(n[2]), cz)), _mm_set1_ps(n[3]));
+      __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(fabsf(n[0])), ex), _mm_mul_ps(_mm_set1_ps(fabsf(n[1])), ey)), _mm_mul_ps(_mm_set1_ps(fabsf(n[2])), ez));
+      outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(dist, radius), _mm_setzero_ps()));
+    }
+
+    uint32_t mask = (uint32_t)_mm_movemask_ps(outside);
+    size_t lanes = (boxes->count-i < 4) ? boxes->count-i : 4;
+    for(size_t j = 0; j < lanes; j++) {
+      visible[i+j] = !((mask >> j) & 1);
+      num_visible += visible[i+j];
+    }
+  }
+  return num_visible;
+#else
+  return cull_test_scalar(frustum, boxes, visible);
+#endif
+}
+
+// Culls random boxes with the SIMD kernel and the scalar reference, logs how long each takes and returns whether they agree
+bool cull_self_test(size_t count) {
+  cull_boxes_t boxes;
+  cull_boxes_create(&boxes, count);
+  srand(1);
+  for(size_t i = 0; i < count; i++) {
+    GLfloat lo[3], hi[3];
+    for(uint32_t k = 0; k < 3; k++) {
+      lo[k] = (GLfloat)(rand()%20000)/100.0f-100.0f;
+      hi[k] = lo[k]+(GLfloat)(rand()%1000)/100.0f;
+    }
+    cull_boxes_set(&boxes, i, lo, hi);
+  }
+
+  // A camera in the middle of the boxes looking down a diagonal, so all the planes have something to cull
+  mat4_t mvp;
+  mat4_perspective(&mvp, 60.0f, 4.0f/3.0f, 1.0f, 150.0f);
+  mat4_rotatef(&mvp, 30.0f, 1.0f, 0.0f, 0.0f);
+  mat4_rotatef(&mvp, 45.0f, 0.0f, 1.0f, 0.0f);
+  cull_frustum_t frustum;
+  cull_frustum_from_matrix(&frustum, &mvp);
+
+  uint8_t *reference = (uint8_t*)malloc(count);
+  uint8_t *visible = (uint8_t*)malloc(count);
+  const uint32_t runs = 100;
+
+  uint64_t start = SDL_GetPerformanceCounter();
+  size_t num_reference = 0;
+  for(uint32_t r = 0; r < runs; r++) num_reference = cull_test_scalar(&frustum, &boxes, reference);
+  double scalar_ms = timer_elapsed_ms(start)/runs;
+
+  start = SDL_GetPerformanceCounter();
+  size_t num_visible = 0;
+  for(uint32_t r = 0; r < runs; r++) num_visible = cull_test(&frustum, &boxes, visible);
+  double simd_ms = timer_elapsed_ms(start)/runs;
+
+  bool match = (num_visible == num_reference && memcmp(visible, reference, count) == 0);
+#if defined(__SSE2__)
+  const char *kernel = "SSE2, 4 boxes";
+#else
+  const char *kernel = "scalar";
+#endif
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Culling %llu boxes: scalar %.3f ms, %s per iteration %.3f ms, %llu visible, %s\n", (unsigned long long)count, scalar_ms, kernel, simd_ms, (unsigned long long)num_visible, match ? "results match" : "RESULTS DIFFER");
+
+  free(reference);
+  free(visible);
+  cull_boxes_delete(&boxes);
+
+  return match;
+}
@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <SDL2/SDL.h>
+
+#include "geompool.h"
+#include "glstate.h"
+#include "timer.h"
+
+// Each arena keeps its free blocks sorted by offset. An allocation takes the smallest block it fits in, which leaves
+// the large blocks for the large meshes, and a freed range is merged with the free blocks on either side of it
+typedef struct {
+  size_t offset;
+  size_t size;
+} geompool_block_t;
+
+typedef struct {
+  size_t capacity;
+  size_t used;
+  geompool_block_t *blocks;
+  size_t num_blocks;
+  size_t max_blocks;
+} geompool_arena_t;
+
+typedef struct {
+  GLuint index;
+  GLint size;
+  size_t offset;
+} geompool_attrib_t;
+
+typedef struct {
+  GLsizei stride;
+  GLuint vbo;
+  GLuint vao;
+  geompool_attrib_t attribs[GEOMPOOL_MAX_ATTRIBS];
+  uint32_t num_attribs;
+} geompool_stream_t;
+
+struct geompool {
+  geompool_stream_t streams[GEOMPOOL_MAX_STREAMS];
+  uint32_t num_streams;
+  GLuint ibo;
+
+  // The streams share the vertex arena, a range of vertices is the same in all of them
+  geompool_arena_t vertices;
+  geompool_arena_t indices;
+
+  size_t allocations;
+  size_t grows;
+};
+
+void _geompool_arena_init(geompool_arena_t *arena, size_t capacity) {
+  arena->capacity = capacity;
+  arena->used = 0;
+  arena->max_blocks = 16;
+  arena->blocks = (geompool_block_t*)malloc(sizeof(geompool_block_t)*arena->max_blocks);
+  arena->blocks[0] = (geompool_block_t){0, capacity};
+  arena->num_blocks = (capacity > 0) ? 1 : 0;
+}
+
+void _geompool_arena_insert(geompool_arena_t *arena, size_t at, geompool_block_t block) {
+  if(arena->num_blocks == arena->max_blocks) {
+    arena->max_blocks *= 2;
+    arena->blocks = (geompool_block_t*)realloc(arena->blocks, sizeof(geompool_block_t)*arena->max_blocks);
+  }
+  memmove(&arena->blocks[at+1], &arena->blocks[at], sizeof(geompool_block_t)*(arena->num_blocks-at));
+  arena->blocks[at] = block;
+  arena->num_blocks++;
+}
+
+void _geompool_arena_remove(geompool_arena_t *arena, size_t at) {
+  memmove(&arena->blocks[at], &arena->blocks[at+1], sizeof(geompool_block_t)*(arena->num_blocks-at-1));
+  arena->num_blocks--;
+}
+
+// Best fit, false if no free block is large enough
+bool _geompool_arena_alloc(geompool_arena_t *arena, size_t size, size_t *offset) {
+  if(size == 0) {
+    *offset = 0;
+    return true;
+  }
+
+  size_t best = arena->num_blocks;
+  for(size_t b = 0; b < arena->num_blocks; b++) {
+    if(arena->blocks[b].size >= size && (best == arena->num_blocks || arena->blocks[b].size < arena->blocks[best].size)) {
+      best = b;
+      if(arena->blocks[b].size == size) break;
+    }
+  }
+  if(best == arena->num_blocks) return false;
+
+  *offset = arena->blocks[best].offset;
+  arena->blocks[best].offset += size;
+  arena->blocks[best].size -= size;
+  if(arena->blocks[best].size == 0) _geompool_arena_remove(arena, best);
+  arena->used += size;
+  return true;
+}
+
+void _geompool_arena_free(geompool_arena_t *arena, size_t offset, size_t size) {
+  if(size == 0) return;
+  assert(offset+size <= arena->capacity && size <= arena->used);
+  arena->used -= size;
+
+  // First free block past the range
+  size_t lo = 0, hi = arena->num_blocks;
+  while(lo < hi) {
+    size_t mid = (lo+hi)/2;
+    if(arena->blocks[mid].offset < offset) lo = mid+1;
+    else hi = mid;
+  }
+  assert(lo == arena->num_blocks || arena->blocks[lo].offset >= offset+size);
+  assert(lo == 0 || arena->blocks[lo-1].offset+arena->blocks[lo-1].size <= offset);
+
+  bool merge_prev = (lo > 0 && arena->blocks[lo-1].offset+arena->blocks[lo-1].size == offset);
+  bool merge_next = (lo < arena->num_blocks && arena->blocks[lo].offset == offset+size);
+  if(merge_prev && merge_next) {
+    arena->blocks[lo-1].size += size+arena->blocks[lo].size;
+    _geompool_arena_remove(arena, lo);
+  } else if(merge_prev) {
+    arena->blocks[lo-1].size += size;
+  } else if(merge_next) {
+    arena->blocks[lo].offset = offset;
+    arena->blocks[lo].size += size;
+  } else {
+    _geompool_arena_insert(arena, lo, (geompool_block_t){offset, size});
+  }
+}
+
+// The new space goes at the end, merged with the last free block if it reaches the old end
+void _geompool_arena_grow(geompool_arena_t *arena, size_t capacity) {
+  size_t added = capacity-arena->capacity;
+  geompool_block_t *last = (arena->num_blocks > 0) ? &arena->blocks[arena->num_blocks-1] : NULL;
+  if(last != NULL && last->offset+last->size == arena->capacity) {
+    last->size += added;
+  } else {
+    _geompool_arena_insert(arena, arena->num_blocks, (geompool_block_t){arena->capacity, added});
+  }
+  arena->capacity = capacity;
+}
+
+void _geompool_arena_stats(const geompool_arena_t *arena, geompool_arena_stats_t *stats) {
+  stats->capacity = arena->capacity;
+  stats->used = arena->used;
+  stats->free_blocks = arena->num_blocks;
+  stats->largest_free = 0;
+  for(size_t b = 0; b < arena->num_blocks; b++) {
+    if(arena->blocks[b].size > stats->largest_free) stats->largest_free = arena->blocks[b].size;
+  }
+
+  size_t free_size = arena->capacity-arena->used;
+  stats->occupancy = (arena->capacity > 0) ? (double)arena->used/(double)arena->capacity : 0.0;
+  stats->fragmentation = (free_size > 0) ? 1.0-(double)stats->largest_free/(double)free_size : 0.0;
+}
+
+// Copies the first size bytes of the buffer into a new buffer of capacity bytes, deletes the old one and returns the new
+GLuint _geompool_regrow_buffer(GLuint buffer, size_t size, size_t capacity) {
+  GLuint grown;
+  glGenBuffers(1, &grown);
+  glstate_bind_buffer(GL_COPY_WRITE_BUFFER, grown);
+  glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)capacity, NULL, GL_STATIC_DRAW);
+  if(size > 0) {
+    glstate_bind_buffer(GL_COPY_READ_BUFFER, buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr)size);
+  }
+  glstate_delete_buffers(1, &buffer);
+  return grown;
+}
+
+// The VAOs keep the buffer their attributes were pointed at, so they are pointed again after the buffer is replaced
+void _geompool_bind_stream(geompool_t *pool, geompool_stream_t *stream) {
+  glstate_bind_vertex_array(stream->vao);
+  glstate_bind_buffer(GL_ARRAY_BUFFER, stream->vbo);
+  for(uint32_t a = 0; a < stream->num_attribs; a++) {
+    const geompool_attrib_t *attrib = &stream->attribs[a];
+    glEnableVertexAttribArray(attrib->index);
+    glVertexAttribPointer(attrib->index, attrib->size, GL_FLOAT, GL_FALSE, stream->stride, (GLvoid*)attrib->offset);
+  }
+  glstate_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, pool->ibo);
+  glstate_bind_vertex_array(0);
+}
+
+// Doubles the arena until size more fits at its end
+size_t _geompool_grown_capacity(const geompool_arena_t *arena, size_t size) {
+  size_t capacity = (arena->capacity > 0) ? arena->capacity : 1;
+  while(capacity < arena->capacity+size) capacity *= 2;
+  return capacity;
+}
+
+geompool_t* geompool_create(uint32_t num_streams, const GLsizei *strides, size_t vertices, size_t indices) {
+  assert(num_streams > 0 && num_streams <= GEOMPOOL_MAX_STREAMS);
+  geompool_t *pool = (geompool_t*)malloc(sizeof(geompool_t));
+  assert(pool != NULL);
+  memset(pool, 0, sizeof(geompool_t));
+
+  _geompool_arena_init(&pool->vertices, vertices);
+  _geompool_arena_init(&pool->indices, indices);
+
+  glGenBuffers(1, &pool->ibo);
+  glstate_bind_buffer(GL_COPY_WRITE_BUFFER, pool->ibo);
+  glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)(indices*sizeof(GLuint)), NULL, GL_STATIC_DRAW);
+
+  pool->num_streams = num_streams;
+  for(uint32_t s = 0; s < num_streams; s++) {
+    geompool_stream_t *stream = &pool->streams[s];
+    stream->stride = strides[s];
+    glGenBuffers(1, &stream->vbo);
+    glstate_bind_buffer(GL_COPY_WRITE_BUFFER, stream->vbo);
+    glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)(vertices*(size_t)stream->stride), NULL, GL_STATIC_DRAW);
+
+    glGenVertexArrays(1, &stream->vao);
+    _geompool_bind_stream(pool, stream);
+  }
+
+  return pool;
+}
+
+// Adds a float attribute at offset bytes into the vertices of the stream
+void geompool_attrib(geompool_t *pool, uint32_t stream, GLuint index, GLint size, size_t offset) {
+  geompool_stream_t *s = &pool->streams[stream];
+  assert(stream < pool->num_streams && s->num_attribs < GEOMPOOL_MAX_ATTRIBS);
+  s->attribs[s->num_attribs++] = (geompool_attrib_t){index, size, offset};
+  _geompool_bind_stream(pool, s);
+}
+
+// Copies num_vertices vertices of every stream and the indices into the pool, growing it if they do not fit
+void geompool_alloc(geompool_t *pool, const void *const *streams, size_t num_vertices, const GLuint *indices, size_t num_indices, geompool_range_t *range) {
+  size_t first_vertex, first_index;
+
+  // Growing always leaves a free block at the end large enough
+  while(!_geompool_arena_alloc(&pool->vertices, num_vertices, &first_vertex)) {
+    size_t old = pool->vertices.capacity;
+    _geompool_arena_grow(&pool->vertices, _geompool_grown_capacity(&pool->vertices, num_vertices));
+    for(uint32_t s = 0; s < pool->num_streams; s++) {
+      geompool_stream_t *stream = &pool->streams[s];
+      size_t stride = (size_t)stream->stride;
+      stream->vbo = _geompool_regrow_buffer(stream->vbo, old*stride, pool->vertices.capacity*stride);
+      _geompool_bind_stream(pool, stream);
+    }
+    pool->grows++;
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Geometry pool grown from %llu to %llu vertices\n", (unsigned long long)old, (unsigned long long)pool->vertices.capacity);
+  }
+
+  while(!_geompool_arena_alloc(&pool->indices, num_indices, &first_index)) {
+    size_t old = pool->indices.capacity;
+    _geompool_arena_grow(&pool->indices, _geompool_grown_capacity(&pool->indices, num_indices));
+    pool->ibo = _geompool_regrow_buffer(pool->ibo, old*sizeof(GLuint), pool->indices.capacity*sizeof(GLuint));
+    for(uint32_t s = 0; s < pool->num_streams; s++) _geompool_bind_stream(pool, &pool->streams[s]);
+    pool->grows++;
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Geometry pool grown from %llu to %llu indices\n", (unsigned long long)old, (unsigned long long)pool->indices.capacity);
+  }
+
+  // Uploads go through the copy target, the element array binding belongs to whichever VAO is bound
+  for(uint32_t s = 0; s < pool->num_streams && num_vertices > 0; s++) {
+    size_t stride = (size_t)pool->streams[s].stride;
+    glstate_bind_buffer(GL_COPY_WRITE_BUFFER, pool->streams[s].vbo);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)(first_vertex*stride), (GLsizeiptr)(num_vertices*stride), streams[s]);
+  }
+  if(num_indices > 0) {
+    glstate_bind_buffer(GL_COPY_WRITE_BUFFER, pool->ibo);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)(first_index*sizeof(GLuint)), (GLsizeiptr)(num_indices*sizeof(GLuint)), indices);
+  }
+
+  range->first_vertex = (GLuint)first_vertex;
+  range->num_vertices = (GLuint)num_vertices;
+  range->first_index = (GLuint)first_index;
+  range->num_indices = (GLuint)num_indices;
+  pool->allocations++;
+}
+
+void geompool_free(geompool_t *pool, const geompool_range_t *range) {
+  _geompool_arena_free(&pool->vertices, range->first_vertex, range->num_vertices);
+  _geompool_arena_free(&pool->indices, range->first_index, range->num_indices);
+  pool->allocations--;
+}
+
+GLuint geompool_vao(geompool_t *pool, uint32_t stream) {
+  return pool->streams[stream].vao;
+}
+
+size_t geompool_allocations(geompool_t *pool) {
+  return pool->allocations;
+}
+
+void geompool_stats(geompool_t *pool, geompool_stats_t *stats) {
+  _geompool_arena_stats(&pool->vertices, &stats->vertices);
+  _geompool_arena_stats(&pool->indices, &stats->indices);
+  stats->allocations = pool->allocations;
+  stats->grows = pool->grows;
+}
+
+void geompool_delete(geompool_t *pool) {
+  for(uint32_t s = 0; s < pool->num_streams; s++) {
+    glstate_delete_buffers(1, &pool->streams[s].vbo);
+    glstate_delete_vertex_arrays(1, &pool->streams[s].vao);
+  }
+  glstate_delete_buffers(1, &pool->ibo);
+  free(pool->vertices.blocks);
+  free(pool->indices.blocks);
+  free(pool);
+}
+
+// Allocates and frees count random ranges of an arena, growing it when they do not fit, and checks no two live ranges
+// overlap, the arena accounts for every unit and the free blocks merge back into one once everything is freed
+bool geompool_self_test(size_t count) {
+  geompool_arena_t arena;
+  _geompool_arena_init(&arena, 1024);
+
+  size_t max_live = 512;
+  geompool_block_t *live = (geompool_block_t*)malloc(sizeof(geompool_block_t)*max_live);
+  size_t num_live = 0, grows = 0, live_size = 0;
+  double fragmentation = 0.0;
+  bool ok = true;
+
+  srand(7);
+  uint64_t start = SDL_GetPerformanceCounter();
+  for(size_t i = 0; i < count && ok; i++) {
+    // Free more often once many ranges are live so the arena settles instead of growing forever
+    if(num_live > 0 && (num_live == max_live || (size_t)rand()%max_live < num_live)) {
+      size_t r = (size_t)rand()%num_live;
+      _geompool_arena_free(&arena, live[r].offset, live[r].size);
+      live_size -= live[r].size;
+      live[r] = live[--num_live];
+    } else {
+      size_t size = 1+(size_t)(rand()%256);
+      size_t offset;
+      if(!_geompool_arena_alloc(&arena, size, &offset)) {
+        _geompool_arena_grow(&arena, _geompool_grown_capacity(&arena, size));
+        grows++;
+        if(!_geompool_arena_alloc(&arena, size, &offset)) ok = false;
+      }
+      if(offset+size > arena.capacity) ok = false;
+      for(size_t r = 0; r < num_live; r++) {
+        if(offset < live[r].offset+live[r].size && live[r].offset < offset+size) ok = false;
+      }
+      live[num_live++] = (geompool_block_t){offset, size};
+      live_size += size;
+    }
+
+    if(arena.used != live_size) ok = false;
+
+    geompool_arena_stats_t stats;
+    _geompool_arena_stats(&arena, &stats);
+    fragmentation += stats.fragmentation;
+  }
+  double test_ms = timer_elapsed_ms(start);
+
+  while(num_live > 0) {
+    num_live--;
+    _geompool_arena_free(&arena, live[num_live].offset, live[num_live].size);
+  }
+  if(arena.used != 0 || arena.num_blocks != 1 || arena.blocks[0].size != arena.capacity) ok = false;
+
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Geometry pool test: %llu operations in %.2f ms, grew %llu times to %llu, average fragmentation %.1f%%, %s\n", (unsigned long long)count, test_ms, (unsigned long long)grows, (unsigned long long)arena.capacity, (count > 0) ? fragmentation*100.0/(double)count : 0.0, ok ? "passed" : "FAILED");
+
+  free(live);
+  free(arena.blocks);
+  return ok;
+}
@@ -0,0 +1,212 @@
+#include <string.h>
+
+#include "glstate.h"
+
+// A shadowed binding or value. Nothing is known about the GL state to begin with so the first call of each kind always goes through
+typedef struct {
+  bool known;
+  GLuint value;
+} glstate_slot_t;
+
+typedef struct {
+  bool known;
+  GLuint buffer;
+  GLintptr offset;
+  GLsizeiptr size;
+} glstate_range_t;
+
+// Buffer targets whose binding is shadowed. GL_ELEMENT_ARRAY_BUFFER is part of the VAO state and is never skipped
+static const GLenum buffer_targets[] = {GL_ARRAY_BUFFER, GL_UNIFORM_BUFFER, GL_PIXEL_PACK_BUFFER, GL_PIXEL_UNPACK_BUFFER, GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, GL_TEXTURE_BUFFER};
+#define GLSTATE_NUM_BUFFER_TARGETS (sizeof(buffer_targets)/sizeof(buffer_targets[0]))
+
+static const GLenum texture_targets[] = {GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BUFFER};
+#define GLSTATE_NUM_TEXTURE_TARGETS (sizeof(texture_targets)/sizeof(texture_targets[0]))
+
+static const GLenum capabilities[] = {GL_BLEND, GL_DEPTH_TEST, GL_CULL_FACE, GL_SCISSOR_TEST, GL_DEPTH_CLAMP, GL_MULTISAMPLE};
+#define GLSTATE_NUM_CAPABILITIES (sizeof(capabilities)/sizeof(capabilities[0]))
+
+static struct {
+  glstate_slot_t program;
+  glstate_slot_t vao;
+  glstate_slot_t buffers[GLSTATE_NUM_BUFFER_TARGETS];
+  glstate_range_t uniform_ranges[GLSTATE_MAX_BUFFER_BINDINGS];
+  glstate_slot_t active_unit;
+  glstate_slot_t textures[GLSTATE_MAX_TEXTURE_UNITS][GLSTATE_NUM_TEXTURE_TARGETS];
+  glstate_slot_t capabilities[GLSTATE_NUM_CAPABILITIES];
+  glstate_slot_t blend_src, blend_dst;
+  glstate_slot_t depth_func;
+  glstate_slot_t depth_mask;
+  glstate_slot_t color_mask;
+  glstate_slot_t polygon_mode;
+} state;
+
+static glstate_stats_t stats;
+
+// Index of the enum in the table or -1 if it is not shadowed
+int32_t _glstate_find(const GLenum *table, size_t count, GLenum value) {
+  for(size_t i = 0; i < count; i++) {
+    if(table[i] == value) return (int32_t)i;
+  }
+  return -1;
+}
+
+// Records the value and returns true if the call has to be made
+bool _glstate_update(glstate_slot_t *slot, GLuint value) {
+  if(slot->known && slot->value == value) {
+    stats.skipped++;
+    return false;
+  }
+
+  slot->known = true;
+  slot->value = value;
+  stats.submitted++;
+  return true;
+}
+
+// Forgets every slot bound to the deleted object, GL reverts those bindings to 0 behind our back
+void _glstate_forget(glstate_slot_t *slots, size_t count, GLsizei n, const GLuint *names) {
+  for(size_t i = 0; i < count; i++) {
+    for(GLsizei j = 0; j < n; j++) {
+      if(slots[i].value == names[j]) slots[i].known = false;
+    }
+  }
+}
+
+void glstate_invalidate() {
+  memset(&state, 0, sizeof(state));
+}
+
+void glstate_use_program(GLuint program) {
+  if(_glstate_update(&state.program, program)) glUseProgram(program);
+}
+
+GLuint glstate_program() {
+  return state.program.known ? state.program.value : 0;
+}
+
+void glstate_bind_vertex_array(GLuint vao) {
+  if(_glstate_update(&state.vao, vao)) glBindVertexArray(vao);
+}
+
+void glstate_bind_buffer(GLenum target, GLuint buffer) {
+  int32_t t = _glstate_find(buffer_targets, GLSTATE_NUM_BUFFER_TARGETS, target);
+  if(t < 0) {
+    stats.submitted++;
+    glBindBuffer(target, buffer);
+  } else if(_glstate_update(&state.buffers[t], buffer)) {
+    glBindBuffer(target, buffer);
+  }
+}
+
+void glstate_bind_buffer_base(GLenum target, GLuint index, GLuint buffer) {
+  // A whole buffer binding is shadowed as a range of size 0, which no glBindBufferRange call can set
+  glstate_bind_buffer_range(target, index, buffer, 0, 0);
+}
+
+void glstate_bind_buffer_range(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+  if(target == GL_UNIFORM_BUFFER && index < GLSTATE_MAX_BUFFER_BINDINGS) {
+    glstate_range_t *range = &state.uniform_ranges[index];
+    if(range->known && range->buffer == buffer && range->offset == offset && range->size == size) {
+      stats.skipped++;
+      return;
+    }
+    *range = (glstate_range_t){true, buffer, offset, size};
+  }
+
+  stats.submitted++;
+  if(size == 0) {
+    glBindBufferBase(target, index, buffer);
+  } else {
+    glBindBufferRange(target, index, buffer, offset, size);
+  }
+
+  // Both also bind the buffer to the generic binding point of the target
+  int32_t t = _glstate_find(buffer_targets, GLSTATE_NUM_BUFFER_TARGETS, target);
+  if(t >= 0) state.buffers[t] = (glstate_slot_t){true, buffer};
+}
+
+void glstate_bind_texture(GLuint unit, GLenum target, GLuint texture) {
+  int32_t t = _glstate_find(texture_targets, GLSTATE_NUM_TEXTURE_TARGETS, target);
+  if(unit < GLSTATE_MAX_TEXTURE_UNITS && t >= 0) {
+    glstate_slot_t *slot = &state.textures[unit][t];
+    if(slot->known && slot->value == texture) {
+      stats.skipped++;
+      return;
+    }
+    *slot = (glstate_slot_t){true, texture};
+  }
+
+  if(_glstate_update(&state.active_unit, unit)) glActiveTexture(GL_TEXTURE0+unit);
+  stats.submitted++;
+  glBindTexture(target, texture);
+}
+
+void glstate_set_capability(GLenum cap, bool enabled) {
+  int32_t c = _glstate_find(capabilities, GLSTATE_NUM_CAPABILITIES, cap);
+  if(c >= 0 && !_glstate_update(&state.capabilities[c], enabled)) return;
+  if(c < 0) stats.submitted++;
+
+  if(enabled) {
+    glEnable(cap);
+  } else {
+    glDisable(cap);
+  }
+}
+
+void glstate_blend_func(GLenum sfactor, GLenum dfactor) {
+  if(state.blend_src.known && state.blend_src.value == sfactor && state.blend_dst.known && state.blend_dst.value == dfactor) {
+    stats.skipped++;
+    return;
+  }
+
+  state.blend_src = (glstate_slot_t){true, sfactor};
+  state.blend_dst = (glstate_slot_t){true, dfactor};
+  stats.submitted++;
+  glBlendFunc(sfactor, dfactor);
+}
+
+void glstate_depth_func(GLenum func) {
+  if(_glstate_update(&state.depth_func, func)) glDepthFunc(func);
+}
+
+void glstate_depth_mask(GLboolean flag) {
+  if(_glstate_update(&state.depth_mask, flag)) glDepthMask(flag);
+}
+
+void glstate_color_mask(GLboolean flag) {
+  // All the channels are written or none of them
+  if(_glstate_update(&state.color_mask, flag)) glColorMask(flag, flag, flag, flag);
+}
+
+void glstate_polygon_mode(GLenum mode) {
+  // Core profile only has GL_FRONT_AND_BACK
+  if(_glstate_update(&state.polygon_mode, mode)) glPolygonMode(GL_FRONT_AND_BACK, mode);
+}
+
+void glstate_delete_buffers(GLsizei n, const GLuint *buffers) {
+  _glstate_forget(state.buffers, GLSTATE_NUM_BUFFER_TARGETS, n, buffers);
+  for(GLuint i = 0; i < GLSTATE_MAX_BUFFER_BINDINGS; i++) {
+    for(GLsizei j = 0; j < n; j++) {
+      if(state.uniform_ranges[i].buffer == buffers[j]) state.uniform_ranges[i].known = false;
+    }
+  }
+  glDeleteBuffers(n, buffers);
+}
+
+void glstate_delete_vertex_arrays(GLsizei n, const GLuint *vaos) {
+  _glstate_forget(&state.vao, 1, n, vaos);
+  glDeleteVertexArrays(n, vaos);
+}
+
+void glstate_delete_textures(GLsizei n, const GLuint *textures) {
+  _glstate_forget(&state.textures[0][0], GLSTATE_MAX_TEXTURE_UNITS*GLSTATE_NUM_TEXTURE_TARGETS, n, textures);
+  glDeleteTextures(n, textures);
+}
+
+void glstate_stats(glstate_stats_t *out) {
+  *out = stats;
+}
+
+void glstate_reset_stats() {
+  memset(&stats, 0, sizeof(glstate_stats_t));
+}
@@ -0,0 +1,21 @@
+#include <string.h>
+
+#include "hash.h"
+
+// Source: http://www.isthe.com/chongo/tech/comp/fnv/
+// 64-bit FNV-1a, the seed allows hashes to be chained over several buffers
+uint64_t hash_fnv1a(const void *data, size_t size, uint64_t seed) {
+  const uint8_t *bytes = (const uint8_t*)data;
+  uint64_t hash = seed;
+
+  for(size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+uint64_t hash_fnv1a_str(const char *str, uint64_t seed) {
+  return hash_fnv1a(str, strlen(str), seed);
+}
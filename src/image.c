@@ -0,0 +1,380 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include "image.h"
+
+// BMP compression types
+#define IMAGE_BMP_RGB 0
+#define IMAGE_BMP_BITFIELDS 3
+
+// Number of entries in the linear to sRGB table. 12 bits of precision keeps the dark end of the curve within one 8-bit step
+#define IMAGE_LINEAR_LUT_SIZE 4096
+
+// Decoding table for the bytes of RGBA8 texels: entries 0-255 decode the colour channels through the sRGB curve, entries
+// 256-511 scale alpha, which is already linear
+static float byte_to_linear[512];
+static uint8_t linear_to_srgb[IMAGE_LINEAR_LUT_SIZE];
+static bool tables_initialized = false;
+static SDL_SpinLock tables_lock = 0;
+
+// Images can be decoded on several threads at once, the first one in builds the tables
+void _image_init_tables() {
+  SDL_AtomicLock(&tables_lock);
+  if(tables_initialized) {
+    SDL_AtomicUnlock(&tables_lock);
+    return;
+  }
+
+  // The sRGB transfer function in both directions
+  for(uint32_t i = 0; i < 256; i++) {
+    float c = (float)i/255.0f;
+    byte_to_linear[i] = (c <= 0.04045f) ? c/12.92f : powf((c+0.055f)/1.055f, 2.4f);
+    byte_to_linear[256+i] = c;
+  }
+
+  for(uint32_t i = 0; i < IMAGE_LINEAR_LUT_SIZE; i++) {
+    float l = (float)i/(float)(IMAGE_LINEAR_LUT_SIZE-1);
+    float c = (l <= 0.0031308f) ? l*12.92f : 1.055f*powf(l, 1.0f/2.4f)-0.055f;
+    linear_to_srgb[i] = (uint8_t)(c*255.0f+0.5f);
+  }
+
+  tables_initialized = true;
+  SDL_AtomicUnlock(&tables_lock);
+}
+
+// Decode a row of sRGB encoded RGBA8 texels into linear float RGBA
+void _image_decode_row(const uint8_t *src, float *dst, uint32_t width) {
+  size_t count = (size_t)width*4;
+  // SSE has no gather, the decode is one table load per byte, done once per texel for the whole row
+  for(size_t i = 0; i < count; i += 4) {
+    dst[i+0] = byte_to_linear[src[i+0]];
+    dst[i+1] = byte_to_linear[src[i+1]];
+    dst[i+2] = byte_to_linear[src[i+2]];
+    dst[i+3] = byte_to_linear[256+src[i+3]];
+  }
+}
+
+// Box filter two rows of linear float RGBA texels into a row half as wide. An odd last column is repeated
+void _image_downsample_row(const float *r0, const float *r1, uint32_t sw, float *out, uint32_t dw) {
+  uint32_t x = 0;
+#ifdef __SSE2__
+  // Whole 2x2 blocks, the two texels of each row are adjacent
+  const __m128 quarter = _mm_set1_ps(0.25f);
+  for(; x < dw && 2*x+1 < sw; x++) {
+    __m128 top = _mm_add_ps(_mm_loadu_ps(r0+8*x), _mm_loadu_ps(r0+8*x+4));
+    __m128 bottom = _mm_add_ps(_mm_loadu_ps(r1+8*x), _mm_loadu_ps(r1+8*x+4));
+    _mm_storeu_ps(out+4*x, _mm_mul_ps(_mm_add_ps(top, bottom), quarter));
+  }
+#endif
+  for(; x < dw; x++) {
+    size_t x0 = (size_t)(2*x)*4, x1 = (size_t)((2*x+1 < sw) ? 2*x+1 : sw-1)*4;
+    for(uint32_t c = 0; c < 4; c++) out[4*x+c] = 0.25f*(r0[x0+c]+r0[x1+c]+r1[x0+c]+r1[x1+c]);
+  }
+}
+
+// Box filter a sRGB encoded RGBA8 level into a linear float RGBA level half its size. Each pair of source rows is
+// decoded to linear floats first and filtered like the deeper levels
+void _image_downsample_srgb(const uint8_t *src, uint32_t sw, uint32_t sh, float *dst, uint32_t dw, uint32_t dh) {
+  float *rows = (float*)malloc((size_t)sw*8*sizeof(float));
+  float *f0 = rows, *f1 = rows+(size_t)sw*4;
+
+  for(uint32_t y = 0; y < dh; y++) {
+    // Odd dimensions repeat the last row
+    uint32_t y1 = (2*y+1 < sh) ? 2*y+1 : sh-1;
+    _image_decode_row(src+(size_t)(2*y)*sw*4, f0, sw);
+    _image_decode_row(src+(size_t)y1*sw*4, f1, sw);
+    _image_downsample_row(f0, f1, sw, dst+(size_t)y*dw*4, dw);
+  }
+
+  free(rows);
+}
+
+// Box filter a linear float RGBA level into another linear float RGBA level half its size
+void _image_downsample_linear(const float *src, uint32_t sw, uint32_t sh, float *dst, uint32_t dw, uint32_t dh) {
+  for(uint32_t y = 0; y < dh; y++) {
+    // Odd dimensions repeat the last row
+    const float *r0 = src+(size_t)(2*y)*sw*4;
+    const float *r1 = src+(size_t)((2*y+1 < sh) ? 2*y+1 : sh-1)*sw*4;
+    _image_downsample_row(r0, r1, sw, dst+(size_t)y*dw*4, dw);
+  }
+}
+
+// Convert linear float RGBA texels back to sRGB encoded RGBA8 through the lookup table
+void _image_encode_srgb(const float *src, uint8_t *dst, size_t count) {
+#ifdef __SSE2__
+  const __m128 scale = _mm_set_ps(255.0f, (float)(IMAGE_LINEAR_LUT_SIZE-1), (float)(IMAGE_LINEAR_LUT_SIZE-1), (float)(IMAGE_LINEAR_LUT_SIZE-1));
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+  for(size_t i = 0; i < count; i++) {
+    // Clamp, scale to the table size (or 255 for alpha) and round to nearest
+    __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src+i*4), zero), one);
+    int32_t k[4];
+    _mm_storeu_si128((__m128i*)(void*)k, _mm_cvtps_epi32(_mm_mul_ps(v, scale)));
+
+    dst[i*4+0] = linear_to_srgb[k[0]];
+    dst[i*4+1] = linear_to_srgb[k[1]];
+    dst[i*4+2] = linear_to_srgb[k[2]];
+    dst[i*4+3] = (uint8_t)k[3];
+  }
+#else
+  for(size_t i = 0; i < count; i++) {
+    for(uint32_t c = 0; c < 4; c++) {
+      float v = src[i*4+c];
+      v = (v < 0.0f) ? 0.0f : ((v > 1.0f) ? 1.0f : v);
+      dst[i*4+c] = (c < 3) ? linear_to_srgb[(uint32_t)(v*(float)(IMAGE_LINEAR_LUT_SIZE-1)+0.5f)] : (uint8_t)(v*255.0f+0.5f);
+    }
+  }
+#endif
+}
+
+// Swizzle a row of 24-bit BGR pixels to RGBA with an opaque alpha
+void _image_bgr_to_rgba(const uint8_t *src, uint8_t *dst, uint32_t width) {
+  uint32_t x = 0;
+
+#if defined(__SSSE3__)
+  // Spread 4 BGR pixels (12 bytes) to 4 RGBA pixels, the alpha bytes are zeroed by the shuffle and then set
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+  const __m128i alpha = _mm_set1_epi32((int32_t)0xff000000);
+
+  // 4 pixels per iteration, the load reads 4 bytes past the last pixel used
+  for(; x+6 <= width; x += 4) {
+    __m128i px = _mm_loadu_si128((const __m128i*)(const void*)(src+x*3));
+    _mm_storeu_si128((__m128i*)(void*)(dst+x*4), _mm_or_si128(_mm_shuffle_epi8(px, shuffle), alpha));
+  }
+#endif
+
+  for(; x < width; x++) {
+    dst[x*4+0] = src[x*3+2];
+    dst[x*4+1] = src[x*3+1];
+    dst[x*4+2] = src[x*3+0];
+    dst[x*4+3] = 255;
+  }
+}
+
+// Swizzle a row of 32-bit BGRA pixels to RGBA, forcing alpha to opaque if the file has no alpha channel
+void _image_bgra_to_rgba(const uint8_t *src, uint8_t *dst, uint32_t width, bool has_alpha) {
+  uint32_t x = 0;
+
+#if defined(__SSSE3__)
+  const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  const __m128i alpha = _mm_set1_epi32(has_alpha ? 0 : (int32_t)0xff000000);
+  for(; x+4 <= width; x += 4) {
+    __m128i px = _mm_loadu_si128((const __m128i*)(const void*)(src+x*4));
+    _mm_storeu_si128((__m128i*)(void*)(dst+x*4), _mm_or_si128(_mm_shuffle_epi8(px, shuffle), alpha));
+  }
+#endif
+
+  for(; x < width; x++) {
+    dst[x*4+0] = src[x*4+2];
+    dst[x*4+1] = src[x*4+1];
+    dst[x*4+2] = src[x*4+0];
+    dst[x*4+3] = has_alpha ? src[x*4+3] : 255;
+  }
+}
+
+uint32_t _image_read_u32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint16_t _image_read_u16(const uint8_t *p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// Decodes uncompressed 24-bit and 32-bit BMPs straight from the mapped file into the level 0 buffer.
+// Returns 0 on success, 1 if the file could not be read and 2 if the BMP variant is not handled here
+int32_t _image_load_bmp(image_t *img, const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0) return 1;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size < 54) {
+    close(fd);
+    return 1;
+  }
+
+  size_t fsize = (size_t)st.st_size;
+  uint8_t *data = (uint8_t*)mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) return 1;
+
+  // BITMAPFILEHEADER followed by at least a BITMAPINFOHEADER
+  uint32_t offset = _image_read_u32(data+10), header_size = _image_read_u32(data+14);
+  int32_t width = (int32_t)_image_read_u32(data+18), height = (int32_t)_image_read_u32(data+22);
+  uint16_t bpp = _image_read_u16(data+28);
+  uint32_t compression = _image_read_u32(data+30);
+
+  // 32-bit bitfield images are handled if the masks describe BGRA or BGRX
+  bool supported = data[0] == 'B' && data[1] == 'M' && header_size >= 40 && width > 0 && height != 0;
+  bool has_alpha = false;
+  if(bpp == 24) {
+    supported = supported && compression == IMAGE_BMP_RGB;
+  } else if(bpp == 32 && compression == IMAGE_BMP_BITFIELDS && 14+header_size+(header_size == 40 ? 12 : 0) <= fsize) {
+    uint32_t r = _image_read_u32(data+54), g = _image_read_u32(data+58), b = _image_read_u32(data+62);
+    uint32_t a = (header_size >= 56) ? _image_read_u32(data+66) : 0;
+    supported = supported && r == 0x00ff0000 && g == 0x0000ff00 && b == 0x000000ff && (a == 0 || a == 0xff000000);
+    has_alpha = (a == 0xff000000);
+  } else {
+    supported = supported && bpp == 32 && compression == IMAGE_BMP_RGB;
+  }
+
+  // Rows are padded to 4 bytes and stored bottom-up unless the height is negative
+  bool bottom_up = height > 0;
+  uint32_t w = (uint32_t)width, h = bottom_up ? (uint32_t)height : (uint32_t)(-height);
+  size_t stride = (((size_t)w*bpp+31)/32)*4;
+  supported = supported && offset+stride*h <= fsize;
+
+  if(!supported) {
+    munmap(data, fsize);
+    return 2;
+  }
+
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Size of \'%s\': %llu bytes, dimensions: %u x %u pixels\n", filename, (unsigned long long)(stride*h), w, h);
+
+  img->width = w;
+  img->height = h;
+  img->levels = 1;
+  img->pixels[0] = (uint8_t*)malloc((size_t)w*h*4);
+
+  // Flip the rows while swizzling so the image ends up top-down like the SDL decoder produced
+  for(uint32_t y = 0; y < h; y++) {
+    const uint8_t *src = data+offset+stride*(bottom_up ? h-1-y : y);
+    uint8_t *dst = img->pixels[0]+(size_t)y*w*4;
+
+    if(bpp == 24) _image_bgr_to_rgba(src, dst, w);
+    else _image_bgra_to_rgba(src, dst, w, has_alpha);
+  }
+
+  munmap(data, fsize);
+
+  return 0;
+}
+
+// Fallback decoder for the BMP variants the direct decoder does not handle (palettes, RLE, 16-bit)
+bool _image_load_sdl(image_t *img, const char *filename) {
+  // Load the BMP
+  SDL_Surface *surface = SDL_LoadBMP(filename);
+
+  // Make sure the file exists and was loaded properly
+  if(surface == NULL) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Error reading image file: %s\n", filename);
+    return false;
+  }
+
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Size of \'%s\': %u bytes, dimensions: %u x %u pixels\n", filename, surface->w*surface->h*surface->format->BytesPerPixel, surface->w, surface->h);
+
+  // Convert the surface to RGBA byte order
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+  SDL_Surface *rgba = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA8888, 0);
+#else
+  SDL_Surface *rgba = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ABGR8888, 0);
+#endif
+  SDL_FreeSurface(surface);
+
+  if(rgba == NULL) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Error converting image file: %s\n", filename);
+    return false;
+  }
+
+  img->width = (uint32_t)rgba->w;
+  img->height = (uint32_t)rgba->h;
+  img->levels = 1;
+
+  // Copy the rows out of the surface since the surface pitch may be padded
+  size_t row_size = (size_t)img->width*4;
+  img->pixels[0] = (uint8_t*)malloc(row_size*img->height);
+  for(uint32_t y = 0; y < img->height; y++) {
+    memcpy(img->pixels[0]+row_size*y, (uint8_t*)rgba->pixels+(size_t)rgba->pitch*y, row_size);
+  }
+
+  SDL_FreeSurface(rgba);
+
+  return true;
+}
+
+bool image_load(image_t *img, const char *filename) {
+  memset(img, 0, sizeof(image_t));
+
+  int32_t status = _image_load_bmp(img, filename);
+  if(status == 2) return _image_load_sdl(img, filename);
+
+  if(status != 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Error reading image file: %s\n", filename);
+    return false;
+  }
+
+  return true;
+}
+
+uint32_t image_level_width(const image_t *img, uint32_t level) {
+  uint32_t width = img->width >> level;
+  return (width > 0) ? width : 1;
+}
+
+uint32_t image_level_height(const image_t *img, uint32_t level) {
+  uint32_t height = img->height >> level;
+  return (height > 0) ? height : 1;
+}
+
+uint32_t image_max_levels(uint32_t width, uint32_t height) {
+  // Count the levels down to 1x1
+  uint32_t levels = 1;
+  while((width > 1 || height > 1) && levels < IMAGE_MAX_LEVELS) {
+    width >>= 1, height >>= 1;
+    levels++;
+  }
+  return levels;
+}
+
+void image_generate_mipmaps(image_t *img) {
+  _image_init_tables();
+
+  uint32_t levels = image_max_levels(img->width, img->height);
+  if(img->levels >= levels) return;
+
+  // Filtering happens in linear space. Level 1 is the largest level generated so both scratch buffers are sized for it
+  size_t scratch_size = (size_t)image_level_width(img, 1)*image_level_height(img, 1)*4*sizeof(float);
+  float *cur = (float*)malloc(scratch_size);
+  float *next = (float*)malloc(scratch_size);
+
+  for(uint32_t level = 1; level < levels; level++) {
+    uint32_t sw = image_level_width(img, level-1), sh = image_level_height(img, level-1);
+    uint32_t dw = image_level_width(img, level), dh = image_level_height(img, level);
+
+    // Level 1 is filtered straight from the sRGB source, deeper levels from the previous linear level
+    if(level == 1) {
+      _image_downsample_srgb(img->pixels[0], sw, sh, cur, dw, dh);
+    } else {
+      _image_downsample_linear(cur, sw, sh, next, dw, dh);
+      float *t = cur;
+      cur = next, next = t;
+    }
+
+    img->pixels[level] = (uint8_t*)malloc((size_t)dw*dh*4);
+    _image_encode_srgb(cur, img->pixels[level], (size_t)dw*dh);
+  }
+
+  img->levels = levels;
+
+  free(cur);
+  free(next);
+}
+
+void image_free(image_t *img) {
+  for(uint32_t level = 0; level < img->levels; level++) free(img->pixels[level]);
+  memset(img, 0, sizeof(image_t));
+}
@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include <SDL2/SDL.h>
+
+#include "lightgrid.h"
+#include "array.h"
+#include "glstate.h"
+#include "timer.h"
+
+// A light as seen from the camera this frame, and the range of clusters its bounding sphere can reach
+typedef struct {
+  GLfloat position[3];
+  GLfloat radius;
+  int32_t slice0, slice1;
+  int32_t tile_x0, tile_x1, tile_y0, tile_y1;
+} lightgrid_view_t;
+
+struct lightgrid {
+  GLfloat near, far;
+
+  // Projection scale along x and y, a point at distance d in front of the camera is at x*scale_x/d in NDC
+  GLfloat scale_x, scale_y;
+  GLint width, height;
+
+  // Bounding box of every cluster in eye space
+  GLfloat (*cluster_lo)[3];
+  GLfloat (*cluster_hi)[3];
+
+  point_light_t *lights;
+  lightgrid_view_t *views;
+  uint32_t num_lights;
+
+  // Lights of each cluster, filled in by the binning jobs with one job per depth slice so no two jobs share a cluster
+  array_t **bins;
+
+  // CPU side of the buffer textures: eye space lights (position and radius, then color), offset and count of the lights
+  // of each cluster, and the light indices of all the clusters one after the other
+  GLfloat *light_data;
+  GLuint *grid;
+  array_t *indices;
+  GLint max_texels;
+
+  GLuint buffers[3];
+  GLuint textures[3];
+
+  threadpool_t *pool;
+  lightgrid_stats_t stats;
+};
+
+// Distance from the camera where a depth slice starts
+GLfloat _lightgrid_slice_depth(const lightgrid_t *grid, uint32_t slice) {
+  return grid->near*powf(grid->far/grid->near, (GLfloat)slice/(GLfloat)LIGHTGRID_SLICES);
+}
+
+int32_t _lightgrid_slice(const lightgrid_t *grid, GLfloat depth) {
+  GLfloat slices = floorf(logf(depth/grid->near)*(GLfloat)LIGHTGRID_SLICES/logf(grid->far/grid->near));
+  int32_t slice = (int32_t)slices;
+  return (slice < 0) ? 0 : ((slice >= LIGHTGRID_SLICES) ? LIGHTGRID_SLICES-1 : slice);
+}
+
+// Tile holding an NDC coordinate, across count tiles
+int32_t _lightgrid_tile(GLfloat ndc, int32_t count) {
+  GLfloat tiles = floorf((ndc*0.5f+0.5f)*(GLfloat)count);
+  int32_t tile = (int32_t)tiles;
+  return (tile < 0) ? 0 : ((tile >= count) ? count-1 : tile);
+}
+
+lightgrid_t* lightgrid_create(const mat4_t *projection, GLfloat near, GLfloat far, GLint width, GLint height, threadpool_t *pool) {
+  lightgrid_t *grid = (lightgrid_t*)malloc(sizeof(lightgrid_t));
+  assert(grid != NULL);
+
+  // The projection is a symmetric perspective one, as made by mat4_perspective
+  grid->near = near;
+  grid->far = far;
+  grid->scale_x = projection->m[0];
+  grid->scale_y = projection->m[5];
+  grid->width = width;
+  grid->height = height;
+  grid->pool = pool;
+
+  grid->cluster_lo = (GLfloat(*)[3])malloc(sizeof(GLfloat)*3*LIGHTGRID_CLUSTERS);
+  grid->cluster_hi = (GLfloat(*)[3])malloc(sizeof(GLfloat)*3*LIGHTGRID_CLUSTERS);
+  for(uint32_t s = 0; s < LIGHTGRID_SLICES; s++) {
+    GLfloat depths[2] = {_lightgrid_slice_depth(grid, s), _lightgrid_slice_depth(grid, s+1)};
+    for(uint32_t ty = 0; ty < LIGHTGRID_TILES_Y; ty++) {
+      for(uint32_t tx = 0; tx < LIGHTGRID_TILES_X; tx++) {
+        uint32_t c = tx+LIGHTGRID_TILES_X*(ty+LIGHTGRID_TILES_Y*s);
+        GLfloat ndc_x[2] = {-1.0f+2.0f*(GLfloat)tx/LIGHTGRID_TILES_X, -1.0f+2.0f*(GLfloat)(tx+1)/LIGHTGRID_TILES_X};
+        GLfloat ndc_y[2] = {-1.0f+2.0f*(GLfloat)ty/LIGHTGRID_TILES_Y, -1.0f+2.0f*(GLfloat)(ty+1)/LIGHTGRID_TILES_Y};
+
+        // Box around the 8 corners of the piece of the frustum
+        for(uint32_t k = 0; k < 3; k++) {
+          grid->cluster_lo[c][k] = INFINITY;
+          grid->cluster_hi[c][k] = -INFINITY;
+        }
+        for(uint32_t i = 0; i < 8; i++) {
+          GLfloat d = depths[i & 1];
+          GLfloat corner[3] = {ndc_x[(i >> 1) & 1]*d/grid->scale_x, ndc_y[(i >> 2) & 1]*d/grid->scale_y, -d};
+          for(uint32_t k = 0; k < 3; k++) {
+            if(corner[k] < grid->cluster_lo[c][k]) grid->cluster_lo[c][k] = corner[k];
+            if(corner[k] > grid->cluster_hi[c][k]) grid->cluster_hi[c][k] = corner[k];
+          }
+        }
+      }
+    }
+  }
+
+  grid->lights = NULL;
+  grid->views = NULL;
+  grid->light_data = NULL;
+  grid->num_lights = 0;
+
+  grid->bins = (array_t**)malloc(sizeof(array_t*)*LIGHTGRID_CLUSTERS);
+  for(uint32_t c = 0; c < LIGHTGRID_CLUSTERS; c++) grid->bins[c] = array_create(8, sizeof(GLuint));
+  grid->grid = (GLuint*)malloc(sizeof(GLuint)*2*LIGHTGRID_CLUSTERS);
+  grid->indices = array_create(1024, sizeof(GLuint));
+
+  // The index list is the one that can outgrow a buffer texture
+  glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &grid->max_texels);
+
+  // Buffer textures of the lights (RGBA32F, two texels each), the clusters (RG32UI) and the light indices (R32UI)
+  const GLenum formats[3] = {GL_RGBA32F, GL_RG32UI, GL_R32UI};
+  glGenBuffers(3, grid->buffers);
+  glGenTextures(3, grid->textures);
+  for(uint32_t i = 0; i < 3; i++) {
+    glstate_bind_buffer(GL_TEXTURE_BUFFER, grid->buffers[i]);
+    glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+    glstate_bind_texture(0, GL_TEXTURE_BUFFER, grid->textures[i]);
+    glTexBuffer(GL_TEXTURE_BUFFER, formats[i], grid->buffers[i]);
+  }
+  glstate_bind_texture(0, GL_TEXTURE_BUFFER, 0);
+  glstate_bind_buffer(GL_TEXTURE_BUFFER, 0);
+
+  memset(&grid->stats, 0, sizeof(lightgrid_stats_t));
+
+  return grid;
+}
+
+void lightgrid_set_lights(lightgrid_t *grid, const point_light_t *lights, uint32_t count) {
+  free(grid->lights);
+  free(grid->views);
+  free(grid->light_data);
+
+  grid->num_lights = count;
+  grid->lights = (point_light_t*)malloc(sizeof(point_light_t)*(count+1));
+  grid->views = (lightgrid_view_t*)malloc(sizeof(lightgrid_view_t)*(count+1));
+  grid->light_data = (GLfloat*)malloc(sizeof(GLfloat)*8*(count+1));
+  memcpy(grid->lights, lights, sizeof(point_light_t)*count);
+}
+
+typedef struct {
+  lightgrid_t *grid;
+  const mat4_t *modelview;
+} lightgrid_job_t;
+
+// Moves a light into eye space and finds the clusters its sphere can reach
+void _lightgrid_view_light(void *ctx, uint64_t index) {
+  lightgrid_job_t *job = (lightgrid_job_t*)ctx;
+  lightgrid_t *grid = job->grid;
+  const point_light_t *light = &grid->lights[index];
+  lightgrid_view_t *view = &grid->views[index];
+
+  vec4_t p = {light->position[0], light->position[1], light->position[2], 1.0f};
+  vec4_t eye = mat4_multv(job->modelview, &p);
+  GLfloat r = light->radius, d = -eye.z;
+
+  view->position[0] = eye.x;
+  view->position[1] = eye.y;
+  view->position[2] = eye.z;
+  view->radius = r;
+
+  GLfloat *data = grid->light_data+index*8;
+  data[0] = eye.x, data[1] = eye.y, data[2] = eye.z, data[3] = r;
+  data[4] = light->color[0], data[5] = light->color[1], data[6] = light->color[2], data[7] = 0.0f;
+
+  // Nothing to bin if the sphere is behind the camera or past the last slice. An empty slice range marks that
+  view->slice0 = 1;
+  view->slice1 = 0;
+  if(d+r < grid->near || d-r > grid->far) return;
+
+  // A sphere reaching the near plane could be anywhere on screen
+  view->tile_x0 = 0, view->tile_x1 = LIGHTGRID_TILES_X-1;
+  view->tile_y0 = 0, view->tile_y1 = LIGHTGRID_TILES_Y-1;
+  if(d-r > grid->near) {
+    // NDC range of the sphere's bounding box, the extremes are at its nearest or farthest face
+    GLfloat lo[2], hi[2];
+    GLfloat centers[2] = {eye.x, eye.y}, scales[2] = {grid->scale_x, grid->scale_y};
+    for(uint32_t k = 0; k < 2; k++) {
+      GLfloat a = centers[k]-r, b = centers[k]+r;
+      lo[k] = scales[k]*((a >= 0.0f) ? a/(d+r) : a/(d-r));
+      hi[k] = scales[k]*((b >= 0.0f) ? b/(d-r) : b/(d+r));
+      if(hi[k] < -1.0f || lo[k] > 1.0f) return;
+    }
+
+    view->tile_x0 = _lightgrid_tile(lo[0], LIGHTGRID_TILES_X);
+    view->tile_x1 = _lightgrid_tile(hi[0], LIGHTGRID_TILES_X);
+    view->tile_y0 = _lightgrid_tile(lo[1], LIGHTGRID_TILES_Y);
+    view->tile_y1 = _lightgrid_tile(hi[1], LIGHTGRID_TILES_Y);
+  }
+
+  view->slice0 = _lightgrid_slice(grid, (d-r > grid->near) ? d-r : grid->near);
+  view->slice1 = _lightgrid_slice(grid, (d+r < grid->far) ? d+r : grid->far);
+}
+
+// Adds each light to the clusters of a depth slice whose box its sphere touches
+void _lightgrid_bin_slice(void *ctx, uint64_t slice) {
+  lightgrid_job_t *job = (lightgrid_job_t*)ctx;
+  lightgrid_t *grid = job->grid;
+
+  for(GLuint i = 0; i < grid->num_lights; i++) {
+    const lightgrid_view_t *view = &grid->views[i];
+    if((int32_t)slice < view->slice0 || (int32_t)slice > view->slice1) continue;
+
+    for(int32_t ty = view->tile_y0; ty <= view->tile_y1; ty++) {
+      for(int32_t tx = view->tile_x0; tx <= view->tile_x1; tx++) {
+        uint32_t c = (uint32_t)tx+LIGHTGRID_TILES_X*((uint32_t)ty+LIGHTGRID_TILES_Y*(uint32_t)slice);
+
+        // Squared distance from the center of the sphere to the box
+        GLfloat dist2 = 0.0f;
+        for(uint32_t k = 0; k < 3; k++) {
+          GLfloat v = view->position[k];
+          if(v < grid->cluster_lo[c][k]) dist2 += (grid->cluster_lo[c][k]-v)*(grid->cluster_lo[c][k]-v);
+          if(v > grid->cluster_hi[c][k]) dist2 += (v-grid->cluster_hi[c][k])*(v-grid->cluster_hi[c][k]);
+        }
+        if(dist2 <= view->radius*view->radius) array_append(grid->bins[c], &i);
+      }
+    }
+  }
+}
+
+void _lightgrid_upload(GLuint buffer, const void *data, size_t size) {
+  // Orphan the storage the GPU may still be reading from the last frame
+  glstate_bind_buffer(GL_TEXTURE_BUFFER, buffer);
+  glBufferData(GL_TEXTURE_BUFFER, (GLsizeiptr)((size > 0) ? size : 16), NULL, GL_STREAM_DRAW);
+  if(size > 0) glBufferSubData(GL_TEXTURE_BUFFER, 0, (GLsizeiptr)size, data);
+}
+
+void lightgrid_update(lightgrid_t *grid, const mat4_t *modelview) {
+  uint64_t start = SDL_GetPerformanceCounter();
+
+  lightgrid_job_t job = {grid, modelview};
+  threadpool_parallel_for(grid->pool, grid->num_lights, _lightgrid_view_light, &job);
+  for(uint32_t c = 0; c < LIGHTGRID_CLUSTERS; c++) array_clear(grid->bins[c]);
+  threadpool_parallel_for(grid->pool, LIGHTGRID_SLICES, _lightgrid_bin_slice, &job);
+
+  // Pack the lists of every cluster one after the other, dropping what does not fit in a buffer texture
+  memset(&grid->stats, 0, sizeof(lightgrid_stats_t));
+  array_clear(grid->indices);
+  for(uint32_t c = 0; c < LIGHTGRID_CLUSTERS; c++) {
+    size_t count = array_size(grid->bins[c]);
+    size_t room = (size_t)grid->max_texels-array_size(grid->indices);
+    if(count > room) count = room;
+
+    grid->grid[c*2] = (GLuint)array_size(grid->indices);
+    grid->grid[c*2+1] = (GLuint)count;
+    for(size_t i = 0; i < count; i++) array_append(grid->indices, array_at(grid->bins[c], i));
+
+    if(count > 0) grid->stats.clusters++;
+    if(count > grid->stats.max_per_cluster) grid->stats.max_per_cluster = (uint32_t)count;
+  }
+
+  _lightgrid_upload(grid->buffers[0], grid->light_data, sizeof(GLfloat)*8*grid->num_lights);
+  _lightgrid_upload(grid->buffers[1], grid->grid, sizeof(GLuint)*2*LIGHTGRID_CLUSTERS);
+  _lightgrid_upload(grid->buffers[2], array_data(grid->indices), sizeof(GLuint)*array_size(grid->indices));
+  glstate_bind_buffer(GL_TEXTURE_BUFFER, 0);
+
+  grid->stats.lights = grid->num_lights;
+  for(uint32_t i = 0; i < grid->num_lights; i++) grid->stats.visible += (grid->views[i].slice0 <= grid->views[i].slice1);
+  grid->stats.indices = array_size(grid->indices);
+  grid->stats.bin_ms = timer_elapsed_ms(start);
+}
+
+void lightgrid_bind(lightgrid_t *grid, GLuint first_unit) {
+  for(GLuint i = 0; i < 3; i++) glstate_bind_texture(first_unit+i, GL_TEXTURE_BUFFER, grid->textures[i]);
+}
+
+// The cluster_dims and cluster_params values of the frame block: the number of tiles and slices, and the scale and bias
+// turning the log of a distance into a slice followed by the size of a tile in pixels
+void lightgrid_params(lightgrid_t *grid, GLuint *dims, GLfloat *params) {
+  dims[0] = LIGHTGRID_TILES_X;
+  dims[1] = LIGHTGRID_TILES_Y;
+  dims[2] = LIGHTGRID_SLICES;
+  dims[3] = 0;
+
+  GLfloat scale = (GLfloat)LIGHTGRID_SLICES/logf(grid->far/grid->near);
+  params[0] = scale;
+  params[1] = -scale*logf(grid->near);
+  params[2] = (GLfloat)grid->width/LIGHTGRID_TILES_X;
+  params[3] = (GLfloat)grid->height/LIGHTGRID_TILES_Y;
+}
+
+void lightgrid_stats(lightgrid_t *grid, lightgrid_stats_t *stats) {
+  *stats = grid->stats;
+}
+
+void lightgrid_delete(lightgrid_t *grid) {
+  glstate_delete_textures(3, grid->textures);
+  glstate_delete_buffers(3, grid->buffers);
+
+  for(uint32_t c = 0; c < LIGHTGRID_CLUSTERS; c++) array_delete(grid->bins[c]);
+  free(grid->bins);
+  array_delete(grid->indices);
+  free(grid->grid);
+  free(grid->cluster_lo);
+  free(grid->cluster_hi);
+  free(grid->lights);
+  free(grid->views);
+  free(grid->light_data);
+  free(grid);
+}
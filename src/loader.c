@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <SDL2/SDL.h>
+
+#include "loader.h"
+#include "array.h"
+#include "texture.h"
+#include "timer.h"
+
+// A scene file has one statement per line, # starts a comment. A model statement adds a model and the statements
+// after it place that model:
+//   model <name>                    resources/<name>.obj
+//   position <x> <y> <z>
+//   rotation <degrees> <x> <y> <z>
+//   scale <x> <y> <z>               or a single uniform scale
+//   instances <count> [spacing]     copies on a grid, spaced from the size of the mesh if no spacing is given
+
+#define LOADER_MAX_PATH 256
+
+typedef struct {
+  // Index of the model's mesh in the distinct meshes of the file
+  uint32_t mesh;
+
+  GLfloat position[3];
+  GLfloat rotation[4];
+  GLfloat scale[3];
+
+  uint32_t instances;
+  GLfloat spacing;
+} loader_model_t;
+
+typedef struct loader loader_t;
+
+// A distinct file of the scene and the job loading it
+typedef struct {
+  char path[LOADER_MAX_PATH];
+  mesh_t mesh;
+  bool parsed;
+  uint32_t index;
+  loader_t *loader;
+} loader_mesh_t;
+
+struct loader {
+  // Indices of the meshes parsed since the context thread last looked, signaled by parsed_cond
+  SDL_mutex *lock;
+  SDL_cond *parsed_cond;
+  array_t *parsed;
+};
+
+void _loader_parse(void *ctx, uint64_t index) {
+  loader_mesh_t *m = (loader_mesh_t*)ctx;
+  m->parsed = mesh_parse(&m->mesh, m->path);
+
+  SDL_LockMutex(m->loader->lock);
+  array_append(m->loader->parsed, &m->index);
+  SDL_CondSignal(m->loader->parsed_cond);
+  SDL_UnlockMutex(m->loader->lock);
+}
+
+// Reads the models of the file and the distinct mesh files they use
+bool _loader_read(const char *filename, array_t *models, array_t *meshes) {
+  FILE *file = fopen(filename, "r");
+  if(file == NULL) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not open scene file: %s\n", filename);
+    return false;
+  }
+
+  char line[512];
+  for(uint32_t number = 1; fgets(line, sizeof(line), file) != NULL; number++) {
+    char keyword[32];
+    if(sscanf(line, "%31s", keyword) != 1 || keyword[0] == '#') continue;
+
+    loader_model_t *model = (array_size(models) > 0) ? (loader_model_t*)array_back(models) : NULL;
+    if(strcmp(keyword, "model") == 0) {
+      char name[LOADER_MAX_PATH-16];
+      if(sscanf(line, "%*s %239s", name) != 1) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s:%u: model without a name\n", filename, number);
+        continue;
+      }
+
+      char path[LOADER_MAX_PATH];
+      snprintf(path, LOADER_MAX_PATH, "resources/%s.obj", name);
+
+      loader_model_t newmodel = {0, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 1.0f, 0.0f}, {1.0f, 1.0f, 1.0f}, 1, 0.0f};
+      for(newmodel.mesh = 0; newmodel.mesh < array_size(meshes); newmodel.mesh++) {
+        if(strcmp(((loader_mesh_t*)array_at(meshes, newmodel.mesh))->path, path) == 0) break;
+      }
+      if(newmodel.mesh == array_size(meshes)) {
+        loader_mesh_t newmesh;
+        memset(&newmesh, 0, sizeof(loader_mesh_t));
+        snprintf(newmesh.path, LOADER_MAX_PATH, "%s", path);
+        newmesh.index = newmodel.mesh;
+        array_append(meshes, &newmesh);
+      }
+      array_append(models, &newmodel);
+      continue;
+    }
+
+    if(model == NULL) {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s:%u: \'%s\' before any model\n", filename, number, keyword);
+      continue;
+    }
+
+    GLfloat v[4];
+    uint32_t count;
+    if(strcmp(keyword, "position") == 0 && sscanf(line, "%*s %f %f %f", &v[0], &v[1], &v[2]) == 3) {
+      memcpy(model->position, v, sizeof(model->position));
+    } else if(strcmp(keyword, "rotation") == 0 && sscanf(line, "%*s %f %f %f %f", &v[0], &v[1], &v[2], &v[3]) == 4) {
+      memcpy(model->rotation, v, sizeof(model->rotation));
+    } else if(strcmp(keyword, "scale") == 0) {
+      int n = sscanf(line, "%*s %f %f %f", &v[0], &v[1], &v[2]);
+      if(n == 1) v[1] = v[2] = v[0];
+      if(n == 1 || n == 3) memcpy(model->scale, v, sizeof(model->scale));
+      else SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s:%u: bad scale\n", filename, number);
+    } else if(strcmp(keyword, "instances") == 0 && sscanf(line, "%*s %u", &count) == 1) {
+      model->instances = (count > 0) ? count : 1;
+      if(sscanf(line, "%*s %*u %f", &v[0]) == 1) model->spacing = v[0];
+    } else {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s:%u: could not read \'%s\'\n", filename, number, keyword);
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+// Distance from the origin of the mesh to the farthest corner of its bounding box
+GLfloat _loader_extent(const mesh_t *mesh) {
+  GLfloat extent2 = 0.0f;
+  for(uint32_t k = 0; k < 3; k++) {
+    GLfloat e = fmaxf(fabsf(mesh->lo[k]), fabsf(mesh->hi[k]));
+    extent2 += e*e;
+  }
+  return sqrtf(extent2);
+}
+
+mesh_t* loader_load_scene(const char *filename, scene_t *scene, threadpool_t *pool, uint32_t *num_meshes) {
+  *num_meshes = 0;
+
+  array_t *models = array_create(64, sizeof(loader_model_t));
+  array_t *files = array_create(64, sizeof(loader_mesh_t));
+  if(!_loader_read(filename, models, files) || array_size(files) == 0) {
+    if(array_size(files) == 0) SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "No models in scene file: %s\n", filename);
+    array_delete(models);
+    array_delete(files);
+    return NULL;
+  }
+
+  uint64_t start = SDL_GetPerformanceCounter();
+  loader_t loader = {SDL_CreateMutex(), SDL_CreateCond(), array_create(64, sizeof(uint32_t))};
+  size_t num_files = array_size(files);
+  loader_mesh_t *pending = (loader_mesh_t*)array_at(files, 0);
+
+  // Textures acquired by the workers are only decoded, this thread uploads them
+  texture_defer_uploads(true);
+  for(uint64_t i = 0; i < num_files; i++) {
+    pending[i].loader = &loader;
+    threadpool_submit(pool, _loader_parse, &pending[i]);
+  }
+
+  // Upload each mesh as soon as it is parsed while the workers go on with the others
+  array_t *parsed = array_create(64, sizeof(uint32_t));
+  size_t done = 0, textures = 0;
+  double upload_ms = 0.0;
+  while(done < num_files) {
+    SDL_LockMutex(loader.lock);
+    while(array_size(loader.parsed) == 0) SDL_CondWait(loader.parsed_cond, loader.lock);
+    array_copy(parsed, loader.parsed);
+    array_clear(loader.parsed);
+    SDL_UnlockMutex(loader.lock);
+
+    uint64_t upload_start = SDL_GetPerformanceCounter();
+    textures += texture_flush_uploads();
+    for(uint64_t i = 0; i < array_size(parsed); i++) {
+      loader_mesh_t *m = &pending[*((uint32_t*)array_at(parsed, i))];
+      if(m->parsed) mesh_upload(&m->mesh, m->path);
+      done++;
+    }
+    upload_ms += timer_elapsed_ms(upload_start);
+  }
+  texture_defer_uploads(false);
+
+  array_delete(parsed);
+  array_delete(loader.parsed);
+  SDL_DestroyCond(loader.parsed_cond);
+  SDL_DestroyMutex(loader.lock);
+
+  // Keep the meshes that loaded
+  uint32_t *remap = (uint32_t*)malloc(sizeof(uint32_t)*(num_files+1));
+  mesh_t *meshes = (mesh_t*)malloc(sizeof(mesh_t)*(num_files+1));
+  uint32_t count = 0;
+  for(uint64_t i = 0; i < num_files; i++) {
+    remap[i] = pending[i].parsed ? count : UINT32_MAX;
+    if(pending[i].parsed) meshes[count++] = pending[i].mesh;
+  }
+
+  // Every model is a node placing one instance of its mesh, or a node with a grid of nodes placing its instances
+  uint32_t *instances = (uint32_t*)calloc(count+1, sizeof(uint32_t));
+  uint32_t placed = 0;
+  for(uint64_t i = 0; i < array_size(models); i++) {
+    loader_model_t *model = (loader_model_t*)array_at(models, i);
+    uint32_t m = remap[model->mesh];
+    if(m == UINT32_MAX) continue;
+
+    scene_node_t node = scene_add_node(scene, SCENE_NONE);
+    scene_set_translation(scene, node, model->position[0], model->position[1], model->position[2]);
+    scene_set_rotation(scene, node, model->rotation[0], model->rotation[1], model->rotation[2], model->rotation[3]);
+    scene_set_scale(scene, node, model->scale[0], model->scale[1], model->scale[2]);
+    placed++;
+
+    if(model->instances == 1) {
+      scene_set_mesh(scene, node, &meshes[m], instances[m]++);
+      continue;
+    }
+
+    GLfloat spacing = (model->spacing > 0.0f) ? model->spacing : 2.5f*_loader_extent(&meshes[m]);
+    float side = ceilf(sqrtf((float)model->instances));
+    uint32_t columns = (uint32_t)side;
+    for(uint32_t j = 0; j < model->instances; j++) {
+      scene_node_t copy = scene_add_node(scene, node);
+      scene_set_translation(scene, copy, ((float)(j%columns)-(float)(columns-1)*0.5f)*spacing, 0.0f, -(float)(j/columns)*spacing);
+      scene_set_mesh(scene, copy, &meshes[m], instances[m]++);
+    }
+  }
+
+  // The instance buffers are sized here and filled from the world transforms once the scene is updated
+  uint64_t total_instances = 0;
+  for(uint32_t m = 0; m < count; m++) {
+    mat4_t *models_identity = (mat4_t*)malloc(sizeof(mat4_t)*instances[m]);
+    for(uint32_t j = 0; j < instances[m]; j++) mat4_identity(&models_identity[j]);
+    mesh_set_instances(&meshes[m], models_identity, instances[m]);
+    free(models_identity);
+    total_instances += instances[m];
+  }
+
+  double total_ms = timer_elapsed_ms(start);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Scene \'%s\': %u of %llu models placed as %llu instances of %u meshes (%llu failed), %llu textures, loaded in %.2f ms on %u worker threads with %.2f ms of uploads\n", filename, placed, (unsigned long long)array_size(models), (unsigned long long)total_instances, count, (unsigned long long)(num_files-count), (unsigned long long)textures, total_ms, threadpool_size(pool), upload_ms);
+
+  free(remap);
+  free(instances);
+  array_delete(models);
+  array_delete(files);
+
+  if(count == 0) {
+    free(meshes);
+    return NULL;
+  }
+
+  *num_meshes = count;
+  return meshes;
+}
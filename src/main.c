@@ -1,5 +1,8 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
 
 #include <SDL2/SDL.h>
 
@@ -7,6 +10,16 @@
 #include "mat.h"
 #include "shader.h"
 #include "mesh.h"
+#include "glstate.h"
+#include "renderqueue.h"
+#include "cull.h"
+#include "occlusion.h"
+#include "threadpool.h"
+#include "lightgrid.h"
+#include "scene.h"
+#include "loader.h"
+#include "geompool.h"
+#include "timer.h"
 
 typedef struct {
   vec3_t position;
@@ -21,19 +34,117 @@ typedef struct {
   vec3_t rotation;
 } camera_t;
 
-static shader_t s_id;
-static mesh_t mesh;
+// The per-frame values as laid out in the FrameBlock uniform block of the shaders (std140)
+typedef struct {
+  GLfloat modelviewprojection[16];
+  GLfloat modelview[16];
+  GLfloat normalmodelview[16];
+  GLfloat light_position[3];
+  GLfloat pad0;
+  GLfloat light_intensities[3];
+  GLfloat pad1;
+  GLfloat light_gamma[3];
+  GLfloat light_attenuation;
+  GLfloat light_ambient_coefficient;
+  GLfloat pad2[3];
+  GLuint cluster_dims[4];
+  GLfloat cluster_params[4];
+} frame_block_t;
+
+// Binding points of the uniform blocks
+#define FRAME_BLOCK_BINDING 0
+#define MATERIAL_BLOCK_BINDING 1
+
+// Timer queries in flight. A result is read back this many frames later, by which time the GPU is done with it
+#define GPU_TIMER_QUERIES 4
+
+// Copies of an instanced mesh rasterized as occluders
+#define OCCLUDER_INSTANCES 16
+
+// The occlusion buffer has a pixel for this many pixels across the window
+#define OCCLUSION_DOWNSCALE 4
+
+// First of the three texture units the light grid's buffer textures are bound to
+#define LIGHTGRID_UNIT 2
+
+#define DEPTH_VERTEX_SHADER "shaders/depth.vert.glsl"
+#define DEPTH_FRAGMENT_SHADER "shaders/depth.frag.glsl"
+
+
+// The program of each shader variant the mesh needs, indexed by its features
+static shader_t variants[SHADER_NUM_VARIANTS];
+static GLuint frame_ubo;
+static frame_block_t frame_block;
+static shader_stats_t frame_stats;
+static glstate_stats_t frame_gl_stats;
+static renderqueue_t *queue;
+
+// The trivial programs of the depth pre-pass, used when depth_prepass is set
+static shader_t depth_program, depth_instanced_program;
+static bool depth_prepass = false;
+
+// GPU time spent drawing the render queue, averaged separately without ([0]) and with ([1]) the depth pre-pass
+static GLuint timer_queries[GPU_TIMER_QUERIES];
+static bool timer_prepass[GPU_TIMER_QUERIES];
+static bool timer_started[GPU_TIMER_QUERIES];
+static uint32_t timer_next = 0;
+static double gpu_ms[2];
+static uint64_t gpu_samples[2];
+
+// CPU time _draw took in the last frame, everything but the wait for the GPU at the swap
+static double cpu_frame_ms;
+
+// Groups, or instances of an instanced mesh, outside the view frustum are not drawn. The counts are of the last frame
+static bool frustum_culling = true;
+static uint8_t *cull_visible;
+static size_t cull_visible_size;
+static size_t *cull_counts;
+static uint32_t cull_counts_size;
+static uint64_t cull_tested, cull_culled;
+static double cull_ms;
+
+// Groups or instances hidden behind the largest faces of the mesh are not drawn either, when occlusion_culling is set
+static occlusion_t *occlusion;
+static bool occlusion_culling = false;
+
+// Point lights binned into clusters of the view frustum, NULL without --lights
+static lightgrid_t *lightgrid;
+
+// Places the mesh, or each of its instances, in the world. The world transforms of the instances are copied into
+// the instance buffer whenever an update recomputed some of them
+static scene_t *scene;
+static scene_node_t grid_node = SCENE_NONE;
+static GLfloat grid_angle = 0.0f;
+static scene_stats_t scene_last_moved;
+
+// The model given on the command line, or every distinct model of the --scene file
+static mesh_t *meshes;
+static uint32_t num_meshes;
 static mat4_t projection = MAT4_IDENTITY, modelviewprojection = MAT4_IDENTITY, modelview = MAT4_IDENTITY, normalmodelview = MAT4_IDENTITY; 
 static lightsource_t light = {{0.0f, 10.0f, 10.0f}, {1.0f, 1.0f, 1.0f}, {1.0f/2.2f, 1.0f/2.2f, 1.0f/2.2f}, 0.0005f, 0.04f};
 static camera_t camera = {{0.0f, 0.0f, 10.0f}, {0.0f, 0.0f, 0.0f}};
 
-static char obj_model[256], vertex_shader[256], fragment_shader[256];
+static char obj_model[256], vertex_shader[256], fragment_shader[256], scene_file[256];
 static GLint w, h;
 static SDL_Window *window;
 
 void _quit() {
-  mesh_delete(&mesh);
-  shader_delete(s_id);
+  for(uint32_t i = 0; i < num_meshes; i++) mesh_delete(&meshes[i]);
+  free(meshes);
+  if(scene != NULL) scene_delete(scene);
+  renderqueue_delete(queue);
+  texture_shutdown();
+  free(cull_visible);
+  free(cull_counts);
+  if(occlusion != NULL) occlusion_delete(occlusion);
+  if(lightgrid != NULL) lightgrid_delete(lightgrid);
+  glstate_delete_buffers(1, &frame_ubo);
+  glDeleteQueries(GPU_TIMER_QUERIES, timer_queries);
+  if(depth_program != 0) shader_delete(depth_program);
+  if(depth_instanced_program != 0) shader_delete(depth_instanced_program);
+  for(uint32_t i = 0; i < SHADER_NUM_VARIANTS; i++) {
+    if(variants[i] != 0) shader_delete(variants[i]);
+  }
   SDL_Quit();
 }
 
@@ -76,6 +187,274 @@ uint32_t _timer(uint32_t interval, void *param) {
   return interval;
 }
 
+void _init_frame_block() {
+  // The per-frame block lives in its own buffer shared by all the programs, it is filled in by _draw
+  glGenBuffers(1, &frame_ubo);
+  glstate_bind_buffer(GL_UNIFORM_BUFFER, frame_ubo);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(frame_block_t), NULL, GL_DYNAMIC_DRAW);
+  glstate_bind_buffer(GL_UNIFORM_BUFFER, 0);
+  glstate_bind_buffer_base(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, frame_ubo);
+}
+
+// The shader variant a material group is drawn with
+uint32_t _group_features(const mesh_t *m, const material_group_t *grp) {
+  uint32_t features = SHADER_FEATURE_GAMMA;
+  if(m->has_normals) features |= SHADER_FEATURE_HAS_NORMALS;
+  if(grp->mtl.use_texture) features |= SHADER_FEATURE_TEXTURED;
+  if(grp->mtl.use_texture && grp->mtl.layer >= 0) features |= SHADER_FEATURE_TEXTURE_ARRAY;
+  if(m->num_instances > 0) features |= SHADER_FEATURE_INSTANCED;
+  if(lightgrid != NULL) features |= SHADER_FEATURE_CLUSTERED;
+  return features;
+}
+
+// Starts compiling every variant the mesh could need, before it is loaded and the materials are known
+bool _submit_variants(bool texture_arrays, bool instanced, bool clustered) {
+  for(uint32_t features = 0; features < SHADER_NUM_VARIANTS; features++) {
+    if(!(features & SHADER_FEATURE_GAMMA)) continue;
+    if(!(features & SHADER_FEATURE_INSTANCED) != !instanced) continue;
+    if(!(features & SHADER_FEATURE_CLUSTERED) != !clustered) continue;
+    if((features & SHADER_FEATURE_TEXTURE_ARRAY) && (!texture_arrays || !(features & SHADER_FEATURE_TEXTURED))) continue;
+
+    variants[features] = shader_submit(vertex_shader, fragment_shader, features);
+    if(variants[features] == 0) return false;
+  }
+
+  depth_program = shader_submit(DEPTH_VERTEX_SHADER, DEPTH_FRAGMENT_SHADER, 0);
+  depth_instanced_program = shader_submit(DEPTH_VERTEX_SHADER, DEPTH_FRAGMENT_SHADER, SHADER_FEATURE_INSTANCED);
+  return (depth_program != 0 && depth_instanced_program != 0);
+}
+
+// The depth pre-pass programs are handed to the render queue only while it is enabled
+void _set_depth_prepass(bool enable) {
+  depth_prepass = enable;
+  renderqueue_set_depth_prepass(queue, enable ? depth_program : 0, enable ? depth_instanced_program : 0);
+}
+
+// Waits for the variants used by the material groups of the meshes and drops the others
+bool _finish_variants() {
+  bool used[SHADER_NUM_VARIANTS] = {false};
+  bool lights_shaded = false;
+  for(uint32_t m = 0; m < num_meshes; m++) {
+    for(uint64_t i = 0; i < array_size(meshes[m].mtl_grps); i++) {
+      uint32_t features = _group_features(&meshes[m], (material_group_t*)array_at(meshes[m].mtl_grps, i));
+      if(used[features]) continue;
+      used[features] = true;
+
+      // Not submitted up front if the loaded mesh did something unexpected
+      if(variants[features] == 0) variants[features] = shader_submit(vertex_shader, fragment_shader, features);
+
+      shader_t program = variants[features];
+      if(program == 0 || !shader_finish(program)) {
+        variants[features] = 0;
+        return false;
+      }
+
+      shader_bind_block(program, "FrameBlock", FRAME_BLOCK_BINDING);
+      shader_bind_block(program, "MaterialBlock", MATERIAL_BLOCK_BINDING);
+
+      // 2D textures go on texture unit 0 and texture arrays on unit 1, for good
+      GLint texture_units[2] = {0, 1};
+      shader_set(shader_uniform(program, "tex"), SHADER_UNIFORM_INT, &texture_units[0]);
+      shader_set(shader_uniform(program, "tex_array"), SHADER_UNIFORM_INT, &texture_units[1]);
+
+      // The light grid's buffer textures follow
+      GLint light_units[3] = {LIGHTGRID_UNIT, LIGHTGRID_UNIT+1, LIGHTGRID_UNIT+2};
+      shader_set(shader_uniform(program, "light_data"), SHADER_UNIFORM_INT, &light_units[0]);
+      shader_set(shader_uniform(program, "light_grid"), SHADER_UNIFORM_INT, &light_units[1]);
+      shader_set(shader_uniform(program, "light_indices"), SHADER_UNIFORM_INT, &light_units[2]);
+      if(shader_uniform(program, "light_grid") != SHADER_UNIFORM_NONE) lights_shaded = true;
+    }
+  }
+
+  // Shaders lighting per vertex have no pixel to look the cluster up for and leave the point lights out. They are not
+  // binned then, and the clustered variants are used as the plain ones they compiled to
+  if(lightgrid != NULL && !lights_shaded) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s does not shade point lights, --lights is ignored (the phong shader does)\n", fragment_shader);
+    lightgrid_delete(lightgrid);
+    lightgrid = NULL;
+    for(uint32_t features = 0; features < SHADER_NUM_VARIANTS; features++) {
+      if(!(features & SHADER_FEATURE_CLUSTERED)) continue;
+      variants[features & ~(uint32_t)SHADER_FEATURE_CLUSTERED] = variants[features];
+      used[features & ~(uint32_t)SHADER_FEATURE_CLUSTERED] = used[features];
+      variants[features] = 0;
+      used[features] = false;
+    }
+  }
+
+  for(uint32_t features = 0; features < SHADER_NUM_VARIANTS; features++) {
+    if(used[features] || variants[features] == 0) continue;
+    shader_delete(variants[features]);
+    variants[features] = 0;
+  }
+
+  if(!shader_finish(depth_program)) depth_program = 0;
+  if(!shader_finish(depth_instanced_program)) depth_instanced_program = 0;
+  if(depth_program == 0 || depth_instanced_program == 0) return false;
+
+  shader_bind_block(depth_program, "FrameBlock", FRAME_BLOCK_BINDING);
+  shader_bind_block(depth_instanced_program, "FrameBlock", FRAME_BLOCK_BINDING);
+  _set_depth_prepass(depth_prepass);
+
+  return true;
+}
+
+// Copies the world transforms of the nodes the last scene update recomputed into the instance buffers of their meshes
+void _apply_scene() {
+  const scene_node_t *nodes;
+  size_t count = scene_recomputed(scene, &nodes);
+  uint32_t *instances = (uint32_t*)malloc(count*sizeof(uint32_t));
+  mat4_t *models = (mat4_t*)malloc(count*sizeof(mat4_t));
+
+  for(uint32_t m = 0; m < num_meshes; m++) {
+    if(meshes[m].num_instances == 0) continue;
+    uint32_t n = 0;
+    for(size_t i = 0; i < count; i++) {
+      uint32_t instance = scene_instance(scene, nodes[i]);
+      if(scene_mesh(scene, nodes[i]) != &meshes[m] || instance >= meshes[m].num_instances) continue;
+      instances[n] = instance;
+      scene_world_matrix(scene, nodes[i], &models[n++]);
+    }
+    if(n > 0) mesh_update_instances(&meshes[m], instances, models, n);
+  }
+
+  free(instances);
+  free(models);
+}
+
+// Places count copies of the mesh on a grid stretching away from the camera, a row at a time. The copies are nodes
+// under one grid node, so turning the grid moves them all
+void _place_instances(uint32_t count) {
+  mesh_t *mesh = &meshes[0];
+
+  // Spacing from the extent of the mesh so neighbours do not overlap
+  GLfloat extent = 0.0f;
+  for(uint64_t i = 0; i < array_size(mesh->mtl_grps); i++) {
+    material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, i);
+    GLfloat r = sqrtf(grp->center[0]*grp->center[0]+grp->center[1]*grp->center[1]+grp->center[2]*grp->center[2])+grp->radius;
+    if(r > extent) extent = r;
+  }
+
+  GLfloat spacing = 2.5f*extent;
+  float side = ceilf(sqrtf((float)count));
+  uint32_t columns = (uint32_t)side;
+
+  // The instance buffer is sized first, _apply_scene fills in the models once the nodes are updated
+  mat4_t *models = (mat4_t*)malloc(count*sizeof(mat4_t));
+  for(uint32_t i = 0; i < count; i++) mat4_identity(&models[i]);
+  mesh_set_instances(mesh, models, count);
+  free(models);
+
+  grid_node = scene_add_node(scene, SCENE_NONE);
+  for(uint32_t i = 0; i < count; i++) {
+    scene_node_t node = scene_add_node(scene, grid_node);
+    scene_set_translation(scene, node, ((float)(i%columns)-(float)(columns-1)*0.5f)*spacing, 0.0f, -(float)(i/columns)*spacing);
+    scene_set_mesh(scene, node, mesh, i);
+  }
+  scene_update(scene);
+  _apply_scene();
+}
+
+// Scatters count point lights of random colors over the bounding box of the meshes, or of all their instances
+void _place_lights(uint32_t count) {
+  GLfloat lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+  for(uint32_t m = 0; m < num_meshes; m++) {
+    mesh_t *mesh = &meshes[m];
+    if(mesh->num_instances == 0) {
+      for(uint32_t k = 0; k < 3; k++) {
+        lo[k] = fminf(lo[k], mesh->lo[k]);
+        hi[k] = fmaxf(hi[k], mesh->hi[k]);
+      }
+    }
+    for(uint32_t i = 0; i < mesh->num_instances; i++) {
+      for(uint32_t k = 0; k < 3; k++) {
+        GLfloat c = mesh->instance_boxes.center[k][i], e = mesh->instance_boxes.extent[k][i];
+        lo[k] = fminf(lo[k], c-e);
+        hi[k] = fmaxf(hi[k], c+e);
+      }
+    }
+  }
+
+  // The more lights, the smaller each one's reach so a pixel is lit by about as many of them
+  GLfloat diagonal = sqrtf((hi[0]-lo[0])*(hi[0]-lo[0])+(hi[1]-lo[1])*(hi[1]-lo[1])+(hi[2]-lo[2])*(hi[2]-lo[2]));
+  GLfloat radius = 1.5f*diagonal/cbrtf((float)count);
+
+  point_light_t *lights = (point_light_t*)malloc(sizeof(point_light_t)*count);
+  for(uint32_t i = 0; i < count; i++) {
+    for(uint32_t k = 0; k < 3; k++) {
+      int position = rand(), color = rand();
+      lights[i].position[k] = lo[k]+(hi[k]-lo[k])*(GLfloat)position/(GLfloat)RAND_MAX;
+      lights[i].color[k] = 0.25f+0.75f*(GLfloat)color/(GLfloat)RAND_MAX;
+    }
+    lights[i].radius = radius;
+  }
+
+  lightgrid_set_lights(lightgrid, lights, count);
+  free(lights);
+}
+
+// Reads back the timer query of the frame GPU_TIMER_QUERIES ago and starts the one of this frame
+void _begin_gpu_timer() {
+  uint32_t q = timer_next;
+  if(timer_started[q]) {
+    GLint available = GL_FALSE;
+    glGetQueryObjectiv(timer_queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+    if(available == GL_TRUE) {
+      GLuint64 ns;
+      glGetQueryObjectui64v(timer_queries[q], GL_QUERY_RESULT, &ns);
+
+      // Running average over roughly the last 32 frames of the mode
+      uint32_t mode = timer_prepass[q] ? 1 : 0;
+      double ms = (double)ns/1000000.0;
+      gpu_ms[mode] = (gpu_samples[mode] == 0) ? ms : gpu_ms[mode]+(ms-gpu_ms[mode])/32.0;
+      gpu_samples[mode]++;
+    }
+  }
+
+  glBeginQuery(GL_TIME_ELAPSED, timer_queries[q]);
+  timer_prepass[q] = depth_prepass;
+  timer_started[q] = true;
+}
+
+void _end_gpu_timer() {
+  glEndQuery(GL_TIME_ELAPSED);
+  timer_next = (timer_next+1)%GPU_TIMER_QUERIES;
+}
+
+void _print_gpu_times() {
+  char with[32] = "not measured", without[32] = "not measured";
+  if(gpu_samples[1] > 0) snprintf(with, 32, "%.3f ms", gpu_ms[1]);
+  if(gpu_samples[0] > 0) snprintf(without, 32, "%.3f ms", gpu_ms[0]);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "GPU time drawing the scene: %s with depth pre-pass, %s without (currently %s)\n", with, without, depth_prepass ? "on" : "off");
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "CPU time building the last frame: %.3f ms\n", cpu_frame_ms);
+}
+
+void _print_geometry_stats() {
+  geompool_stats_t pool_stats;
+  mesh_geometry_stats(&pool_stats);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Geometry pool: %llu meshes, %llu of %llu vertices used (%.1f%%) in %llu free blocks (%.1f%% fragmented), %llu of %llu indices used (%.1f%%) in %llu free blocks (%.1f%% fragmented), grown %llu times\n", (unsigned long long)pool_stats.allocations, (unsigned long long)pool_stats.vertices.used, (unsigned long long)pool_stats.vertices.capacity, pool_stats.vertices.occupancy*100.0, (unsigned long long)pool_stats.vertices.free_blocks, pool_stats.vertices.fragmentation*100.0, (unsigned long long)pool_stats.indices.used, (unsigned long long)pool_stats.indices.capacity, pool_stats.indices.occupancy*100.0, (unsigned long long)pool_stats.indices.free_blocks, pool_stats.indices.fragmentation*100.0, (unsigned long long)pool_stats.grows);
+}
+
+void _print_shader_stats() {
+  // Each set used to cost a glUseProgram, a glGetUniformLocation and a glUniform call
+  uint64_t saved = 3*frame_stats.sets-frame_stats.uploads-frame_stats.program_binds;
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Uniforms last frame: %llu sets, %llu uploaded, %llu GL calls saved\n", (unsigned long long)frame_stats.sets, (unsigned long long)frame_stats.uploads, (unsigned long long)saved);
+  renderqueue_stats_t queue_stats;
+  renderqueue_stats(queue, &queue_stats);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Render queue last frame: %llu items (%llu transparent, %llu instances) of %u states sorted in %.3f ms (%u-bit keys, %u radix passes)\n", (unsigned long long)queue_stats.items, (unsigned long long)queue_stats.transparent, (unsigned long long)queue_stats.instances, queue_stats.states, queue_stats.sort_ms, queue_stats.key_bits, queue_stats.sort_passes);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "GL state changes last frame: %llu submitted, %llu redundant skipped\n", (unsigned long long)frame_gl_stats.submitted, (unsigned long long)frame_gl_stats.skipped);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Frustum culling last frame: %llu of %llu boxes culled in %.3f ms (%s)\n", (unsigned long long)cull_culled, (unsigned long long)cull_tested, cull_ms, frustum_culling ? "on" : "off");
+  occlusion_stats_t occ_stats;
+  occlusion_stats(occlusion, &occ_stats);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Occlusion culling last frame: %llu occluder triangles rasterized in %.3f ms, %llu of %llu boxes occluded in %.3f ms (%s)\n", (unsigned long long)occ_stats.triangles, occ_stats.raster_ms, (unsigned long long)occ_stats.occluded, (unsigned long long)occ_stats.tested, occ_stats.test_ms, occlusion_culling ? "on" : "off");
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Scene last moved: %llu of %llu nodes recomputed in %llu ranges in %.3f ms\n", (unsigned long long)scene_last_moved.updated, (unsigned long long)scene_last_moved.nodes, (unsigned long long)scene_last_moved.ranges, scene_last_moved.update_ms);
+  _print_geometry_stats();
+  if(lightgrid != NULL) {
+    lightgrid_stats_t light_stats;
+    lightgrid_stats(lightgrid, &light_stats);
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Light clusters last frame: %u of %u lights in view, %u of %u clusters lit (%llu light indices, at most %u per cluster), binned in %.3f ms\n", light_stats.visible, light_stats.lights, light_stats.clusters, LIGHTGRID_CLUSTERS, (unsigned long long)light_stats.indices, light_stats.max_per_cluster, light_stats.bin_ms);
+  }
+}
+
 void _key_down(SDL_Event *event) {
  float step_size = 0.2f, rot_mult = 10.0f;
   switch(event->key.keysym.sym) {
@@ -118,12 +497,33 @@ void _key_down(SDL_Event *event) {
     camera.rotation.z -= rot_mult*step_size;
     break;
   case SDLK_f:
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+    glstate_polygon_mode(GL_LINE);
     break;
   case SDLK_g:
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glstate_polygon_mode(GL_FILL);
+    break;
+  case SDLK_z:
+    _set_depth_prepass(!depth_prepass);
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Depth pre-pass %s\n", depth_prepass ? "on" : "off");
+    break;
+  case SDLK_c:
+    frustum_culling = !frustum_culling;
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Frustum culling %s\n", frustum_culling ? "on" : "off");
+    break;
+  case SDLK_o:
+    occlusion_culling = !occlusion_culling;
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Occlusion culling %s\n", occlusion_culling ? "on" : "off");
+    break;
+  case SDLK_r:
+    if(grid_node != SCENE_NONE) {
+      grid_angle += rot_mult*step_size;
+      scene_set_rotation(scene, grid_node, grid_angle, 0.0f, 1.0f, 0.0f);
+    }
     break;
   case SDLK_p:
+    texture_memory_report();
+    _print_shader_stats();
+    _print_gpu_times();
     break;
   }
 }
@@ -253,7 +653,7 @@ bool _init_gl() {
   glViewport(0, 0, w, h);
 
   // Enable scissor test and set scissor box to the size of the window
-  glEnable(GL_SCISSOR_TEST);
+  glstate_set_capability(GL_SCISSOR_TEST, true);
   glScissor(0, 0, w, h);
 
   // Set the color and dpeth buffer clear values
@@ -265,64 +665,283 @@ bool _init_gl() {
   //glCullFace(GL_BACK);
 
   // Enable depth testing
-  glEnable(GL_DEPTH_TEST);
-  glDepthFunc(GL_LEQUAL);
-  glEnable(GL_DEPTH_CLAMP);
-  glDepthMask(GL_TRUE);
+  glstate_set_capability(GL_DEPTH_TEST, true);
+  glstate_depth_func(GL_LEQUAL);
+  glstate_set_capability(GL_DEPTH_CLAMP, true);
+  glstate_depth_mask(GL_TRUE);
   glDepthRange(0.0f, 1.0f);
 
-  // Enable alpha blending
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  // Blending is only enabled by the render queue for the transparent pass
+  glstate_set_capability(GL_BLEND, false);
 
   // Enable multisampling (this may have been already enabled by SDL)
-  glEnable(GL_MULTISAMPLE);
+  glstate_set_capability(GL_MULTISAMPLE, true);
 
   return true;
 }
 
+// Sets a visibility flag for each box, all of them visible to begin with
+uint8_t* _cull_flags(size_t count) {
+  if(count > cull_visible_size) {
+    cull_visible = (uint8_t*)realloc(cull_visible, count);
+    cull_visible_size = count;
+  }
+  memset(cull_visible, 1, count);
+  return cull_visible;
+}
+
+// Instances are culled if there are any, groups otherwise
+cull_boxes_t* _cull_boxes(mesh_t *m) {
+  return (m->num_instances > 0) ? &m->instance_boxes : &m->group_boxes;
+}
+
+// Adds the occluders of the mesh to the occlusion buffer. An instanced mesh is occluded by its copies nearest to the
+// camera among those in the frustum
+void _add_occluders(mesh_t *m, const uint8_t *visible) {
+  if(m->num_instances == 0) {
+    occlusion_add_triangles(occlusion, &modelviewprojection, m->occluder, m->occluder_triangles);
+    return;
+  }
+
+  const cull_boxes_t *boxes = &m->instance_boxes;
+  uint32_t nearest[OCCLUDER_INSTANCES];
+  GLfloat nearest_distance[OCCLUDER_INSTANCES];
+  uint32_t num_nearest = 0;
+  for(uint32_t i = 0; i < m->num_instances; i++) {
+    if(!visible[i]) continue;
+
+    GLfloat d[3] = {boxes->center[0][i]-camera.position.x, boxes->center[1][i]-camera.position.y, boxes->center[2][i]-camera.position.z};
+    GLfloat distance = d[0]*d[0]+d[1]*d[1]+d[2]*d[2];
+    if(num_nearest == OCCLUDER_INSTANCES && distance >= nearest_distance[num_nearest-1]) continue;
+
+    // Insertion into the list sorted by distance, dropping the farthest if it is full
+    uint32_t j = (num_nearest < OCCLUDER_INSTANCES) ? num_nearest++ : num_nearest-1;
+    for(; j > 0 && nearest_distance[j-1] > distance; j--) {
+      nearest[j] = nearest[j-1];
+      nearest_distance[j] = nearest_distance[j-1];
+    }
+    nearest[j] = i;
+    nearest_distance[j] = distance;
+  }
+
+  for(uint32_t n = 0; n < num_nearest; n++) {
+    mat4_t mvp = modelviewprojection;
+    mat4_mult(&mvp, &m->instance_models[nearest[n]]);
+    occlusion_add_triangles(occlusion, &mvp, m->occluder, m->occluder_triangles);
+  }
+}
+
+// Culls the boxes of every mesh, one run of flags per mesh in cull_visible and the number left visible in cull_counts.
+// The occluders of all the meshes go into the occlusion buffer before any box is tested against it, so a mesh is also
+// hidden by the meshes queued after it, and the buffer is rasterized once per frame
+void _cull_meshes(const cull_frustum_t *frustum) {
+  size_t total = 0;
+  for(uint32_t m = 0; m < num_meshes; m++) total += _cull_boxes(&meshes[m])->count;
+  uint8_t *visible = _cull_flags(total);
+  if(num_meshes > cull_counts_size) {
+    cull_counts = (size_t*)realloc(cull_counts, sizeof(size_t)*num_meshes);
+    cull_counts_size = num_meshes;
+  }
+
+  uint64_t start = SDL_GetPerformanceCounter();
+  size_t offset = 0;
+  for(uint32_t m = 0; m < num_meshes; m++) {
+    cull_boxes_t *boxes = _cull_boxes(&meshes[m]);
+    cull_counts[m] = boxes->count;
+    if(frustum != NULL) {
+      cull_counts[m] = cull_test(frustum, boxes, visible+offset);
+      cull_tested += boxes->count;
+      cull_culled += boxes->count-cull_counts[m];
+    }
+    offset += boxes->count;
+  }
+  cull_ms += timer_elapsed_ms(start);
+
+  if(!occlusion_culling) return;
+
+  offset = 0;
+  for(uint32_t m = 0; m < num_meshes; m++) {
+    if(cull_counts[m] > 0) _add_occluders(&meshes[m], visible+offset);
+    offset += _cull_boxes(&meshes[m])->count;
+  }
+  occlusion_rasterize(occlusion);
+
+  offset = 0;
+  for(uint32_t m = 0; m < num_meshes; m++) {
+    cull_boxes_t *boxes = _cull_boxes(&meshes[m]);
+    if(cull_counts[m] > 0) cull_counts[m] = occlusion_test_boxes(occlusion, &modelviewprojection, boxes, visible+offset);
+    offset += boxes->count;
+  }
+}
+
+// Adds a draw item for each material group of the mesh to the render queue. Groups whose flag in visible is cleared are
+// left out, for an instanced mesh those instances are left out of the instance buffer instead
+void _queue_mesh(mesh_t *m, mat4_t *mv, const uint8_t *visible, size_t num_visible) {
+  size_t size = array_size(m->mtl_grps);
+  uint32_t instances = m->num_instances;
+
+  if(m->num_instances > 0) {
+    // Also puts every instance back once culling is turned off
+    instances = mesh_upload_visible_instances(m, visible, (uint32_t)num_visible);
+    if(instances == 0) return;
+  }
+
+  for(uint64_t i = 0; i < size; i++) {
+    material_group_t *grp = (material_group_t*)array_at(m->mtl_grps, i);
+    if(grp->count == 0 || (m->num_instances == 0 && !visible[i])) continue;
+
+    // Instanced groups are treated as one group spread over all the instances
+    vec4_t center = {grp->center[0], grp->center[1], grp->center[2], 1.0f};
+    float radius = grp->radius;
+    if(m->num_instances > 0) {
+      center.x += m->instance_center[0];
+      center.y += m->instance_center[1];
+      center.z += m->instance_center[2];
+      radius += m->instance_radius;
+    }
+
+    vec4_t eye = mat4_multv(mv, &center);
+    float center_distance = sqrtf(eye.x*eye.x+eye.y*eye.y+eye.z*eye.z);
+
+    renderqueue_item_t item;
+    item.pass = (grp->mtl.transparency < 1.0f) ? RENDERQUEUE_PASS_TRANSPARENT : RENDERQUEUE_PASS_OPAQUE;
+    item.program = variants[_group_features(m, grp)];
+    item.vao = m->vao;
+    item.depth_vao = m->depth_vao;
+    item.instances = instances;
+    item.instance_buffer = m->instance_vbo;
+    item.texture = 0;
+    item.target = GL_TEXTURE_2D;
+    item.unit = 0;
+    item.ubo = m->mtl_ubo;
+    item.ubo_offset = grp->block_offset;
+    item.ubo_size = sizeof(material_block_t);
+    item.offset = m->geometry.first_index+grp->offset;
+    item.count = grp->count;
+    item.base_vertex = (GLint)m->geometry.first_vertex;
+    // Transparent groups are blended back to front by the distance to their centroid
+    item.depth = center_distance;
+
+    if(grp->mtl.tex != NULL) {
+      // Mark the texture as drawn, which brings it back if the residency manager evicted it
+      texture_use(grp->mtl.tex);
+
+      // Tell the streamer how many texture coordinate units a pixel covers at the point of the group closest to the camera
+      float distance = center_distance-radius;
+      if(distance < 1.0f) distance = 1.0f;
+
+      float pixels_per_unit = projection.m[5]*(float)h*0.5f/distance;
+      texture_request(grp->mtl.tex, grp->uv_density/pixels_per_unit);
+
+      // 2D textures go on unit 0 and texture arrays on unit 1
+      item.texture = grp->mtl.tex->texID;
+      item.target = grp->mtl.tex->target;
+      item.unit = (grp->mtl.tex->target == GL_TEXTURE_2D_ARRAY) ? 1 : 0;
+    }
+
+    renderqueue_push(queue, &item);
+  }
+}
+
 void _draw() {
+  uint64_t frame_start = SDL_GetPerformanceCounter();
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  
-  mesh_bind(&mesh);
-  shader_bind(s_id);
-
-  // Set the uniform variables
-  shader_set_uniform(s_id, "modelviewprojection", SHADER_UNIFORM_MAT4, modelviewprojection.m);
-  shader_set_uniform(s_id, "modelview", SHADER_UNIFORM_MAT4, modelview.m);
-  shader_set_uniform(s_id, "normalmodelview", SHADER_UNIFORM_MAT4, normalmodelview.m);
-  shader_set_uniform(s_id, "light.position", SHADER_UNIFORM_VEC3, &light.position); 
-  shader_set_uniform(s_id, "light.intensities", SHADER_UNIFORM_VEC3, &light.intensities); 
-  shader_set_uniform(s_id, "light.gamma", SHADER_UNIFORM_VEC3, &light.gamma); 
-  shader_set_uniform(s_id, "light.attenuation", SHADER_UNIFORM_FLOAT, &light.attenuation); 
-  shader_set_uniform(s_id, "light.ambient_coefficient", SHADER_UNIFORM_FLOAT, &light.ambient_coefficient); 
-   
-  size_t size = array_size(mesh.mtl_grps);
-  for(uint64_t i = 0; i < size; i++) {
-    material_group_t *grp = (material_group_t*)array_at(mesh.mtl_grps, i);
 
-    shader_set_uniform(s_id, "mtl.diffuse", SHADER_UNIFORM_VEC3, &grp->mtl.diffuse);
-    shader_set_uniform(s_id, "mtl.ambient", SHADER_UNIFORM_VEC3, &grp->mtl.ambient);
-    shader_set_uniform(s_id, "mtl.specular", SHADER_UNIFORM_VEC3, &grp->mtl.specular);
-    shader_set_uniform(s_id, "mtl.shininess", SHADER_UNIFORM_FLOAT, &grp->mtl.shininess);
-    shader_set_uniform(s_id, "mtl.transparency", SHADER_UNIFORM_FLOAT, &grp->mtl.transparency);
-    shader_set_uniform(s_id, "mtl.use_texture", SHADER_UNIFORM_UINT, &grp->mtl.tex.use_texture);
+  // Fill in the per-frame block, the buffer is only updated if something moved
+  frame_block_t block;
+  memset(&block, 0, sizeof(frame_block_t));
+  memcpy(block.modelviewprojection, modelviewprojection.m, sizeof(block.modelviewprojection));
+  memcpy(block.modelview, modelview.m, sizeof(block.modelview));
+  memcpy(block.normalmodelview, normalmodelview.m, sizeof(block.normalmodelview));
+  memcpy(block.light_position, &light.position, sizeof(block.light_position));
+  memcpy(block.light_intensities, &light.intensities, sizeof(block.light_intensities));
+  memcpy(block.light_gamma, &light.gamma, sizeof(block.light_gamma));
+  block.light_attenuation = light.attenuation;
+  block.light_ambient_coefficient = light.ambient_coefficient;
+  if(lightgrid != NULL) lightgrid_params(lightgrid, block.cluster_dims, block.cluster_params);
+
+  if(memcmp(&block, &frame_block, sizeof(frame_block_t)) != 0) {
+    frame_block = block;
+    glstate_bind_buffer(GL_UNIFORM_BUFFER, frame_ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frame_block_t), &frame_block);
+    glstate_bind_buffer(GL_UNIFORM_BUFFER, 0);
+  }
+
+  // Only the nodes moved since the last frame and those under them are recomputed
+  if(scene_update(scene) > 0) {
+    scene_stats(scene, &scene_last_moved);
+    _apply_scene();
+  }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, grp->mtl.tex.texID);
+  // The mesh is drawn with an identity model matrix so the frustum planes of the modelviewprojection are in model space
+  cull_frustum_t frustum;
+  cull_frustum_from_matrix(&frustum, &modelviewprojection);
+  cull_tested = cull_culled = 0;
+  cull_ms = 0.0;
+  occlusion_clear(occlusion);
 
-    uint32_t texture_unit = 0;
-    shader_set_uniform(s_id, "tex", SHADER_UNIFORM_INT, &texture_unit);
+  // Collect the groups of every mesh left after culling, sort them by state and depth and draw them
+  _cull_meshes(frustum_culling ? &frustum : NULL);
+  renderqueue_clear(queue);
+  size_t offset = 0;
+  for(uint32_t m = 0; m < num_meshes; m++) {
+    _queue_mesh(&meshes[m], &modelview, cull_visible+offset, cull_counts[m]);
+    offset += _cull_boxes(&meshes[m])->count;
+  }
+  renderqueue_sort(queue);
 
-    glDrawElements(GL_TRIANGLES, (GLsizei)grp->count, GL_UNSIGNED_INT, (GLvoid*)(sizeof(uint32_t)*grp->offset));
+  // Bin the point lights for the current camera
+  if(lightgrid != NULL) {
+    lightgrid_update(lightgrid, &modelview);
+    lightgrid_bind(lightgrid, LIGHTGRID_UNIT);
   }
 
+  _begin_gpu_timer();
+  renderqueue_draw(queue);
+  _end_gpu_timer();
+
   shader_unbind();
   mesh_unbind();
+
+  // Stream texture levels in and out according to what was just drawn, then evict the textures that have gone
+  // unused the longest if over budget
+  texture_stream_update();
+  texture_residency_update();
+
+  // Keep the uniform traffic of the frame for the stats
+  shader_stats(&frame_stats);
+  shader_reset_stats();
+  glstate_stats(&frame_gl_stats);
+  glstate_reset_stats();
+
+  cpu_frame_ms = timer_elapsed_ms(frame_start);
+}
+
+// The self-tests only exercise the CPU side, so they run before there is a window or a GL context and can be passed
+// without the model and shader names. Exits with the result of the first one on the command line
+void _run_self_tests(int argc, char **argv) {
+  for(int32_t i = 1; i < argc; i++) {
+    bool has_value = (i+1 < argc);
+    if(strcmp(argv[i], "--bctest") == 0 && has_value) {
+      exit(bc_self_test((uint32_t)strtoul(argv[i+1], NULL, 10), threadpool_default()) ? EXIT_SUCCESS : EXIT_FAILURE);
+    } else if(strcmp(argv[i], "--sortbench") == 0 && has_value) {
+      exit(renderqueue_self_test((size_t)strtoul(argv[i+1], NULL, 10)) ? EXIT_SUCCESS : EXIT_FAILURE);
+    } else if(strcmp(argv[i], "--cullbench") == 0 && has_value) {
+      exit(cull_self_test((size_t)strtoul(argv[i+1], NULL, 10)) ? EXIT_SUCCESS : EXIT_FAILURE);
+    } else if(strcmp(argv[i], "--scenebench") == 0 && has_value) {
+      exit(scene_self_test((size_t)strtoul(argv[i+1], NULL, 10)) ? EXIT_SUCCESS : EXIT_FAILURE);
+    } else if(strcmp(argv[i], "--pooltest") == 0 && has_value) {
+      exit(geompool_self_test((size_t)strtoul(argv[i+1], NULL, 10)) ? EXIT_SUCCESS : EXIT_FAILURE);
+    } else if(strcmp(argv[i], "--occlusiontest") == 0) {
+      exit(occlusion_self_test(threadpool_default()) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
 }
 
 int main(int argc, char **argv) { 
   bool running = true;
+
+  _run_self_tests(argc, argv);
   
   // Initialize SDL
   if(!_init_sdl()) exit(EXIT_FAILURE);
@@ -358,23 +977,100 @@ int main(int argc, char **argv) {
     snprintf(fragment_shader, 256, "shaders/%s.frag.glsl", argv[2]);
   }
 
+  // Optional flags follow the model and shader names
+  bool texture_arrays = false;
+  uint32_t instances = 0, lights = 0;
+  for(int32_t i = 3; i < argc; i++) {
+    if(strcmp(argv[i], "--bc") == 0) {
+      texture_enable_compression(true);
+    } else if(strcmp(argv[i], "--atlas") == 0) {
+      mesh_enable_atlas(true);
+    } else if(strcmp(argv[i], "--texarray") == 0) {
+      mesh_enable_texture_arrays(true);
+      texture_arrays = true;
+    } else if(strcmp(argv[i], "--stream") == 0 && i+1 < argc) {
+      texture_enable_streaming((size_t)strtoul(argv[++i], NULL, 10)*1024*1024);
+    } else if(strcmp(argv[i], "--instances") == 0 && i+1 < argc) {
+      instances = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if(strcmp(argv[i], "--lights") == 0 && i+1 < argc) {
+      lights = (uint32_t)strtoul(argv[++i], NULL, 10);
+    } else if(strcmp(argv[i], "--prepass") == 0) {
+      depth_prepass = true;
+    } else if(strcmp(argv[i], "--residency") == 0 && i+1 < argc) {
+      texture_enable_residency((size_t)strtoul(argv[++i], NULL, 10)*1024*1024);
+    } else if(strcmp(argv[i], "--nocull") == 0) {
+      frustum_culling = false;
+    } else if(strcmp(argv[i], "--occlusion") == 0) {
+      occlusion_culling = true;
+    } else if(strcmp(argv[i], "--scene") == 0 && i+1 < argc) {
+      snprintf(scene_file, 256, "%s", argv[++i]);
+    } else {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unknown option: %s\n", argv[i]);
+    }
+  }
+
   // Set up a perspective projection matrix
   mat4_perspective(&projection, 60.0f, (float)w/(float)h, 1.0f, 10000.0f);
   
   // Initial update
   _update();
 
-  s_id = shader_load(vertex_shader, fragment_shader);  
+  // Draw items are sorted over the depth range of the projection
+  queue = renderqueue_create(MATERIAL_BLOCK_BINDING);
+  renderqueue_set_depth_range(queue, 1.0f, 10000.0f);
+  occlusion = occlusion_create((uint32_t)w/OCCLUSION_DOWNSCALE, (uint32_t)h/OCCLUSION_DOWNSCALE, threadpool_default());
+  if(lights > 0) lightgrid = lightgrid_create(&projection, 1.0f, 10000.0f, w, h, threadpool_default());
+  glGenQueries(GPU_TIMER_QUERIES, timer_queries);
 
-  if(s_id == 0) {
+  // Hand all the shader variants to the driver first so they compile while the mesh loads
+  uint64_t start = SDL_GetPerformanceCounter();
+  _init_frame_block();
+  // Every model of a scene file is an instance of its mesh
+  bool instanced = (instances > 0 || scene_file[0] != '\0');
+  if(!_submit_variants(texture_arrays, instanced, lights > 0)) {
     SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not load shaders\n");
     exit(EXIT_FAILURE);
   }
 
-  if(!mesh_load(&mesh, obj_model)) {
-    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not load mesh\n");
+  scene = scene_create(1+(size_t)instances);
+  if(scene_file[0] != '\0') {
+    meshes = loader_load_scene(scene_file, scene, threadpool_default(), &num_meshes);
+    if(meshes == NULL) {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not load scene\n");
+      exit(EXIT_FAILURE);
+    }
+    scene_update(scene);
+    _apply_scene();
+  } else {
+    meshes = (mesh_t*)calloc(1, sizeof(mesh_t));
+    if(!mesh_load(&meshes[0], obj_model)) {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not load mesh\n");
+      exit(EXIT_FAILURE);
+    }
+    num_meshes = 1;
+
+    // Without instances the mesh has a node of its own, drawn as is at the origin
+    if(instances > 0) {
+      _place_instances(instances);
+    } else {
+      scene_set_mesh(scene, scene_add_node(scene, SCENE_NONE), &meshes[0], SCENE_NONE);
+      scene_update(scene);
+    }
+  }
+  if(lights > 0) _place_lights(lights);
+
+  // Only the variants the materials of the meshes use are waited for
+  if(!_finish_variants()) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not load shaders\n");
     exit(EXIT_FAILURE);
   }
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Mesh and shaders ready in %.2f ms\n", timer_elapsed_ms(start));
+  _print_geometry_stats();
+
+  // Report how much of the texture upload overlapped with loading
+  texture_upload_stats_t upload_stats;
+  texture_upload_stats(&upload_stats);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Texture uploads: %llu levels, %.2f MB, staging batches %llu overlapped, %llu stalled (%.2f ms)\n", (unsigned long long)upload_stats.uploads, (double)upload_stats.bytes/(1024.0*1024.0), (unsigned long long)upload_stats.overlapped, (unsigned long long)upload_stats.stalls, upload_stats.stall_ms);
 
   // Main loop
   while(running) {
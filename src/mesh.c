@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include <SDL2/SDL_log.h>
 
@@ -8,6 +9,23 @@
 #include "vec.h"
 #include "obj.h"
 #include "mtl.h"
+#include "texture.h"
+#include "atlas.h"
+#include "glstate.h"
+
+// Padding around each image in a texture atlas. The atlas only gets the mip levels in which the padding is
+// at least a texel wide, so no level blends neighbouring images together
+#define MESH_ATLAS_PADDING 16
+
+// Tolerance for texture coordinates that are meant to be on the edge of the image
+#define MESH_ATLAS_UV_EPSILON 0.001f
+
+// Faces kept as occluders, the largest ones hide the most for the time they take to rasterize
+#define MESH_OCCLUDER_TRIANGLES 1024
+
+// Initial size of the geometry pool, it doubles whenever a mesh does not fit
+#define MESH_POOL_VERTICES (1 << 18)
+#define MESH_POOL_INDICES (1 << 20)
 
 // A material definition. This structure holds the name of the material as well as all the relevant values for that material
 typedef struct {
@@ -15,35 +33,173 @@ typedef struct {
   array_t *mtl_name;
 } material_def_t;
 
+static bool atlas_enabled = false;
+static bool texture_arrays_enabled = false;
+static geompool_t *geometry_pool = NULL;
+
+// Every mesh is suballocated from the same pool, created with the first mesh and deleted with the last
+geompool_t* _mesh_geometry_pool() {
+  if(geometry_pool != NULL) return geometry_pool;
+
+  // Stream 0 interleaves the attributes, 0 = vertex position, 1 = vertex texture coordinates, 2 = vertex normals.
+  // The depth pre-pass only reads positions, stream 1 holds a tightly packed copy of them
+  GLsizei strides[2] = {(GLsizei)(9*sizeof(GLfloat)), (GLsizei)(3*sizeof(GLfloat))};
+  geometry_pool = geompool_create(2, strides, MESH_POOL_VERTICES, MESH_POOL_INDICES);
+  geompool_attrib(geometry_pool, 0, 0, 3, 0);
+  geompool_attrib(geometry_pool, 0, 1, 3, 3*sizeof(GLfloat));
+  geompool_attrib(geometry_pool, 0, 2, 3, 6*sizeof(GLfloat));
+  geompool_attrib(geometry_pool, 1, 0, 3, 0);
+  return geometry_pool;
+}
+
 void _mesh_gen_buffers(mesh_t *mesh) {
-  // Generate the name for the vertex array object (VAO)
-  glGenVertexArrays(1, &mesh->vao);
-  glBindVertexArray(mesh->vao);
+  geompool_t *pool = _mesh_geometry_pool();
+  mesh->vao = geompool_vao(pool, 0);
+  mesh->depth_vao = geompool_vao(pool, 1);
+
+  size_t num_vertices = array_size(mesh->vattributes)/3;
+  GLfloat *positions = (GLfloat*)malloc(num_vertices*3*sizeof(GLfloat));
+  const GLfloat *vattributes = (const GLfloat*)array_data(mesh->vattributes);
+  for(size_t v = 0; v < num_vertices; v++) memcpy(&positions[v*3], &vattributes[v*9], 3*sizeof(GLfloat));
+
+  // Copy the vertex and index data into the pool
+  const void *streams[2] = {vattributes, positions};
+  geompool_alloc(pool, streams, num_vertices, (const GLuint*)array_data(mesh->indices), array_size(mesh->indices), &mesh->geometry);
+  free(positions);
+
+  // Lay the materials out one after the other, each at an offset glBindBufferRange accepts
+  GLint alignment;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+  size_t stride = (sizeof(material_block_t)+(size_t)alignment-1)/(size_t)alignment*(size_t)alignment;
+
+  size_t num_grps = array_size(mesh->mtl_grps);
+  uint8_t *blocks = (uint8_t*)calloc(num_grps+1, stride);
+  for(uint64_t g = 0; g < num_grps; g++) {
+    material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, g);
+    material_block_t *block = (material_block_t*)(void*)(blocks+g*stride);
+
+    memcpy(block->diffuse, grp->mtl.diffuse, sizeof(block->diffuse));
+    memcpy(block->ambient, grp->mtl.ambient, sizeof(block->ambient));
+    memcpy(block->specular, grp->mtl.specular, sizeof(block->specular));
+    block->shininess = grp->mtl.shininess;
+    block->transparency = grp->mtl.transparency;
+    block->use_texture = grp->mtl.use_texture;
+    block->layer = grp->mtl.layer;
+
+    grp->block_offset = (GLintptr)(g*stride);
+  }
 
-  // Create names for the vertex buffer object (VBO) and the index buffer object
-  glGenBuffers(1, &mesh->vbo);
-  glGenBuffers(1, &mesh->ibo);
+  glGenBuffers(1, &mesh->mtl_ubo);
+  glstate_bind_buffer(GL_UNIFORM_BUFFER, mesh->mtl_ubo);
+  glBufferData(GL_UNIFORM_BUFFER, (GLsizeiptr)((num_grps+1)*stride), blocks, GL_STATIC_DRAW);
+  glstate_bind_buffer(GL_UNIFORM_BUFFER, 0);
 
-  // Copy the index data into the index buffer
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr)(array_size(mesh->indices)*sizeof(GLuint)), array_data(mesh->indices), GL_STATIC_DRAW);
+  free(blocks);
+}
 
-  // Copy the vertex data into the vertex buffer
-  glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
-  glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(array_size(mesh->vattributes)*3*sizeof(GLfloat)), array_data(mesh->vattributes), GL_STATIC_DRAW);
+void _mesh_gen_bounds(mesh_t *mesh) {
+  size_t num_grps = array_size(mesh->mtl_grps);
+  cull_boxes_create(&mesh->group_boxes, num_grps);
+  for(uint64_t c = 0; c < 3; c++) {
+    mesh->lo[c] = INFINITY;
+    mesh->hi[c] = -INFINITY;
+  }
 
-  // Set and enable the vertex attributes. 0 = vertex position, 1 = vertex texture coordinates, 2 = vertex normals
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 9*sizeof(GLfloat), (GLvoid*)0);
+  for(uint64_t g = 0; g < num_grps; g++) {
+    material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, g);
+    for(uint64_t c = 0; c < 3; c++) grp->lo[c] = grp->hi[c] = 0.0f;
+    if(grp->count == 0) continue;
 
-  glEnableVertexAttribArray(1);
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 9*sizeof(GLfloat), (GLvoid*)(3*sizeof(GLfloat)));
+    // Center the sphere on the bounding box of the faces
+    GLfloat *lo = grp->lo, *hi = grp->hi;
+    for(uint64_t c = 0; c < 3; c++) {
+      lo[c] = INFINITY;
+      hi[c] = -INFINITY;
+    }
+    for(uint64_t k = grp->offset; k < grp->offset+grp->count; k++) {
+      GLfloat *pos = (GLfloat*)array_at(mesh->vattributes, (*((GLuint*)array_at(mesh->indices, k)))*3);
+      for(uint64_t c = 0; c < 3; c++) {
+        if(pos[c] < lo[c]) lo[c] = pos[c];
+        if(pos[c] > hi[c]) hi[c] = pos[c];
+      }
+    }
+    for(uint64_t c = 0; c < 3; c++) {
+      grp->center[c] = 0.5f*(lo[c]+hi[c]);
+      if(lo[c] < mesh->lo[c]) mesh->lo[c] = lo[c];
+      if(hi[c] > mesh->hi[c]) mesh->hi[c] = hi[c];
+    }
+    cull_boxes_set(&mesh->group_boxes, g, lo, hi);
+
+    // Compare the area of the faces in texture space to their area in model space
+    float radius2 = 0.0f, uv_area = 0.0f, area = 0.0f;
+    for(uint64_t k = grp->offset; k+2 < grp->offset+grp->count; k += 3) {
+      GLfloat *p[3], *t[3];
+      for(uint64_t v = 0; v < 3; v++) {
+        GLuint index = *((GLuint*)array_at(mesh->indices, k+v));
+        p[v] = (GLfloat*)array_at(mesh->vattributes, index*3);
+        t[v] = (GLfloat*)array_at(mesh->vattributes, index*3+1);
+
+        float d[3] = {p[v][0]-grp->center[0], p[v][1]-grp->center[1], p[v][2]-grp->center[2]};
+        float dist2 = d[0]*d[0]+d[1]*d[1]+d[2]*d[2];
+        if(dist2 > radius2) radius2 = dist2;
+      }
+
+      float e0[3] = {p[1][0]-p[0][0], p[1][1]-p[0][1], p[1][2]-p[0][2]};
+      float e1[3] = {p[2][0]-p[0][0], p[2][1]-p[0][1], p[2][2]-p[0][2]};
+      float n[3] = {e0[1]*e1[2]-e0[2]*e1[1], e0[2]*e1[0]-e0[0]*e1[2], e0[0]*e1[1]-e0[1]*e1[0]};
+      area += 0.5f*sqrtf(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]);
+      uv_area += 0.5f*fabsf((t[1][0]-t[0][0])*(t[2][1]-t[0][1])-(t[2][0]-t[0][0])*(t[1][1]-t[0][1]));
+    }
+
+    grp->radius = sqrtf(radius2);
+    grp->uv_density = (area > 0.0f) ? sqrtf(uv_area/area) : 0.0f;
+  }
+}
+
+typedef struct {
+  GLfloat area;
 
-  glEnableVertexAttribArray(2);
-  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 9*sizeof(GLfloat), (GLvoid*)(6*sizeof(GLfloat)));
+  // Offset of the face in the index list
+  uint64_t offset;
+} mesh_face_area_t;
 
-  // Unbind VAO
-  glBindVertexArray(0);
+int _mesh_compare_area(const void *a, const void *b) {
+  GLfloat area_a = ((const mesh_face_area_t*)a)->area, area_b = ((const mesh_face_area_t*)b)->area;
+  return (area_a < area_b) ? 1 : ((area_a > area_b) ? -1 : 0);
+}
+
+void _mesh_gen_occluder(mesh_t *mesh) {
+  // Only opaque faces hide what is behind them. Faces are compared by their squared doubled area
+  size_t num_faces = 0;
+  mesh_face_area_t *faces = (mesh_face_area_t*)malloc(sizeof(mesh_face_area_t)*(array_size(mesh->indices)/3+1));
+  for(uint64_t g = 0; g < array_size(mesh->mtl_grps); g++) {
+    material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, g);
+    if(grp->mtl.transparency < 1.0f) continue;
+
+    for(uint64_t k = grp->offset; k+2 < grp->offset+grp->count; k += 3) {
+      GLfloat *p[3];
+      for(uint64_t v = 0; v < 3; v++) p[v] = (GLfloat*)array_at(mesh->vattributes, (*((GLuint*)array_at(mesh->indices, k+v)))*3);
+
+      float e0[3] = {p[1][0]-p[0][0], p[1][1]-p[0][1], p[1][2]-p[0][2]};
+      float e1[3] = {p[2][0]-p[0][0], p[2][1]-p[0][1], p[2][2]-p[0][2]};
+      float n[3] = {e0[1]*e1[2]-e0[2]*e1[1], e0[2]*e1[0]-e0[0]*e1[2], e0[0]*e1[1]-e0[1]*e1[0]};
+      faces[num_faces].area = n[0]*n[0]+n[1]*n[1]+n[2]*n[2];
+      faces[num_faces].offset = k;
+      num_faces++;
+    }
+  }
+  qsort(faces, num_faces, sizeof(mesh_face_area_t), _mesh_compare_area);
+
+  mesh->occluder_triangles = (num_faces < MESH_OCCLUDER_TRIANGLES) ? num_faces : MESH_OCCLUDER_TRIANGLES;
+  mesh->occluder = (GLfloat*)malloc(sizeof(GLfloat)*9*(mesh->occluder_triangles+1));
+  for(uint64_t t = 0; t < mesh->occluder_triangles; t++) {
+    for(uint64_t v = 0; v < 3; v++) {
+      GLfloat *pos = (GLfloat*)array_at(mesh->vattributes, (*((GLuint*)array_at(mesh->indices, faces[t].offset+v)))*3);
+      memcpy(mesh->occluder+(t*3+v)*3, pos, sizeof(GLfloat)*3);
+    }
+  }
+
+  free(faces);
 }
 
 void _mesh_init_material(material_t *mtl) {
@@ -52,8 +208,9 @@ void _mesh_init_material(material_t *mtl) {
   mtl->specular[0] = 1.0f, mtl->specular[1] = 1.0f, mtl->specular[2] = 1.0f;
   mtl->shininess = 80.0f;
   mtl->transparency = 1.0f;
-  mtl->tex.texID = 0;
-  mtl->tex.use_texture = GL_FALSE;
+  mtl->tex = NULL;
+  mtl->use_texture = GL_FALSE;
+  mtl->layer = -1;
 }
 
 void _mesh_create_material_group(mesh_t *mesh) {
@@ -69,6 +226,11 @@ void _mesh_create_material_group(mesh_t *mesh) {
   }
   grp.count = 0;
 
+  grp.center[0] = 0.0f, grp.center[1] = 0.0f, grp.center[2] = 0.0f;
+  grp.radius = 0.0f;
+  grp.uv_density = 0.0f;
+  grp.block_offset = 0;
+
   // Default values for the material in case none exist
   _mesh_init_material(&grp.mtl);
 
@@ -76,47 +238,6 @@ void _mesh_create_material_group(mesh_t *mesh) {
   array_append(mesh->mtl_grps, &grp);
 }
 
-void _mesh_load_texture(mesh_t *mesh, material_t *mtl, const char *tex_filename) {
-  // Load the BMP
-  mtl->tex.use_texture = GL_FALSE;
-  SDL_Surface *surface = SDL_LoadBMP(tex_filename);
-
-  // Make sure the file exists and was loaded properly
-  if(surface == NULL) {
-    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Error reading texture file: %s\n", tex_filename);
-    return;
-  }
-
-  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Size of \'%s\': %u bytes, dimensions: %u x %u pixels\n", tex_filename, surface->w*surface->h*surface->format->BytesPerPixel, surface->w, surface->h);
-  
-  // Convert the surface to RGBA
-  SDL_Surface *texture = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA8888, 0);
-  if(surface != NULL) SDL_FreeSurface(surface);
- 
-  glBindVertexArray(mesh->vao);
-
-  // Generate the texture handle
-  glGenTextures(1, &mtl->tex.texID);
-  glBindTexture(GL_TEXTURE_2D, mtl->tex.texID);
-
-  // Set the texture parameters
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-  // Upload the texture pixel data
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, (GLsizei)texture->w, (GLsizei)texture->h, 0, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8, texture->pixels);
-
-  // Unbind the texture
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glBindVertexArray(0);
-
-  // Free the surface
-  mtl->tex.use_texture = GL_TRUE;
-  SDL_FreeSurface(texture);
-}
-
 bool _mesh_load_material(mesh_t *mesh, const char *mtl_filename, array_t *mtl_list) {
   // Initialize the parser struct
   mtl_parser_t p;
@@ -196,8 +317,10 @@ bool _mesh_load_material(mesh_t *mesh, const char *mtl_filename, array_t *mtl_li
         array_copy(texname, p.token.lexeme);
         array_prepend_str(texname, "resources/");
         
-        // Load the texture from the file
-        _mesh_load_texture(mesh, &mtl_def->mtl, array_data(texname));
+        // Load the texture from the file, or reuse it if it is already loaded
+        if(mtl_def->mtl.tex != NULL) texture_release(mtl_def->mtl.tex);
+        mtl_def->mtl.tex = texture_acquire(array_data(texname));
+        mtl_def->mtl.use_texture = (mtl_def->mtl.tex != NULL) ? GL_TRUE : GL_FALSE;
         array_delete(texname);
         break;
       }
@@ -212,7 +335,331 @@ bool _mesh_load_material(mesh_t *mesh, const char *mtl_filename, array_t *mtl_li
   return true;
 }
 
-bool mesh_load(mesh_t *mesh, const char *objfile) {
+bool _mesh_material_equal(const material_t *a, const material_t *b) {
+  return memcmp(a->diffuse, b->diffuse, sizeof(a->diffuse)) == 0 && memcmp(a->ambient, b->ambient, sizeof(a->ambient)) == 0 &&
+    memcmp(a->specular, b->specular, sizeof(a->specular)) == 0 && a->shininess == b->shininess &&
+    a->transparency == b->transparency && a->tex == b->tex && a->use_texture == b->use_texture && a->layer == b->layer;
+}
+
+// Gather the indices of all the groups sharing a material so each material is drawn with a single call
+void _mesh_merge_groups(mesh_t *mesh) {
+  size_t num_grps = array_size(mesh->mtl_grps);
+  array_t *grps = array_create(num_grps, sizeof(material_group_t));
+  array_t *indices = array_create(array_size(mesh->indices), sizeof(GLuint));
+  bool *merged = (bool*)calloc(num_grps+1, sizeof(bool));
+
+  for(uint64_t i = 0; i < num_grps; i++) {
+    if(merged[i]) continue;
+
+    material_group_t grp = *((material_group_t*)array_at(mesh->mtl_grps, i));
+    grp.offset = (GLuint)array_size(indices);
+    grp.count = 0;
+
+    for(uint64_t j = i; j < num_grps; j++) {
+      material_group_t *src = (material_group_t*)array_at(mesh->mtl_grps, j);
+      if(merged[j] || !_mesh_material_equal(&grp.mtl, &src->mtl)) continue;
+
+      for(uint64_t k = src->offset; k < src->offset+src->count; k++) array_append(indices, array_at(mesh->indices, k));
+      grp.count += src->count;
+      merged[j] = true;
+
+      // The merged group keeps the first group's texture reference
+      if(j != i && src->mtl.tex != NULL) texture_release(src->mtl.tex);
+    }
+
+    array_append(grps, &grp);
+  }
+
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Merged %llu material groups into %llu\n", (unsigned long long)num_grps, (unsigned long long)array_size(grps));
+
+  array_delete(mesh->mtl_grps);
+  array_delete(mesh->indices);
+  mesh->mtl_grps = grps;
+  mesh->indices = indices;
+  free(merged);
+}
+
+// Packs the textures of the textured groups into one atlas texture and remaps their texture coordinates into it.
+// Groups whose coordinates leave the [0, 1] range rely on wrapping and keep their own texture
+void _mesh_build_atlas(mesh_t *mesh, const char *objfile) {
+  size_t num_grps = array_size(mesh->mtl_grps);
+  size_t num_verts = array_size(mesh->vattributes)/3;
+
+  // Index of each group's image in the atlas, -1 if the group stays out of it
+  int64_t *grp_rect = (int64_t*)malloc(sizeof(int64_t)*(num_grps+1));
+  array_t *textures = array_create(8, sizeof(texture_t*));
+
+  for(uint64_t g = 0; g < num_grps; g++) {
+    material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, g);
+    grp_rect[g] = -1;
+    if(grp->mtl.tex == NULL) continue;
+
+    bool inside = true;
+    for(uint64_t k = grp->offset; k < grp->offset+grp->count && inside; k++) {
+      GLfloat *uv = (GLfloat*)array_at(mesh->vattributes, (*((GLuint*)array_at(mesh->indices, k)))*3+1);
+      for(uint64_t c = 0; c < 2; c++) {
+        if(uv[c] < -MESH_ATLAS_UV_EPSILON || uv[c] > 1.0f+MESH_ATLAS_UV_EPSILON) inside = false;
+      }
+    }
+
+    if(!inside) {
+      SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Texture \'%s\' wraps, leaving it out of the atlas\n", grp->mtl.tex->path);
+      continue;
+    }
+
+    for(uint64_t i = 0; i < array_size(textures) && grp_rect[g] < 0; i++) {
+      if(*((texture_t**)array_at(textures, i)) == grp->mtl.tex) grp_rect[g] = (int64_t)i;
+    }
+    if(grp_rect[g] < 0) {
+      grp_rect[g] = (int64_t)array_size(textures);
+      array_append(textures, &grp->mtl.tex);
+    }
+  }
+
+  // Nothing to gain from an atlas with a single image
+  size_t count = array_size(textures);
+  if(count < 2) {
+    free(grp_rect);
+    array_delete(textures);
+    return;
+  }
+
+  // The registry only keeps the GL textures so the images have to be decoded again
+  image_t *images = (image_t*)calloc(count, sizeof(image_t));
+  atlas_rect_t *rects = (atlas_rect_t*)calloc(count, sizeof(atlas_rect_t));
+  uint64_t area = 0;
+  bool loaded = true;
+
+  for(uint64_t i = 0; i < count && loaded; i++) {
+    texture_t *tex = *((texture_t**)array_at(textures, i));
+    loaded = image_load(&images[i], tex->path);
+    rects[i].width = images[i].width;
+    rects[i].height = images[i].height;
+    area += (uint64_t)(images[i].width+2*MESH_ATLAS_PADDING)*(images[i].height+2*MESH_ATLAS_PADDING);
+  }
+
+  // Start from the smallest power of two size that could hold all the images and grow it until they pack
+  GLint max_size;
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+
+  uint32_t width = 1, height = 1;
+  bool packed = false;
+  while((uint64_t)width*height < area) {
+    if(width <= height) width <<= 1;
+    else height <<= 1;
+  }
+  while(loaded && width <= (uint32_t)max_size && height <= (uint32_t)max_size) {
+    if((packed = atlas_pack(rects, count, width, height, MESH_ATLAS_PADDING))) break;
+    if(width <= height) width <<= 1;
+    else height <<= 1;
+  }
+
+  if(packed) {
+    image_t atlas;
+    memset(&atlas, 0, sizeof(image_t));
+    atlas.width = width;
+    atlas.height = height;
+    atlas.levels = 1;
+    atlas.pixels[0] = (uint8_t*)calloc((size_t)width*height, 4);
+
+    for(uint64_t i = 0; i < count; i++) atlas_blit(&atlas, &images[i], &rects[i], MESH_ATLAS_PADDING);
+
+    // Drop the levels where the padding is less than a texel
+    image_generate_mipmaps(&atlas);
+    uint32_t levels = 1;
+    for(uint32_t padding = MESH_ATLAS_PADDING; padding > 1; padding >>= 1) levels++;
+    while(atlas.levels > levels) {
+      atlas.levels--;
+      free(atlas.pixels[atlas.levels]);
+      atlas.pixels[atlas.levels] = NULL;
+    }
+
+    char name[256];
+    snprintf(name, 256, "atlas:%s", objfile);
+    texture_t *atlas_tex = texture_create(name, &atlas);
+    image_free(&atlas);
+
+    // Which atlas image each vertex's texture coordinate has been remapped to. -1 if untouched, -2 if used by a group outside the atlas
+    int64_t *owner = (int64_t*)malloc(sizeof(int64_t)*(num_verts+1));
+    GLfloat *orig_uv = (GLfloat*)malloc(sizeof(GLfloat)*3*(num_verts+1));
+    int64_t *dup_rect = (int64_t*)malloc(sizeof(int64_t)*(num_verts+1));
+    GLuint *dup_vertex = (GLuint*)malloc(sizeof(GLuint)*(num_verts+1));
+
+    for(uint64_t v = 0; v < num_verts; v++) {
+      owner[v] = -1, dup_rect[v] = -1;
+      memcpy(&orig_uv[v*3], array_at(mesh->vattributes, v*3+1), 3*sizeof(GLfloat));
+    }
+    for(uint64_t g = 0; g < num_grps; g++) {
+      material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, g);
+      if(grp_rect[g] >= 0) continue;
+      for(uint64_t k = grp->offset; k < grp->offset+grp->count; k++) owner[*((GLuint*)array_at(mesh->indices, k))] = -2;
+    }
+
+    for(uint64_t g = 0; g < num_grps; g++) {
+      material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, g);
+      int64_t r = grp_rect[g];
+      if(r < 0) continue;
+
+      for(uint64_t k = grp->offset; k < grp->offset+grp->count; k++) {
+        GLuint v = *((GLuint*)array_at(mesh->indices, k));
+        if(owner[v] == r) continue;
+
+        // A vertex shared with a group that uses another image gets its own copy
+        GLuint index = v;
+        if(owner[v] != -1) {
+          if(dup_rect[v] == r) {
+            array_set(mesh->indices, k, &dup_vertex[v]);
+            continue;
+          }
+
+          index = (GLuint)(array_size(mesh->vattributes)/3);
+          GLfloat attr[3];
+          memcpy(attr, array_at(mesh->vattributes, v*3), 3*sizeof(GLfloat));
+          array_append(mesh->vattributes, attr);
+          array_append(mesh->vattributes, &orig_uv[v*3]);
+          memcpy(attr, array_at(mesh->vattributes, v*3+2), 3*sizeof(GLfloat));
+          array_append(mesh->vattributes, attr);
+
+          dup_rect[v] = r, dup_vertex[v] = index;
+          array_set(mesh->indices, k, &index);
+        } else {
+          owner[v] = r;
+        }
+
+        // Scale and offset the coordinate into the image's rectangle
+        GLfloat *uv = (GLfloat*)array_at(mesh->vattributes, index*3+1);
+        GLfloat u = (orig_uv[v*3] < 0.0f) ? 0.0f : ((orig_uv[v*3] > 1.0f) ? 1.0f : orig_uv[v*3]);
+        GLfloat t = (orig_uv[v*3+1] < 0.0f) ? 0.0f : ((orig_uv[v*3+1] > 1.0f) ? 1.0f : orig_uv[v*3+1]);
+        uv[0] = ((GLfloat)rects[r].x+u*(GLfloat)rects[r].width)/(GLfloat)width;
+        uv[1] = ((GLfloat)rects[r].y+t*(GLfloat)rects[r].height)/(GLfloat)height;
+      }
+
+      // Point the group at the atlas
+      texture_release(grp->mtl.tex);
+      grp->mtl.tex = atlas_tex;
+      texture_retain(atlas_tex);
+    }
+
+    // The groups hold the references now
+    texture_release(atlas_tex);
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Packed %llu textures into a %u x %u atlas\n", (unsigned long long)count, width, height);
+
+    free(owner);
+    free(orig_uv);
+    free(dup_rect);
+    free(dup_vertex);
+
+    // Groups that only differed by their texture can now be drawn together
+    _mesh_merge_groups(mesh);
+  } else {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not build a texture atlas for %s\n", objfile);
+  }
+
+  for(uint64_t i = 0; i < count; i++) image_free(&images[i]);
+  free(images);
+  free(rects);
+  free(grp_rect);
+  array_delete(textures);
+}
+
+void _mesh_build_texture_array(mesh_t *mesh, const char *objfile) {
+  size_t num_grps = array_size(mesh->mtl_grps);
+  array_t *textures = array_create(8, sizeof(texture_t*));
+
+  // The distinct 2D textures of the mesh that were loaded from an image file. The layers are decoded from those files
+  // again, a texture made in memory like the atlas has nothing to decode
+  for(uint64_t g = 0; g < num_grps; g++) {
+    material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, g);
+    if(grp->mtl.tex == NULL || grp->mtl.tex->target != GL_TEXTURE_2D || !grp->mtl.tex->reloadable) continue;
+
+    bool found = false;
+    for(uint64_t i = 0; i < array_size(textures) && !found; i++) found = (*((texture_t**)array_at(textures, i)) == grp->mtl.tex);
+    if(!found) array_append(textures, &grp->mtl.tex);
+  }
+
+  // Layers have to be the same size, so the array takes the size most of the textures share
+  size_t num_textures = array_size(textures);
+  uint32_t width = 0, height = 0;
+  size_t count = 0;
+  for(uint64_t i = 0; i < num_textures; i++) {
+    texture_t *tex = *((texture_t**)array_at(textures, i));
+    size_t same = 0;
+    for(uint64_t j = 0; j < num_textures; j++) {
+      texture_t *other = *((texture_t**)array_at(textures, j));
+      if(other->width == tex->width && other->height == tex->height) same++;
+    }
+    if(same > count) count = same, width = tex->width, height = tex->height;
+  }
+
+  GLint max_layers;
+  glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+
+  // Nothing to gain from an array with a single layer
+  if(count < 2 || count > (size_t)max_layers) {
+    array_delete(textures);
+    return;
+  }
+
+  // The registry only keeps the GL textures so the images have to be decoded again
+  texture_t **layers = (texture_t**)malloc(sizeof(texture_t*)*count);
+  image_t *images = (image_t*)calloc(count, sizeof(image_t));
+  bool loaded = true;
+
+  count = 0;
+  for(uint64_t i = 0; i < num_textures && loaded; i++) {
+    texture_t *tex = *((texture_t**)array_at(textures, i));
+    if(tex->width != width || tex->height != height) continue;
+
+    layers[count] = tex;
+    loaded = image_load(&images[count], tex->path);
+    if(loaded) image_generate_mipmaps(&images[count]);
+    count++;
+  }
+
+  if(loaded) {
+    char name[256];
+    snprintf(name, 256, "array:%s", objfile);
+    texture_t *array_tex = texture_create_array(name, images, (uint32_t)count);
+
+    // Point the groups at their layer of the array
+    for(uint64_t g = 0; g < num_grps; g++) {
+      material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, g);
+      for(uint64_t i = 0; i < count; i++) {
+        if(grp->mtl.tex != layers[i]) continue;
+
+        texture_release(grp->mtl.tex);
+        grp->mtl.tex = array_tex;
+        grp->mtl.layer = (GLint)i;
+        texture_retain(array_tex);
+        break;
+      }
+    }
+
+    // The groups hold the references now
+    texture_release(array_tex);
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Packed %llu textures of %u x %u into a texture array\n", (unsigned long long)count, width, height);
+  } else {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not build a texture array for %s\n", objfile);
+  }
+
+  for(uint64_t i = 0; i < count; i++) image_free(&images[i]);
+  free(images);
+  free(layers);
+  array_delete(textures);
+}
+
+void mesh_enable_atlas(bool enable) {
+  atlas_enabled = enable;
+}
+
+void mesh_enable_texture_arrays(bool enable) {
+  texture_arrays_enabled = enable;
+}
+
+// Everything up to the GL objects. Safe to run on a loader thread while texture uploads are deferred
+bool mesh_parse(mesh_t *mesh, const char *objfile) {
   // Initialize the parser struct
   obj_parser_t p;
   if(obj_parser_init(&p, objfile) != 0) {
@@ -224,6 +671,15 @@ bool mesh_load(mesh_t *mesh, const char *objfile) {
   mesh->vattributes = array_create(256, 3*sizeof(GLfloat));
   mesh->indices = array_create(256, sizeof(GLuint));
   mesh->mtl_grps = array_create(2, sizeof(material_group_t));
+  mesh->num_faces = 0;
+  mesh->instance_vbo = 0;
+  mesh->num_instances = 0;
+  mesh->instance_models = NULL;
+  mesh->occluder = NULL;
+  mesh->occluder_triangles = 0;
+  mesh->visible_models = NULL;
+  mesh->num_uploaded_instances = 0;
+  cull_boxes_create(&mesh->instance_boxes, 0);
   
   // Grab the vertex attribute data and place them in separate arrays
   array_t *uv = array_create(256, 3*sizeof(GLfloat));
@@ -262,6 +718,8 @@ bool mesh_load(mesh_t *mesh, const char *objfile) {
     }
   }
 
+  mesh->has_normals = (array_size(normals) > 0);
+
   // If a mtllib file was specified, parse it
   array_t *mtl_list = array_create(2, sizeof(material_def_t));
   if(array_size(mtllib) > 0) _mesh_load_material(mesh, array_data(mtllib), mtl_list);
@@ -364,8 +822,9 @@ bool mesh_load(mesh_t *mesh, const char *objfile) {
           if(strcmp((char*)array_data(mtl_def->mtl_name), (char*)array_data(mtl_name)) == 0) {
             material_group_t *grp = (material_group_t*)array_back(mesh->mtl_grps);
 
-            // Copy the material data
+            // Copy the material data, the group holds its own reference to the texture
             memcpy(&grp->mtl, &mtl_def->mtl, sizeof(material_t));
+            if(grp->mtl.tex != NULL) texture_retain(grp->mtl.tex);
             found_mtl = true;
             break;
           }
@@ -395,34 +854,152 @@ bool mesh_load(mesh_t *mesh, const char *objfile) {
   for(uint64_t i = 0; i < array_size(mtl_list); i++) {
     material_def_t *mtl_def = (material_def_t*)array_at(mtl_list, i);
     array_delete(mtl_def->mtl_name);
+    if(mtl_def->mtl.tex != NULL) texture_release(mtl_def->mtl.tex);
   }
   array_delete(mtl_list);
   
   // Delete the parser struct
   obj_parser_free(&p);
 
+  // Occluders only depend on the faces and on which groups are transparent, which the atlas does not change
+  _mesh_gen_occluder(mesh);
+
+  return true;
+}
+
+// The rest of the loading, on the context thread once the textures of the mesh are uploaded
+void mesh_upload(mesh_t *mesh, const char *objfile) {
+  // Collapse the textured groups into an atlas if requested
+  if(atlas_enabled) _mesh_build_atlas(mesh, objfile);
+
+  // Move the textures that are left and share a size into a texture array
+  if(texture_arrays_enabled) _mesh_build_texture_array(mesh, objfile);
+
+  // The texture streamer needs the screen size of each group
+  _mesh_gen_bounds(mesh);
+
   // Generate and fill the OpenGL buffers
   _mesh_gen_buffers(mesh);
 
   // Print some stats
-  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Mesh loaded with %lu vertex attributes and %lu faces\n", array_size(mesh->vattributes)/3, mesh->num_faces);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Mesh loaded with %llu vertex attributes and %llu faces\n", (unsigned long long)(array_size(mesh->vattributes)/3), (unsigned long long)mesh->num_faces);
+}
 
+bool mesh_load(mesh_t *mesh, const char *objfile) {
+  if(!mesh_parse(mesh, objfile)) return false;
+  mesh_upload(mesh, objfile);
   return true;
 }
 
+// Bounding sphere of the instance origins, around the center of their bounding box
+void _mesh_instance_bounds(mesh_t *mesh, const mat4_t *models, uint32_t count) {
+  GLfloat lo[3] = {0.0f, 0.0f, 0.0f}, hi[3] = {0.0f, 0.0f, 0.0f};
+  for(uint32_t i = 0; i < count; i++) {
+    for(uint32_t k = 0; k < 3; k++) {
+      GLfloat t = models[i].m[12+k];
+      if(i == 0 || t < lo[k]) lo[k] = t;
+      if(i == 0 || t > hi[k]) hi[k] = t;
+    }
+  }
+
+  for(uint32_t k = 0; k < 3; k++) mesh->instance_center[k] = (lo[k]+hi[k])*0.5f;
+  mesh->instance_radius = sqrtf((hi[0]-lo[0])*(hi[0]-lo[0])+(hi[1]-lo[1])*(hi[1]-lo[1])+(hi[2]-lo[2])*(hi[2]-lo[2]))*0.5f;
+}
+
+void mesh_set_instances(mesh_t *mesh, const mat4_t *models, uint32_t count) {
+  if(mesh->instance_vbo == 0) glGenBuffers(1, &mesh->instance_vbo);
+  glstate_bind_buffer(GL_ARRAY_BUFFER, mesh->instance_vbo);
+  glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)(count*sizeof(mat4_t)), models, GL_STATIC_DRAW);
+
+  // The VAOs are shared with every mesh, the render queue points their instance attributes at the buffer for each draw
+  mesh->num_instances = count;
+  _mesh_instance_bounds(mesh, models, count);
+
+  // Keep the models around to pack the visible ones, and box the mesh as each instance places it for culling
+  free(mesh->instance_models);
+  free(mesh->visible_models);
+  cull_boxes_delete(&mesh->instance_boxes);
+  mesh->instance_models = (mat4_t*)malloc(count*sizeof(mat4_t));
+  mesh->visible_models = (mat4_t*)malloc(count*sizeof(mat4_t));
+  memcpy(mesh->instance_models, models, count*sizeof(mat4_t));
+  mesh->num_uploaded_instances = count;
+
+  cull_boxes_create(&mesh->instance_boxes, count);
+  for(uint32_t i = 0; i < count; i++) {
+    GLfloat box_lo[3], box_hi[3];
+    cull_transform_box(&models[i], mesh->lo, mesh->hi, box_lo, box_hi);
+    cull_boxes_set(&mesh->instance_boxes, i, box_lo, box_hi);
+  }
+}
+
+// Replaces the models of count instances, given by index in any order. Runs of consecutive indices are uploaded
+// together, and only while the buffer holds every instance in order: packed visible ones are packed again from the new
+// models on the next upload
+void mesh_update_instances(mesh_t *mesh, const uint32_t *instances, const mat4_t *models, uint32_t count) {
+  for(uint32_t i = 0; i < count; i++) {
+    uint32_t instance = instances[i];
+    mesh->instance_models[instance] = models[i];
+    GLfloat box_lo[3], box_hi[3];
+    cull_transform_box(&models[i], mesh->lo, mesh->hi, box_lo, box_hi);
+    cull_boxes_set(&mesh->instance_boxes, instance, box_lo, box_hi);
+  }
+  _mesh_instance_bounds(mesh, mesh->instance_models, mesh->num_instances);
+
+  if(mesh->num_uploaded_instances != mesh->num_instances) return;
+  glstate_bind_buffer(GL_ARRAY_BUFFER, mesh->instance_vbo);
+  uint32_t i = 0;
+  while(i < count) {
+    uint32_t first = instances[i], run = 1;
+    for(i++; i < count && instances[i] == first+run; i++) run++;
+    glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)(first*sizeof(mat4_t)), (GLsizeiptr)(run*sizeof(mat4_t)), &mesh->instance_models[first]);
+  }
+}
+
+uint32_t mesh_upload_visible_instances(mesh_t *mesh, const uint8_t *visible, uint32_t num_visible) {
+  // The buffer already holds every instance in order if nothing was culled this frame or the last
+  if(num_visible == mesh->num_instances && mesh->num_uploaded_instances == mesh->num_instances) return num_visible;
+
+  uint32_t n = 0;
+  for(uint32_t i = 0; i < mesh->num_instances; i++) {
+    if(visible[i]) mesh->visible_models[n++] = mesh->instance_models[i];
+  }
+
+  if(n > 0) {
+    glstate_bind_buffer(GL_ARRAY_BUFFER, mesh->instance_vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, (GLsizeiptr)(n*sizeof(mat4_t)), mesh->visible_models);
+  }
+  mesh->num_uploaded_instances = n;
+
+  return n;
+}
+
+// Use of the geometry pool shared by the meshes, all zero if no mesh is loaded
+void mesh_geometry_stats(geompool_stats_t *stats) {
+  if(geometry_pool != NULL) geompool_stats(geometry_pool, stats);
+  else memset(stats, 0, sizeof(geompool_stats_t));
+}
+
 void mesh_bind(mesh_t *mesh) {
-  glBindVertexArray(mesh->vao);
+  glstate_bind_vertex_array(mesh->vao);
 }
 
 void mesh_unbind() {
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glBindVertexArray(0);
+  glstate_bind_texture(0, GL_TEXTURE_2D, 0);
+  glstate_bind_vertex_array(0);
 }
 
 void mesh_delete(mesh_t *mesh) {
-  // Delete the vertex & index buffer object
-  glDeleteBuffers(1, &mesh->vbo);
-  glDeleteBuffers(1, &mesh->ibo);
+  // Give the geometry back to the pool, which goes with the last mesh
+  if(geometry_pool != NULL) {
+    geompool_free(geometry_pool, &mesh->geometry);
+    if(geompool_allocations(geometry_pool) == 0) {
+      geompool_delete(geometry_pool);
+      geometry_pool = NULL;
+    }
+  }
+
+  GLuint buffers[2] = {mesh->mtl_ubo, mesh->instance_vbo};
+  glstate_delete_buffers(2, buffers);
 
   // Delete the vertex attribute array
   array_delete(mesh->vattributes);
@@ -435,14 +1012,18 @@ void mesh_delete(mesh_t *mesh) {
   for(uint64_t i = 0; i < size; i++) {
     material_group_t *grp = (material_group_t*)array_at(mesh->mtl_grps, i);
 
-    // Delete the texture if it exists
-    glDeleteTextures(1, &grp->mtl.tex.texID);
+    // Release the texture if it exists, it is deleted once no material uses it anymore
+    if(grp->mtl.tex != NULL) texture_release(grp->mtl.tex);
   }
   
   // Delete the material group array
   array_delete(mesh->mtl_grps);
 
-  // Finally delete the vertex array object
-  glDeleteVertexArrays(1, &mesh->vao);
+  // Delete the culling data
+  cull_boxes_delete(&mesh->group_boxes);
+  cull_boxes_delete(&mesh->instance_boxes);
+  free(mesh->instance_models);
+  free(mesh->visible_models);
+  free(mesh->occluder);
 }
 
@@ -142,7 +142,7 @@ int32_t mtl_parser_init(mtl_parser_t *p, const char *filename) {
   size_t fsize = (size_t)ftell(f);
   fseek(f, 0, SEEK_SET);
 
-  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Size of \'%s\' file: %lu bytes\n", filename, fsize);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Size of \'%s\' file: %llu bytes\n", filename, (unsigned long long)fsize);
 
   // Read the whole file into memory
   char *fstring = (char*)malloc(fsize+1);
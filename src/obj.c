@@ -270,7 +270,7 @@ int32_t obj_parser_init(obj_parser_t *p, const char *filename) {
   size_t fsize = (size_t)ftell(f);
   fseek(f, 0, SEEK_SET);
 
-  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Size of \'%s\' file: %lu bytes\n", filename, fsize);
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Size of \'%s\' file: %llu bytes\n", filename, (unsigned long long)fsize);
 
   // Read the whole file into memory
   char *fstring = (char*)malloc(fsize+1);
@@ -0,0 +1,346 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <SDL2/SDL.h>
+
+#include "occlusion.h"
+#include "array.h"
+#include "timer.h"
+
+// The depth buffer keeps, for each pixel, the nearest occluder at its center. Triangles write the farthest depth their
+// plane reaches in the pixel, and boxes are tested against the pixels around their rectangle as well, so an occluder
+// only covering part of a pixel does not hide what shows past its edge. Depths are window depths in [0, 1]
+
+// A triangle set up for rasterization in pixel coordinates. The edge functions are positive inside, and shared edges
+// give exactly opposite values so no pixel center falls between the triangles of an occluder
+typedef struct {
+  GLfloat a[3], b[3], c[3];
+  GLfloat dzdx, dzdy, z0;
+
+  // Inclusive bounds of the pixels covered
+  int32_t x0, y0, x1, y1;
+} occlusion_triangle_t;
+
+struct occlusion {
+  uint32_t width, height;
+  uint32_t tiles_x, tiles_y;
+  GLfloat *depth;
+
+  // Triangles added since the last clear and, for each tile, the indices of the ones overlapping it
+  array_t *triangles;
+  array_t **bins;
+
+  threadpool_t *pool;
+  occlusion_stats_t stats;
+};
+
+typedef struct {
+  occlusion_t *occ;
+  const mat4_t *mvp;
+  const cull_boxes_t *boxes;
+  uint8_t *visible;
+} occlusion_test_job_t;
+
+occlusion_t* occlusion_create(uint32_t width, uint32_t height, threadpool_t *pool) {
+  occlusion_t *occ = (occlusion_t*)malloc(sizeof(occlusion_t));
+  assert(occ != NULL);
+
+  // Whole tiles only, the pixels past the requested size are never covered by anything on screen
+  occ->tiles_x = (width+OCCLUSION_TILE_SIZE-1)/OCCLUSION_TILE_SIZE;
+  occ->tiles_y = (height+OCCLUSION_TILE_SIZE-1)/OCCLUSION_TILE_SIZE;
+  if(occ->tiles_x == 0) occ->tiles_x = 1;
+  if(occ->tiles_y == 0) occ->tiles_y = 1;
+  occ->width = occ->tiles_x*OCCLUSION_TILE_SIZE;
+  occ->height = occ->tiles_y*OCCLUSION_TILE_SIZE;
+  occ->depth = (GLfloat*)malloc(sizeof(GLfloat)*occ->width*occ->height);
+
+  occ->triangles = array_create(256, sizeof(occlusion_triangle_t));
+  occ->bins = (array_t**)malloc(sizeof(array_t*)*occ->tiles_x*occ->tiles_y);
+  for(uint32_t t = 0; t < occ->tiles_x*occ->tiles_y; t++) occ->bins[t] = array_create(64, sizeof(uint32_t));
+
+  occ->pool = pool;
+  occlusion_clear(occ);
+
+  return occ;
+}
+
+void occlusion_clear(occlusion_t *occ) {
+  for(size_t i = 0; i < (size_t)occ->width*occ->height; i++) occ->depth[i] = 1.0f;
+  array_clear(occ->triangles);
+  for(uint32_t t = 0; t < occ->tiles_x*occ->tiles_y; t++) array_clear(occ->bins[t]);
+  memset(&occ->stats, 0, sizeof(occlusion_stats_t));
+}
+
+// Projects a point to pixel coordinates and window depth. False if it is not in front of the near plane
+bool _occlusion_project(const occlusion_t *occ, const mat4_t *mvp, const GLfloat *p, GLfloat *out) {
+  vec4_t v = {p[0], p[1], p[2], 1.0f};
+  vec4_t clip = mat4_multv(mvp, &v);
+  if(clip.w <= 0.0f || clip.z < -clip.w) return false;
+
+  out[0] = (clip.x/clip.w*0.5f+0.5f)*(GLfloat)occ->width;
+  out[1] = (clip.y/clip.w*0.5f+0.5f)*(GLfloat)occ->height;
+  out[2] = clip.z/clip.w*0.5f+0.5f;
+  return true;
+}
+
+void _occlusion_setup(occlusion_t *occ, GLfloat v[3][3]) {
+  GLfloat area = (v[1][0]-v[0][0])*(v[2][1]-v[0][1])-(v[2][0]-v[0][0])*(v[1][1]-v[0][1]);
+  if(fabsf(area) < 1e-6f) return;
+
+  // Either winding occludes, make it counter clockwise so the inside is where all the edge functions are positive
+  if(area < 0.0f) {
+    for(uint32_t k = 0; k < 3; k++) {
+      GLfloat t = v[1][k];
+      v[1][k] = v[2][k];
+      v[2][k] = t;
+    }
+    area = -area;
+  }
+
+  occlusion_triangle_t tri;
+  for(uint32_t e = 0; e < 3; e++) {
+    const GLfloat *p = v[e], *q = v[(e+1)%3];
+    tri.a[e] = p[1]-q[1];
+    tri.b[e] = q[0]-p[0];
+    tri.c[e] = p[0]*q[1]-q[0]*p[1];
+  }
+
+  tri.dzdx = ((v[1][2]-v[0][2])*(v[2][1]-v[0][1])-(v[2][2]-v[0][2])*(v[1][1]-v[0][1]))/area;
+  tri.dzdy = ((v[2][2]-v[0][2])*(v[1][0]-v[0][0])-(v[1][2]-v[0][2])*(v[2][0]-v[0][0]))/area;
+  tri.z0 = v[0][2]-tri.dzdx*v[0][0]-tri.dzdy*v[0][1]+0.5f*(fabsf(tri.dzdx)+fabsf(tri.dzdy));
+
+  GLfloat lo[2], hi[2];
+  for(uint32_t k = 0; k < 2; k++) {
+    lo[k] = fminf(v[0][k], fminf(v[1][k], v[2][k]));
+    hi[k] = fmaxf(v[0][k], fmaxf(v[1][k], v[2][k]));
+  }
+  if(hi[0] < 0.0f || hi[1] < 0.0f || lo[0] >= (GLfloat)occ->width || lo[1] >= (GLfloat)occ->height) return;
+
+  tri.x0 = (lo[0] > 0.0f) ? (int32_t)lo[0] : 0;
+  tri.y0 = (lo[1] > 0.0f) ? (int32_t)lo[1] : 0;
+  tri.x1 = (hi[0] < (GLfloat)occ->width) ? (int32_t)hi[0] : (int32_t)occ->width-1;
+  tri.y1 = (hi[1] < (GLfloat)occ->height) ? (int32_t)hi[1] : (int32_t)occ->height-1;
+
+  // Bin the triangle into every tile its bounds overlap
+  uint32_t index = (uint32_t)array_size(occ->triangles);
+  array_append(occ->triangles, &tri);
+  for(int32_t ty = tri.y0/OCCLUSION_TILE_SIZE; ty <= tri.y1/OCCLUSION_TILE_SIZE; ty++) {
+    for(int32_t tx = tri.x0/OCCLUSION_TILE_SIZE; tx <= tri.x1/OCCLUSION_TILE_SIZE; tx++) {
+      array_append(occ->bins[(uint32_t)ty*occ->tiles_x+(uint32_t)tx], &index);
+    }
+  }
+}
+
+void occlusion_add_triangles(occlusion_t *occ, const mat4_t *mvp, const GLfloat *positions, size_t num_triangles) {
+  for(size_t i = 0; i < num_triangles; i++) {
+    // Triangles crossing the near plane are dropped rather than clipped, an occluder less only hides less
+    GLfloat v[3][3];
+    bool in_front = true;
+    for(uint32_t k = 0; k < 3 && in_front; k++) in_front = _occlusion_project(occ, mvp, positions+(i*3+k)*3, v[k]);
+    if(!in_front) continue;
+
+    _occlusion_setup(occ, v);
+  }
+  occ->stats.triangles = array_size(occ->triangles);
+}
+
+void _occlusion_raster_tile(void *ctx, uint64_t tile) {
+  occlusion_t *occ = (occlusion_t*)ctx;
+  array_t *bin = occ->bins[tile];
+  int32_t tx0 = (int32_t)(tile%occ->tiles_x)*OCCLUSION_TILE_SIZE, ty0 = (int32_t)(tile/occ->tiles_x)*OCCLUSION_TILE_SIZE;
+  int32_t tx1 = tx0+OCCLUSION_TILE_SIZE-1, ty1 = ty0+OCCLUSION_TILE_SIZE-1;
+
+  for(size_t i = 0; i < array_size(bin); i++) {
+    const occlusion_triangle_t *tri = (const occlusion_triangle_t*)array_at(occ->triangles, *((uint32_t*)array_at(bin, i)));
+    int32_t x0 = (tri->x0 > tx0) ? tri->x0 : tx0, x1 = (tri->x1 < tx1) ? tri->x1 : tx1;
+    int32_t y0 = (tri->y0 > ty0) ? tri->y0 : ty0, y1 = (tri->y1 < ty1) ? tri->y1 : ty1;
+
+    // Whole groups of 4 pixels, the edge functions reject the ones past the bounds. Tiles are a multiple of 4 wide
+    x0 &= ~3;
+
+    for(int32_t y = y0; y <= y1; y++) {
+      GLfloat py = (GLfloat)y+0.5f;
+      GLfloat *row = occ->depth+(size_t)y*occ->width;
+#ifdef __SSE2__
+      __m128 lane = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+      __m128 r0 = _mm_set1_ps(tri->b[0]*py+tri->c[0]), r1 = _mm_set1_ps(tri->b[1]*py+tri->c[1]), r2 = _mm_set1_ps(tri->b[2]*py+tri->c[2]);
+      __m128 rz = _mm_set1_ps(tri->dzdy*py+tri->z0);
+      __m128 a0 = _mm_set1_ps(tri->a[0]), a1 = _mm_set1_ps(tri->a[1]), a2 = _mm_set1_ps(tri->a[2]), dzdx = _mm_set1_ps(tri->dzdx);
+      __m128 zero = _mm_setzero_ps();
+      for(int32_t x = x0; x <= x1; x += 4) {
+        __m128 px = _mm_add_ps(_mm_set1_ps((GLfloat)x), lane);
+        __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), r0), zero), _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), r1), zero)), _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), r2), zero));
+        __m128 old = _mm_loadu_ps(row+x);
+        __m128 z = _mm_min_ps(old, _mm_add_ps(_mm_mul_ps(dzdx, px), rz));
+        _mm_storeu_ps(row+x, _mm_or_ps(_mm_and_ps(inside, z), _mm_andnot_ps(inside, old)));
+      }
+#else
+      for(int32_t x = x0; x <= x1; x++) {
+        GLfloat px = (GLfloat)x+0.5f;
+        bool inside = true;
+        for(uint32_t e = 0; e < 3; e++) inside = inside && (tri->a[e]*px+tri->b[e]*py+tri->c[e] >= 0.0f);
+        GLfloat z = tri->dzdx*px+tri->dzdy*py+tri->z0;
+        if(inside && z < row[x]) row[x] = z;
+      }
+#endif
+    }
+  }
+}
+
+void occlusion_rasterize(occlusion_t *occ) {
+  uint64_t start = SDL_GetPerformanceCounter();
+  threadpool_parallel_for(occ->pool, (uint64_t)occ->tiles_x*occ->tiles_y, _occlusion_raster_tile, occ);
+  occ->stats.raster_ms += timer_elapsed_ms(start);
+}
+
+bool occlusion_test_box(occlusion_t *occ, const mat4_t *mvp, const GLfloat *center, const GLfloat *extent) {
+  // Screen rectangle and nearest depth of the corners
+  GLfloat lo[3] = {INFINITY, INFINITY, INFINITY}, hi[2] = {-INFINITY, -INFINITY};
+  for(uint32_t i = 0; i < 8; i++) {
+    GLfloat corner[3], p[3];
+    for(uint32_t k = 0; k < 3; k++) corner[k] = center[k]+((i >> k) & 1 ? extent[k] : -extent[k]);
+
+    // A box reaching the camera is not hidden by anything in front of it
+    if(!_occlusion_project(occ, mvp, corner, p)) return true;
+
+    for(uint32_t k = 0; k < 3; k++) {
+      if(p[k] < lo[k]) lo[k] = p[k];
+      if(k < 2 && p[k] > hi[k]) hi[k] = p[k];
+    }
+  }
+
+  // Off screen boxes are left to the frustum culling
+  if(hi[0] < 0.0f || hi[1] < 0.0f || lo[0] >= (GLfloat)occ->width || lo[1] >= (GLfloat)occ->height) return true;
+
+  // Every pixel the rectangle touches and their neighbours, widened to groups of 4. More pixels only make the box more
+  // likely to be visible
+  int32_t x0 = (lo[0] > 1.0f) ? (int32_t)lo[0]-1 : 0, y0 = (lo[1] > 1.0f) ? (int32_t)lo[1]-1 : 0;
+  int32_t x1 = (hi[0]+1.0f < (GLfloat)occ->width) ? (int32_t)hi[0]+1 : (int32_t)occ->width-1;
+  int32_t y1 = (hi[1]+1.0f < (GLfloat)occ->height) ? (int32_t)hi[1]+1 : (int32_t)occ->height-1;
+  x0 &= ~3;
+
+  for(int32_t y = y0; y <= y1; y++) {
+    const GLfloat *row = occ->depth+(size_t)y*occ->width;
+#ifdef __SSE2__
+    __m128 z = _mm_set1_ps(lo[2]);
+    for(int32_t x = x0; x <= x1; x += 4) {
+      if(_mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(row+x), z)) != 0) return true;
+    }
+#else
+    for(int32_t x = x0; x <= x1; x++) {
+      if(row[x] >= lo[2]) return true;
+    }
+#endif
+  }
+
+  return false;
+}
+
+void _occlusion_test_job(void *ctx, uint64_t index) {
+  occlusion_test_job_t *job = (occlusion_test_job_t*)ctx;
+  if(!job->visible[index]) return;
+
+  GLfloat center[3] = {job->boxes->center[0][index], job->boxes->center[1][index], job->boxes->center[2][index]};
+  GLfloat extent[3] = {job->boxes->extent[0][index], job->boxes->extent[1][index], job->boxes->extent[2][index]};
+  job->visible[index] = occlusion_test_box(job->occ, job->mvp, center, extent);
+}
+
+size_t occlusion_test_boxes(occlusion_t *occ, const mat4_t *mvp, const cull_boxes_t *boxes, uint8_t *visible) {
+  uint64_t start = SDL_GetPerformanceCounter();
+
+  size_t tested = 0;
+  for(size_t i = 0; i < boxes->count; i++) tested += visible[i];
+
+  // Boxes already culled are skipped
+  occlusion_test_job_t job = {occ, mvp, boxes, visible};
+  threadpool_parallel_for(occ->pool, boxes->count, _occlusion_test_job, &job);
+
+  size_t num_visible = 0;
+  for(size_t i = 0; i < boxes->count; i++) num_visible += visible[i];
+
+  occ->stats.tested += tested;
+  occ->stats.occluded += tested-num_visible;
+  occ->stats.test_ms += timer_elapsed_ms(start);
+
+  return num_visible;
+}
+
+void occlusion_stats(occlusion_t *occ, occlusion_stats_t *stats) {
+  *stats = occ->stats;
+}
+
+void occlusion_delete(occlusion_t *occ) {
+  for(uint32_t t = 0; t < occ->tiles_x*occ->tiles_y; t++) array_delete(occ->bins[t]);
+  free(occ->bins);
+  array_delete(occ->triangles);
+  free(occ->depth);
+  free(occ);
+}
+
+// Checks boxes against a known occluder and times the rasterization of random triangles, returns whether every box
+// came out as expected
+bool occlusion_self_test(threadpool_t *pool) {
+  occlusion_t *occ = occlusion_create(160, 120, pool);
+
+  // With an identity matrix positions are already in clip space. A square over the middle half of the screen at depth 0.5
+  mat4_t mvp = MAT4_IDENTITY;
+  GLfloat square[18] = {-0.5f, -0.5f, 0.0f, 0.5f, -0.5f, 0.0f, 0.5f, 0.5f, 0.0f, -0.5f, -0.5f, 0.0f, 0.5f, 0.5f, 0.0f, -0.5f, 0.5f, 0.0f};
+  occlusion_add_triangles(occ, &mvp, square, 2);
+  occlusion_rasterize(occ);
+
+  struct {
+    GLfloat center[3];
+    GLfloat extent[3];
+    bool visible;
+    const char *name;
+  } cases[] = {
+    {{0.0f, 0.0f, 0.5f}, {0.1f, 0.1f, 0.1f}, false, "behind the occluder"},
+    {{0.0f, 0.0f, -0.5f}, {0.1f, 0.1f, 0.1f}, true, "in front of the occluder"},
+    {{0.0f, 0.0f, 0.0f}, {0.1f, 0.1f, 0.1f}, true, "through the occluder"},
+    {{0.0f, 0.0f, 0.5f}, {0.01f, 0.01f, 0.1f}, false, "behind the seam between the triangles"},
+    {{0.5f, 0.0f, 0.5f}, {0.1f, 0.1f, 0.1f}, true, "behind the edge of the occluder"},
+    {{0.59f, 0.0f, 0.5f}, {0.1f, 0.1f, 0.1f}, true, "just past the edge of the occluder"},
+    {{0.8f, 0.8f, 0.5f}, {0.1f, 0.1f, 0.1f}, true, "beside the occluder"}
+  };
+
+  bool passed = true;
+  for(uint32_t i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+    bool visible = occlusion_test_box(occ, &mvp, cases[i].center, cases[i].extent);
+    if(visible != cases[i].visible) {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Occlusion test failed: box %s is %s\n", cases[i].name, visible ? "visible" : "hidden");
+      passed = false;
+    }
+  }
+
+  // Random triangles across the screen
+  const size_t count = 10000;
+  GLfloat *positions = (GLfloat*)malloc(sizeof(GLfloat)*9*count);
+  srand(1);
+  for(size_t i = 0; i < count; i++) {
+    GLfloat cx = (GLfloat)(rand()%2000)/1000.0f-1.0f, cy = (GLfloat)(rand()%2000)/1000.0f-1.0f, cz = (GLfloat)(rand()%2000)/1000.0f-1.0f;
+    for(uint32_t k = 0; k < 3; k++) {
+      positions[i*9+k*3+0] = cx+(GLfloat)(rand()%200)/1000.0f-0.1f;
+      positions[i*9+k*3+1] = cy+(GLfloat)(rand()%200)/1000.0f-0.1f;
+      positions[i*9+k*3+2] = cz;
+    }
+  }
+
+  occlusion_clear(occ);
+  uint64_t start = SDL_GetPerformanceCounter();
+  occlusion_add_triangles(occ, &mvp, positions, count);
+  double setup_ms = timer_elapsed_ms(start);
+  occlusion_rasterize(occ);
+
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Occlusion buffer %ux%u: %s, %llu triangles set up in %.3f ms and rasterized in %.3f ms on %u threads\n", occ->width, occ->height, passed ? "all boxes as expected" : "BOXES WRONG", (unsigned long long)count, setup_ms, occ->stats.raster_ms, threadpool_size(pool)+1);
+
+  free(positions);
+  occlusion_delete(occ);
+
+  return passed;
+}
@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "renderqueue.h"
+#include "glstate.h"
+#include "mesh.h"
+#include "timer.h"
+
+// Every distinct state of the items queued in a frame (program, texture, geometry and material range) gets a dense
+// index as it is first pushed. The states are ranked by program, then texture, then geometry, so the most expensive
+// changes are the rarest, and each item is sorted on a 32-bit key of its pass, the rank of its state and its depth:
+//
+//   opaque:      | pass 1 | state rank | depth |
+//   transparent: | pass 1 | far depth          |
+//
+// Opaque items are grouped by state and drawn front to back within a state so early depth testing rejects what is
+// hidden. Transparent items have to blend back to front, their whole key is depth. The key is only as wide as the
+// rank needs plus RENDERQUEUE_MIN_DEPTH_BITS, rounded up to whole bytes so the depth takes what the last byte has left,
+// and the sort only has as many passes as that. The geometry is the VAO and the instance buffer, meshes share the VAO
+// but each has its own instances
+#define RENDERQUEUE_DEPTH_BITS 24
+#define RENDERQUEUE_MIN_DEPTH_BITS 7
+#define RENDERQUEUE_KEY_BITS 32
+
+// Bits sorted per radix sort pass. A byte at a time keeps the scatter within 256 write streams, and the sort skips the
+// bytes every key has in common
+#define RENDERQUEUE_RADIX_BITS 8
+#define RENDERQUEUE_RADIX_SIZE (1 << RENDERQUEUE_RADIX_BITS)
+#define RENDERQUEUE_RADIX_PASSES (RENDERQUEUE_KEY_BITS/RENDERQUEUE_RADIX_BITS)
+
+// A distinct state of the items of this frame
+typedef struct {
+  GLuint program;
+  GLuint texture;
+  GLuint geometry;
+  GLuint ubo;
+  GLintptr ubo_offset;
+} renderqueue_state_t;
+
+struct renderqueue {
+  GLuint material_binding;
+  GLfloat near;
+  GLfloat far;
+
+  // Programs of the depth pre-pass for plain and instanced items, 0 if there is no pre-pass
+  shader_t depth_program;
+  shader_t depth_instanced_program;
+
+  // VAO whose instance attributes were last pointed and the buffer they read, 0 if they are off
+  GLuint instance_vao;
+  GLuint instance_buffer;
+
+  // What actually gets sorted is the key of each item in the top half of a 64-bit entry and its index in the bottom
+  // half, the items themselves never move. The state index and the pass and quantized depth of each item are kept
+  // apart from the items so building the keys does not read them
+  renderqueue_item_t *items;
+  uint32_t *item_states;
+  uint32_t *item_depths;
+  uint64_t *entries;
+  uint64_t *scratch;
+  size_t size;
+  size_t capacity;
+
+  // The distinct states of this frame and an open addressing table of their index plus one, 0 for a free slot
+  renderqueue_state_t *states;
+  uint32_t *ranks;
+  uint32_t num_states;
+  uint32_t states_capacity;
+  uint32_t *table;
+  uint32_t table_size;
+
+  // Histogram of each byte of the keys
+  uint32_t counts[RENDERQUEUE_RADIX_PASSES][RENDERQUEUE_RADIX_SIZE];
+
+  renderqueue_stats_t stats;
+};
+
+uint32_t _renderqueue_hash_state(const renderqueue_state_t *state) {
+  uint64_t h = ((uint64_t)state->program*0x9e3779b97f4a7c15ull) ^ ((uint64_t)state->texture*0xc2b2ae3d27d4eb4full);
+  h ^= ((uint64_t)state->geometry*0x165667b19e3779f9ull) ^ ((uint64_t)state->ubo*0x27d4eb2f165667c5ull) ^ ((uint64_t)state->ubo_offset*0x94d049bb133111ebull);
+  return (uint32_t)(h ^ (h >> 29) ^ (h >> 43));
+}
+
+// Doubles the table and puts the states back in
+void _renderqueue_grow_table(renderqueue_t *queue) {
+  queue->table_size = (queue->table_size > 0) ? queue->table_size*2 : 256;
+  queue->table = (uint32_t*)realloc(queue->table, queue->table_size*sizeof(uint32_t));
+  memset(queue->table, 0, queue->table_size*sizeof(uint32_t));
+  for(uint32_t i = 0; i < queue->num_states; i++) {
+    uint32_t slot = _renderqueue_hash_state(&queue->states[i]) & (queue->table_size-1);
+    while(queue->table[slot] != 0) slot = (slot+1) & (queue->table_size-1);
+    queue->table[slot] = i+1;
+  }
+}
+
+// Index of the state of the item, added if it is the first item with it this frame
+uint32_t _renderqueue_state_index(renderqueue_t *queue, const renderqueue_item_t *item) {
+  renderqueue_state_t state = {item->program, item->texture, item->vao ^ item->instance_buffer, item->ubo, item->ubo_offset};
+
+  // Kept at most half full
+  if(2*(queue->num_states+1) > queue->table_size) _renderqueue_grow_table(queue);
+  uint32_t slot = _renderqueue_hash_state(&state) & (queue->table_size-1);
+  while(queue->table[slot] != 0) {
+    renderqueue_state_t *other = &queue->states[queue->table[slot]-1];
+    if(other->program == state.program && other->texture == state.texture && other->geometry == state.geometry && other->ubo == state.ubo && other->ubo_offset == state.ubo_offset) return queue->table[slot]-1;
+    slot = (slot+1) & (queue->table_size-1);
+  }
+
+  if(queue->num_states == queue->states_capacity) {
+    queue->states_capacity = (queue->states_capacity > 0) ? queue->states_capacity*2 : 256;
+    queue->states = (renderqueue_state_t*)realloc(queue->states, queue->states_capacity*sizeof(renderqueue_state_t));
+    queue->ranks = (uint32_t*)realloc(queue->ranks, queue->states_capacity*sizeof(uint32_t));
+  }
+  queue->states[queue->num_states] = state;
+  queue->table[slot] = queue->num_states+1;
+  return queue->num_states++;
+}
+
+// Depth quantized over the depth range, 0 at the near plane
+uint32_t _renderqueue_depth_bits(renderqueue_t *queue, GLfloat depth) {
+  GLfloat t = (depth-queue->near)/(queue->far-queue->near);
+  if(t < 0.0f) t = 0.0f;
+  if(t > 1.0f) t = 1.0f;
+  return (uint32_t)(t*(GLfloat)((1u << RENDERQUEUE_DEPTH_BITS)-1));
+}
+
+// Bits needed to tell count values apart
+uint32_t _renderqueue_bits(uint32_t count) {
+  uint32_t bits = 0;
+  while(bits < 32 && (1ull << bits) < count) bits++;
+  return bits;
+}
+
+
+// Adds the bytes from first to last of the keys in the top 32 bits of the entries to their histograms. Only the bytes
+// of the key are counted, a byte that is always 0 would make every entry wait on the increment of the one before
+void _renderqueue_count_bytes(const uint64_t *entries, size_t count, uint32_t first, uint32_t last, uint32_t counts[RENDERQUEUE_RADIX_PASSES][RENDERQUEUE_RADIX_SIZE]) {
+  for(size_t i = 0; i < count; i++) {
+    uint32_t key = (uint32_t)(entries[i] >> 32);
+    for(uint32_t d = first; d <= last; d++) counts[d][(key >> (d*RENDERQUEUE_RADIX_BITS)) & (RENDERQUEUE_RADIX_SIZE-1)]++;
+  }
+}
+
+// LSD radix sort of entries by the key_bits wide key in their top 32 bits, carrying the bottom half along, from the
+// histogram of each byte and the bits that differ between keys. Bytes every key has in common are skipped. Returns the number
+// of passes, the sorted entries end up in *entries
+uint32_t _renderqueue_radix_sort(uint64_t **entries, uint64_t **scratch, size_t count, uint32_t key_bits, uint32_t counts[RENDERQUEUE_RADIX_PASSES][RENDERQUEUE_RADIX_SIZE], uint32_t varying) {
+  uint32_t digits = (key_bits+RENDERQUEUE_RADIX_BITS-1)/RENDERQUEUE_RADIX_BITS;
+  uint32_t passes = 0;
+  for(uint32_t d = 0; d < digits; d++) {
+    uint32_t shift = d*RENDERQUEUE_RADIX_BITS;
+    if(((varying >> shift) & (RENDERQUEUE_RADIX_SIZE-1)) == 0) continue;
+
+    // Turn the counts into the offset of each bucket
+    uint32_t offset = 0;
+    for(uint32_t b = 0; b < RENDERQUEUE_RADIX_SIZE; b++) {
+      uint32_t n = counts[d][b];
+      counts[d][b] = offset;
+      offset += n;
+    }
+
+    const uint64_t *src = *entries;
+    uint64_t *dst = *scratch;
+    for(size_t i = 0; i < count; i++) dst[counts[d][(src[i] >> (32+shift)) & (RENDERQUEUE_RADIX_SIZE-1)]++] = src[i];
+
+    *scratch = *entries;
+    *entries = dst;
+    passes++;
+  }
+  return passes;
+}
+
+// Ranks the states by program, texture and geometry, and keeps each rank shifted into place in the sort key. Their GL
+// names are cut down to fit a sort key, states whose names collide only come out ranked less well. Uses the front of
+// the entry buffers, there are never more states than items
+void _renderqueue_rank_states(renderqueue_t *queue, uint32_t rank_shift, uint32_t depth_bits) {
+  uint64_t *order = queue->entries, *scratch = queue->scratch;
+  for(uint32_t i = 0; i < queue->num_states; i++) {
+    const renderqueue_state_t *state = &queue->states[i];
+    uint64_t key = ((uint64_t)(state->program & 0xff) << 24) | ((uint64_t)(state->texture & 0xfff) << 12) | (uint64_t)(state->geometry & 0xfff);
+    order[i] = (key << 32) | i;
+  }
+
+  memset(queue->counts, 0, sizeof(queue->counts));
+  _renderqueue_count_bytes(order, queue->num_states, 0, RENDERQUEUE_RADIX_PASSES-1, queue->counts);
+  _renderqueue_radix_sort(&order, &scratch, queue->num_states, RENDERQUEUE_KEY_BITS, queue->counts, ~0u);
+  for(uint32_t r = 0; r < queue->num_states; r++) queue->ranks[(uint32_t)order[r]] = (r >> rank_shift) << depth_bits;
+}
+
+renderqueue_t* renderqueue_create(GLuint material_binding) {
+  renderqueue_t *queue = (renderqueue_t*)calloc(1, sizeof(renderqueue_t));
+  queue->material_binding = material_binding;
+  queue->near = 0.0f;
+  queue->far = 1.0f;
+  return queue;
+}
+
+void renderqueue_set_depth_range(renderqueue_t *queue, GLfloat near, GLfloat far) {
+  queue->near = near;
+  queue->far = far;
+}
+
+void renderqueue_set_depth_prepass(renderqueue_t *queue, shader_t program, shader_t instanced_program) {
+  queue->depth_program = program;
+  queue->depth_instanced_program = instanced_program;
+}
+
+void renderqueue_clear(renderqueue_t *queue) {
+  queue->size = 0;
+  queue->num_states = 0;
+  if(queue->table != NULL) memset(queue->table, 0, queue->table_size*sizeof(uint32_t));
+}
+
+void renderqueue_push(renderqueue_t *queue, const renderqueue_item_t *item) {
+  if(queue->size == queue->capacity) {
+    queue->capacity = (queue->capacity > 0) ? queue->capacity*2 : 256;
+    queue->items = (renderqueue_item_t*)realloc(queue->items, queue->capacity*sizeof(renderqueue_item_t));
+    queue->item_states = (uint32_t*)realloc(queue->item_states, queue->capacity*sizeof(uint32_t));
+    queue->item_depths = (uint32_t*)realloc(queue->item_depths, queue->capacity*sizeof(uint32_t));
+    queue->entries = (uint64_t*)realloc(queue->entries, queue->capacity*sizeof(uint64_t));
+    queue->scratch = (uint64_t*)realloc(queue->scratch, queue->capacity*sizeof(uint64_t));
+  }
+
+  queue->items[queue->size] = *item;
+  queue->item_states[queue->size] = _renderqueue_state_index(queue, item);
+  uint32_t depth = _renderqueue_depth_bits(queue, item->depth);
+  if(item->pass == RENDERQUEUE_PASS_TRANSPARENT) depth = (1u << 31) | (((1u << RENDERQUEUE_DEPTH_BITS)-1)-depth);
+  queue->item_depths[queue->size] = depth;
+  queue->size++;
+}
+
+size_t renderqueue_size(renderqueue_t *queue) {
+  return queue->size;
+}
+
+void renderqueue_sort(renderqueue_t *queue) {
+  uint64_t start = SDL_GetPerformanceCounter();
+  queue->stats.sort_passes = 0;
+
+  if(queue->size > 0) {
+    // Past 2^24 states the lowest bits of the ranks are dropped, neighbouring states are then only sorted as one
+    uint32_t rank_bits = _renderqueue_bits(queue->num_states), rank_shift = 0;
+    if(rank_bits > RENDERQUEUE_KEY_BITS-1-RENDERQUEUE_MIN_DEPTH_BITS) {
+      rank_shift = rank_bits-(RENDERQUEUE_KEY_BITS-1-RENDERQUEUE_MIN_DEPTH_BITS);
+      rank_bits -= rank_shift;
+    }
+    uint32_t key_bits = (1+rank_bits+RENDERQUEUE_MIN_DEPTH_BITS+RENDERQUEUE_RADIX_BITS-1)/RENDERQUEUE_RADIX_BITS*RENDERQUEUE_RADIX_BITS;
+    uint32_t depth_bits = key_bits-1-rank_bits;
+    uint32_t far_bits = (key_bits-1 < RENDERQUEUE_DEPTH_BITS) ? key_bits-1 : RENDERQUEUE_DEPTH_BITS;
+    queue->stats.states = queue->num_states;
+    queue->stats.key_bits = key_bits;
+    _renderqueue_rank_states(queue, rank_shift, depth_bits);
+
+    // Both keys are made for every item and one is picked, which pass an item is in is too random to branch on. The
+    // histogram of the two bytes every key has is built along with the keys, they are only read back for the others
+    uint32_t transparent_key = 1u << (key_bits-1), varying = 0, first = 0;
+    const uint32_t *ranks = queue->ranks, *item_states = queue->item_states, *item_depths = queue->item_depths;
+    uint32_t (*counts)[RENDERQUEUE_RADIX_SIZE] = queue->counts;
+    uint64_t *entries = queue->entries;
+    memset(counts, 0, sizeof(queue->counts));
+    for(size_t i = 0; i < queue->size; i++) {
+      uint32_t pass_depth = item_depths[i], depth = pass_depth & ((1u << RENDERQUEUE_DEPTH_BITS)-1);
+      uint32_t opaque = ranks[item_states[i]] | (depth >> (RENDERQUEUE_DEPTH_BITS-depth_bits));
+      uint32_t transparent = transparent_key | ((depth >> (RENDERQUEUE_DEPTH_BITS-far_bits)) << (key_bits-1-far_bits));
+      uint32_t key = (pass_depth >> 31) ? transparent : opaque;
+      if(i == 0) first = key;
+      varying |= key ^ first;
+      counts[0][key & (RENDERQUEUE_RADIX_SIZE-1)]++;
+      counts[1][(key >> RENDERQUEUE_RADIX_BITS) & (RENDERQUEUE_RADIX_SIZE-1)]++;
+      entries[i] = ((uint64_t)key << 32) | i;
+    }
+    if(key_bits > 16) _renderqueue_count_bytes(entries, queue->size, 2, key_bits/RENDERQUEUE_RADIX_BITS-1, counts);
+
+    // Between frames the scratch buffer drops out of the cache. Writing it in order brings it back far faster than the
+    // scattered writes of the first pass would, one line at a time
+    memset(queue->scratch, 0, queue->size*sizeof(uint64_t));
+    queue->stats.sort_passes = _renderqueue_radix_sort(&queue->entries, &queue->scratch, queue->size, key_bits, queue->counts, varying);
+  }
+
+  queue->stats.sort_ms = timer_elapsed_ms(start);
+  queue->stats.items = queue->size;
+}
+
+// Opaque items are drawn without blending, which they do not need, and write depth. After a depth pre-pass the depth is
+// already there, they only shade the fragments that match it. Transparent items blend over them without writing depth
+// so they do not hide each other
+void _renderqueue_begin_pass(renderqueue_pass_t pass, bool prepass) {
+  if(pass == RENDERQUEUE_PASS_TRANSPARENT) {
+    glstate_set_capability(GL_BLEND, true);
+    glstate_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glstate_depth_mask(GL_FALSE);
+    glstate_depth_func(GL_LEQUAL);
+  } else if(prepass) {
+    glstate_set_capability(GL_BLEND, false);
+    glstate_depth_mask(GL_FALSE);
+    glstate_depth_func(GL_EQUAL);
+  } else {
+    glstate_set_capability(GL_BLEND, false);
+    glstate_depth_mask(GL_TRUE);
+    glstate_depth_func(GL_LEQUAL);
+  }
+}
+
+// Points the instance attributes of the bound VAO at the instance buffer of the item, or turns them off for a plain
+// draw. There is no base instance before GL 4.2, so the attributes follow the mesh being drawn
+void _renderqueue_bind_instances(renderqueue_t *queue, GLuint vao, GLuint buffer) {
+  if(queue->instance_vao == vao && queue->instance_buffer == buffer) return;
+  queue->instance_vao = vao;
+  queue->instance_buffer = buffer;
+
+  // The model matrix goes in one column per attribute location, each advanced once per instance instead of once per vertex
+  if(buffer != 0) glstate_bind_buffer(GL_ARRAY_BUFFER, buffer);
+  for(GLuint c = 0; c < 4; c++) {
+    if(buffer != 0) {
+      glEnableVertexAttribArray(MESH_INSTANCE_ATTRIB+c);
+      glVertexAttribPointer(MESH_INSTANCE_ATTRIB+c, 4, GL_FLOAT, GL_FALSE, sizeof(mat4_t), (GLvoid*)(c*4*sizeof(GLfloat)));
+      glVertexAttribDivisor(MESH_INSTANCE_ATTRIB+c, 1);
+    } else {
+      glDisableVertexAttribArray(MESH_INSTANCE_ATTRIB+c);
+    }
+  }
+}
+
+// Issues the draw call of the item, all the state has to be set
+void _renderqueue_draw_item(const renderqueue_item_t *item) {
+  const GLvoid *indices = (const GLvoid*)(sizeof(uint32_t)*item->offset);
+  if(item->instances > 0) {
+    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, (GLsizei)item->count, GL_UNSIGNED_INT, indices, (GLsizei)item->instances, item->base_vertex);
+  } else {
+    glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)item->count, GL_UNSIGNED_INT, indices, item->base_vertex);
+  }
+}
+
+// Draws the depth of the opaque items with the trivial program and color writes off
+void _renderqueue_draw_depth(renderqueue_t *queue) {
+  _renderqueue_begin_pass(RENDERQUEUE_PASS_OPAQUE, false);
+  glstate_color_mask(GL_FALSE);
+
+  // Opaque items come first
+  for(size_t i = 0; i < queue->size; i++) {
+    const renderqueue_item_t *item = &queue->items[(uint32_t)queue->entries[i]];
+    if(item->pass != RENDERQUEUE_PASS_OPAQUE) break;
+
+    glstate_use_program((item->instances > 0) ? queue->depth_instanced_program : queue->depth_program);
+    GLuint vao = (item->depth_vao != 0) ? item->depth_vao : item->vao;
+    glstate_bind_vertex_array(vao);
+    _renderqueue_bind_instances(queue, vao, (item->instances > 0) ? item->instance_buffer : 0);
+    _renderqueue_draw_item(item);
+    queue->stats.prepass_draws++;
+  }
+
+  glstate_color_mask(GL_TRUE);
+}
+
+void renderqueue_draw(renderqueue_t *queue) {
+  bool prepass = (queue->depth_program != 0);
+  queue->stats.transparent = 0;
+  queue->stats.instances = 0;
+  queue->stats.prepass_draws = 0;
+
+  // The VAOs may have been changed or replaced since the last frame
+  queue->instance_vao = 0;
+  if(prepass) _renderqueue_draw_depth(queue);
+
+  // The pass is the top of the key so each pass is a single run of items
+  renderqueue_pass_t pass = RENDERQUEUE_PASS_OPAQUE;
+  _renderqueue_begin_pass(pass, prepass);
+
+  // The sort puts items sharing state next to each other, the state layer drops the binds that repeat
+  for(size_t i = 0; i < queue->size; i++) {
+    const renderqueue_item_t *item = &queue->items[(uint32_t)queue->entries[i]];
+    if(item->pass != pass) {
+      pass = item->pass;
+      _renderqueue_begin_pass(pass, prepass);
+    }
+    if(pass == RENDERQUEUE_PASS_TRANSPARENT) queue->stats.transparent++;
+    queue->stats.instances += (item->instances > 0) ? item->instances : 1;
+
+    glstate_use_program(item->program);
+    glstate_bind_vertex_array(item->vao);
+    _renderqueue_bind_instances(queue, item->vao, (item->instances > 0) ? item->instance_buffer : 0);
+    glstate_bind_buffer_range(GL_UNIFORM_BUFFER, queue->material_binding, item->ubo, item->ubo_offset, item->ubo_size);
+    if(item->texture != 0) glstate_bind_texture(item->unit, item->target, item->texture);
+
+    _renderqueue_draw_item(item);
+  }
+
+  // Depth writes have to be back on for the depth buffer to be cleared
+  _renderqueue_begin_pass(RENDERQUEUE_PASS_OPAQUE, false);
+
+  queue->stats.draws = queue->size;
+}
+
+void renderqueue_stats(renderqueue_t *queue, renderqueue_stats_t *stats) {
+  *stats = queue->stats;
+}
+
+void renderqueue_delete(renderqueue_t *queue) {
+  free(queue->items);
+  free(queue->item_states);
+  free(queue->item_depths);
+  free(queue->entries);
+  free(queue->scratch);
+  free(queue->states);
+  free(queue->ranks);
+  free(queue->table);
+  free(queue);
+}
+
+// Fills the queue with count synthetic items, with the state either drawn from a scene sized set of shaders, textures,
+// meshes and their material groups or entirely random
+void _renderqueue_test_fill(renderqueue_t *queue, size_t count, bool random_state) {
+  renderqueue_clear(queue);
+  for(size_t i = 0; i < count; i++) {
+    renderqueue_item_t item;
+    memset(&item, 0, sizeof(renderqueue_item_t));
+    item.pass = (rand()%10 == 0) ? RENDERQUEUE_PASS_TRANSPARENT : RENDERQUEUE_PASS_OPAQUE;
+    if(random_state) {
+      item.program = (GLuint)rand(), item.texture = (GLuint)rand(), item.vao = (GLuint)rand(), item.ubo = (GLuint)rand();
+      item.ubo_offset = (GLintptr)(rand()%256)*256;
+    } else {
+      // 32 meshes of 8 material groups, each group with its own shader, texture and material
+      GLuint mesh = (GLuint)(rand()%32), group = (GLuint)(rand()%8), material = mesh*8+group;
+      item.program = 1+material%4, item.texture = 1+(material*7)%64, item.vao = 1, item.ubo = 1;
+      item.instance_buffer = 2+mesh;
+      item.ubo_offset = (GLintptr)material*256;
+    }
+    int depth = rand();
+    item.depth = queue->near+(queue->far-queue->near)*(GLfloat)depth/(GLfloat)RAND_MAX;
+    renderqueue_push(queue, &item);
+  }
+}
+
+// Sorts count synthetic items a few times over, for a scene like mix of state and for random state where nearly every
+// item has a state of its own. Prints the time taken to push and to sort, and checks that every item is still there,
+// that the opaque items come first with each state in a single run drawn front to back, and that the transparent items
+// are drawn back to front
+bool renderqueue_self_test(size_t count) {
+  const char *names[2] = {"scene", "random"};
+  renderqueue_t *queue = renderqueue_create(0);
+  renderqueue_set_depth_range(queue, 1.0f, 10000.0f);
+  uint8_t *seen = (uint8_t*)malloc(count+1);
+  bool ok = true;
+
+  srand(7);
+  for(uint32_t kind = 0; kind < 2; kind++) {
+    double best_ms = 0.0, total_ms = 0.0, push_ms = 0.0;
+    bool passed = true;
+    uint32_t rounds = 10;
+
+    for(uint32_t round = 0; round < rounds; round++) {
+      uint64_t start = SDL_GetPerformanceCounter();
+      _renderqueue_test_fill(queue, count, kind == 1);
+      push_ms += timer_elapsed_ms(start);
+      renderqueue_sort(queue);
+      if(round == 0 || queue->stats.sort_ms < best_ms) best_ms = queue->stats.sort_ms;
+      total_ms += queue->stats.sort_ms;
+
+      // Depth is only sorted to the precision the key has left for it
+      uint32_t key_bits = queue->stats.key_bits, rank_bits = _renderqueue_bits(queue->num_states);
+      uint32_t opaque_shift = RENDERQUEUE_DEPTH_BITS-(key_bits-1-rank_bits);
+      uint32_t far_shift = (key_bits-1 < RENDERQUEUE_DEPTH_BITS) ? RENDERQUEUE_DEPTH_BITS-(key_bits-1) : 0;
+
+      // The states seen so far, a state is done once a run of another opaque state starts
+      uint8_t *done = (uint8_t*)calloc(queue->num_states, 1);
+      memset(seen, 0, count+1);
+      for(size_t i = 0; i < queue->size; i++) {
+        uint32_t index = (uint32_t)queue->entries[i];
+        if(i > 0 && (queue->entries[i-1] >> 32) > (queue->entries[i] >> 32)) passed = false;
+        if(index >= queue->size || seen[index]++) {
+          passed = false;
+          continue;
+        }
+        if(i == 0) continue;
+
+        uint32_t previous = (uint32_t)queue->entries[i-1];
+        uint32_t depth = queue->item_depths[index], previous_depth = queue->item_depths[previous];
+        uint32_t state = queue->item_states[index], previous_state = queue->item_states[previous];
+        if((previous_depth >> 31) > (depth >> 31)) passed = false;
+        if(depth >> 31) {
+          // Transparent items keep their distance from the far plane
+          if(previous_depth >> 31 && ((previous_depth & 0xffffff) >> far_shift) > ((depth & 0xffffff) >> far_shift)) passed = false;
+        } else if(state != previous_state) {
+          if(done[state]) passed = false;
+          done[previous_state] = 1;
+        } else if((previous_depth >> opaque_shift) > (depth >> opaque_shift)) {
+          passed = false;
+        }
+      }
+      free(done);
+    }
+    ok = ok && passed;
+
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Sort test %s: %llu items of %u states pushed in %.3f ms, sorted in %.3f ms best, %.3f ms average, %u-bit keys, %u radix passes, %s\n", names[kind], (unsigned long long)count, queue->stats.states, push_ms/(double)rounds, best_ms, total_ms/(double)rounds, queue->stats.key_bits, queue->stats.sort_passes, passed ? "passed" : "FAILED");
+  }
+
+  free(seen);
+  renderqueue_delete(queue);
+  return ok;
+}
@@ -0,0 +1,338 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <SDL2/SDL.h>
+
+#include "scene.h"
+#include "array.h"
+#include "timer.h"
+
+// Every per-node value is its own array indexed by node. The world transforms are the top three rows of the column
+// major matrix, world[c*3+r] holding row r of column c for all the nodes. Nodes are only ever appended under existing
+// ones, so a node's subtree lies between it and last[node], though not alone: a child appended to an earlier parent
+// lands after the nodes of other subtrees. An update sweeps the ranges of the nodes changed since the last one, in
+// order, and only recomputes the nodes that changed or whose parent was just recomputed, skipping the strangers
+struct scene {
+  size_t count;
+  size_t capacity;
+  scene_node_t *parent;
+  scene_node_t *last;
+  GLfloat *translation[3];
+  GLfloat *rotation[4];
+  GLfloat *scale[3];
+  GLfloat *world[12];
+  mesh_t **mesh;
+  uint32_t *instance;
+  uint8_t *dirty;
+  uint32_t *updated;
+  uint32_t epoch;
+  array_t *changed;
+  array_t *recomputed;
+  scene_stats_t stats;
+};
+
+void* _scene_resize(void *values, size_t capacity, size_t elem_size) {
+  void *resized = realloc(values, capacity*elem_size);
+  if(resized == NULL) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Out of memory for %llu scene nodes\n", (unsigned long long)capacity);
+    exit(EXIT_FAILURE);
+  }
+  return resized;
+}
+
+void _scene_reserve(scene_t *scene, size_t capacity) {
+  if(capacity <= scene->capacity) return;
+  scene->parent = (scene_node_t*)_scene_resize(scene->parent, capacity, sizeof(scene_node_t));
+  scene->last = (scene_node_t*)_scene_resize(scene->last, capacity, sizeof(scene_node_t));
+  for(uint32_t k = 0; k < 3; k++) {
+    scene->translation[k] = (GLfloat*)_scene_resize(scene->translation[k], capacity, sizeof(GLfloat));
+    scene->scale[k] = (GLfloat*)_scene_resize(scene->scale[k], capacity, sizeof(GLfloat));
+  }
+  for(uint32_t k = 0; k < 4; k++) {
+    scene->rotation[k] = (GLfloat*)_scene_resize(scene->rotation[k], capacity, sizeof(GLfloat));
+  }
+  for(uint32_t k = 0; k < 12; k++) {
+    scene->world[k] = (GLfloat*)_scene_resize(scene->world[k], capacity, sizeof(GLfloat));
+  }
+  scene->mesh = (mesh_t**)_scene_resize(scene->mesh, capacity, sizeof(mesh_t*));
+  scene->instance = (uint32_t*)_scene_resize(scene->instance, capacity, sizeof(uint32_t));
+  scene->dirty = (uint8_t*)_scene_resize(scene->dirty, capacity, sizeof(uint8_t));
+  scene->updated = (uint32_t*)_scene_resize(scene->updated, capacity, sizeof(uint32_t));
+  scene->capacity = capacity;
+}
+
+void _scene_touch(scene_t *scene, scene_node_t node) {
+  if(scene->dirty[node]) return;
+  scene->dirty[node] = 1;
+  array_append(scene->changed, &node);
+}
+
+// world = parent world * translation * rotation * scale
+void _scene_compose(scene_t *scene, scene_node_t node) {
+  GLfloat qx = scene->rotation[0][node], qy = scene->rotation[1][node], qz = scene->rotation[2][node], qw = scene->rotation[3][node];
+  GLfloat sx = scene->scale[0][node], sy = scene->scale[1][node], sz = scene->scale[2][node];
+  GLfloat l[12] = {
+    (1.0f-2.0f*(qy*qy+qz*qz))*sx, (2.0f*(qx*qy+qz*qw))*sx, (2.0f*(qx*qz-qy*qw))*sx,
+    (2.0f*(qx*qy-qz*qw))*sy, (1.0f-2.0f*(qx*qx+qz*qz))*sy, (2.0f*(qy*qz+qx*qw))*sy,
+    (2.0f*(qx*qz+qy*qw))*sz, (2.0f*(qy*qz-qx*qw))*sz, (1.0f-2.0f*(qx*qx+qy*qy))*sz,
+    scene->translation[0][node], scene->translation[1][node], scene->translation[2][node]
+  };
+
+  scene_node_t p = scene->parent[node];
+  if(p == SCENE_NONE) {
+    for(uint32_t k = 0; k < 12; k++) scene->world[k][node] = l[k];
+    return;
+  }
+
+  GLfloat pw[12];
+  for(uint32_t k = 0; k < 12; k++) pw[k] = scene->world[k][p];
+  for(uint32_t c = 0; c < 4; c++) {
+    for(uint32_t r = 0; r < 3; r++) {
+      GLfloat v = pw[r]*l[c*3+0]+pw[3+r]*l[c*3+1]+pw[6+r]*l[c*3+2];
+      if(c == 3) v += pw[9+r];
+      scene->world[c*3+r][node] = v;
+    }
+  }
+}
+
+int _scene_compare_nodes(const void *a, const void *b) {
+  scene_node_t na = *(const scene_node_t*)a, nb = *(const scene_node_t*)b;
+  return (na > nb) - (na < nb);
+}
+
+scene_t* scene_create(size_t capacity) {
+  scene_t *scene = (scene_t*)calloc(1, sizeof(scene_t));
+  scene->changed = array_create(64, sizeof(scene_node_t));
+  scene->recomputed = array_create(64, sizeof(scene_node_t));
+  scene->epoch = 1;
+  _scene_reserve(scene, capacity > 0 ? capacity : 64);
+  return scene;
+}
+
+scene_node_t scene_add_node(scene_t *scene, scene_node_t parent) {
+  if(parent != SCENE_NONE && parent >= scene->count) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Scene node parent %u does not exist\n", parent);
+    parent = SCENE_NONE;
+  }
+  if(scene->count == scene->capacity) _scene_reserve(scene, scene->capacity*2);
+
+  scene_node_t node = (scene_node_t)scene->count++;
+  scene->parent[node] = parent;
+  scene->last[node] = node;
+  for(uint32_t k = 0; k < 3; k++) {
+    scene->translation[k][node] = 0.0f;
+    scene->scale[k][node] = 1.0f;
+    scene->rotation[k][node] = 0.0f;
+  }
+  scene->rotation[3][node] = 1.0f;
+  scene->mesh[node] = NULL;
+  scene->instance[node] = SCENE_NONE;
+  scene->dirty[node] = 0;
+  scene->updated[node] = 0;
+  _scene_touch(scene, node);
+
+  // The new node is the last of the subtree of every one of its ancestors
+  for(scene_node_t p = parent; p != SCENE_NONE; p = scene->parent[p]) scene->last[p] = node;
+
+  return node;
+}
+
+size_t scene_size(scene_t *scene) {
+  return scene->count;
+}
+
+scene_node_t scene_parent(scene_t *scene, scene_node_t node) {
+  return scene->parent[node];
+}
+
+void scene_set_translation(scene_t *scene, scene_node_t node, GLfloat x, GLfloat y, GLfloat z) {
+  scene->translation[0][node] = x;
+  scene->translation[1][node] = y;
+  scene->translation[2][node] = z;
+  _scene_touch(scene, node);
+}
+
+// angle in degrees around the axis (x, y, z), as with mat4_rotatef
+void scene_set_rotation(scene_t *scene, scene_node_t node, GLfloat angle, GLfloat x, GLfloat y, GLfloat z) {
+  GLfloat length = sqrtf(x*x+y*y+z*z);
+  GLfloat half = angle*(GLfloat)M_PI/360.0f;
+  GLfloat s = (length > 0.0f) ? sinf(half)/length : 0.0f;
+  scene->rotation[0][node] = x*s;
+  scene->rotation[1][node] = y*s;
+  scene->rotation[2][node] = z*s;
+  scene->rotation[3][node] = (length > 0.0f) ? cosf(half) : 1.0f;
+  _scene_touch(scene, node);
+}
+
+void scene_set_scale(scene_t *scene, scene_node_t node, GLfloat x, GLfloat y, GLfloat z) {
+  scene->scale[0][node] = x;
+  scene->scale[1][node] = y;
+  scene->scale[2][node] = z;
+  _scene_touch(scene, node);
+}
+
+// instance is the copy of an instanced mesh the node places, SCENE_NONE for a node drawing the mesh itself
+void scene_set_mesh(scene_t *scene, scene_node_t node, mesh_t *mesh, uint32_t instance) {
+  scene->mesh[node] = mesh;
+  scene->instance[node] = instance;
+}
+
+mesh_t* scene_mesh(scene_t *scene, scene_node_t node) {
+  return scene->mesh[node];
+}
+
+uint32_t scene_instance(scene_t *scene, scene_node_t node) {
+  return scene->instance[node];
+}
+
+// Recomputes the world transforms of the nodes changed since the last update and of everything under them. Returns
+// the number of nodes recomputed
+size_t scene_update(scene_t *scene) {
+  uint64_t start = SDL_GetPerformanceCounter();
+  size_t num_changed = array_size(scene->changed);
+  size_t updated = 0, ranges = 0;
+  array_clear(scene->recomputed);
+
+  if(num_changed > 0) {
+    // The epoch tells the nodes recomputed in this update apart, so nothing has to be cleared afterwards
+    if(++scene->epoch == 0) {
+      memset(scene->updated, 0, scene->count*sizeof(uint32_t));
+      scene->epoch = 1;
+    }
+    uint32_t epoch = scene->epoch;
+
+    scene_node_t *changed = (scene_node_t*)array_at(scene->changed, 0);
+    // Nodes added or changed in order, as when loading, are already sorted
+    bool sorted = true;
+    for(size_t i = 1; i < num_changed && sorted; i++) sorted = (changed[i-1] < changed[i]);
+    if(!sorted) qsort(changed, num_changed, sizeof(scene_node_t), _scene_compare_nodes);
+
+    // Overlapping subtree ranges are merged into one sweep so every parent is recomputed before its children
+    size_t i = 0;
+    while(i < num_changed) {
+      scene_node_t first = changed[i], last = scene->last[first];
+      for(i++; i < num_changed && changed[i] <= last; i++) {
+        if(scene->last[changed[i]] > last) last = scene->last[changed[i]];
+      }
+
+      for(scene_node_t n = first; n <= last; n++) {
+        scene_node_t p = scene->parent[n];
+        if(!scene->dirty[n] && (p == SCENE_NONE || scene->updated[p] != epoch)) continue;
+        _scene_compose(scene, n);
+        scene->dirty[n] = 0;
+        scene->updated[n] = epoch;
+        array_append(scene->recomputed, &n);
+        updated++;
+      }
+      ranges++;
+    }
+    array_clear(scene->changed);
+  }
+
+  scene->stats.nodes = scene->count;
+  scene->stats.updated = updated;
+  scene->stats.ranges = ranges;
+  scene->stats.update_ms = timer_elapsed_ms(start);
+  return updated;
+}
+
+// The nodes the last update recomputed, in order
+size_t scene_recomputed(scene_t *scene, const scene_node_t **nodes) {
+  *nodes = (const scene_node_t*)array_data(scene->recomputed);
+  return array_size(scene->recomputed);
+}
+
+void scene_world_matrix(scene_t *scene, scene_node_t node, mat4_t *mat) {
+  for(uint32_t c = 0; c < 4; c++) {
+    for(uint32_t r = 0; r < 3; r++) mat->m[c*4+r] = scene->world[c*3+r][node];
+    mat->m[c*4+3] = (c == 3) ? 1.0f : 0.0f;
+  }
+}
+
+void scene_stats(scene_t *scene, scene_stats_t *stats) {
+  *stats = scene->stats;
+}
+
+void scene_delete(scene_t *scene) {
+  free(scene->parent);
+  free(scene->last);
+  for(uint32_t k = 0; k < 3; k++) {
+    free(scene->translation[k]);
+    free(scene->scale[k]);
+  }
+  for(uint32_t k = 0; k < 4; k++) free(scene->rotation[k]);
+  for(uint32_t k = 0; k < 12; k++) free(scene->world[k]);
+  free(scene->mesh);
+  free(scene->instance);
+  free(scene->dirty);
+  free(scene->updated);
+  array_delete(scene->changed);
+  array_delete(scene->recomputed);
+  free(scene);
+}
+
+// Builds a random tree of count nodes, times a full update, an update after moving a few nodes and one with nothing
+// to do. Then appends nodes under random earlier ones of any model, so subtrees interleave, moves their parents and
+// checks the partial updates left the same transforms as recomputing everything
+bool scene_self_test(size_t count) {
+  if(count < 2) count = 2;
+  scene_t *scene = scene_create(count);
+  srand(1);
+
+  // Models of 64 nodes added one after the other, each node under a random earlier one of its model
+  for(size_t i = 0; i < count; i++) {
+    size_t root = i-i%64;
+    scene_node_t parent = (i == root) ? SCENE_NONE : (scene_node_t)(root+(size_t)rand()%(i-root));
+    scene_node_t node = scene_add_node(scene, parent);
+    scene_set_translation(scene, node, (GLfloat)(rand()%200-100)/10.0f, (GLfloat)(rand()%200-100)/10.0f, (GLfloat)(rand()%200-100)/10.0f);
+    scene_set_rotation(scene, node, (GLfloat)(rand()%360), 0.0f, 1.0f, 0.0f);
+  }
+
+  size_t full = scene_update(scene);
+  scene_stats_t full_stats;
+  scene_stats(scene, &full_stats);
+
+  const uint32_t moved = 16;
+  for(uint32_t j = 0; j < moved; j++) {
+    scene_node_t node = (scene_node_t)((size_t)rand()%count);
+    scene_set_translation(scene, node, (GLfloat)(rand()%200-100)/10.0f, 0.0f, 0.0f);
+  }
+  size_t partial = scene_update(scene);
+  scene_stats_t partial_stats;
+  scene_stats(scene, &partial_stats);
+
+  scene_update(scene);
+  scene_stats_t idle_stats;
+  scene_stats(scene, &idle_stats);
+
+  // The appended nodes end up in the ranges of every model after their parent's
+  size_t appended = count/16 > moved ? count/16 : moved;
+  for(size_t i = 0; i < appended; i++) {
+    scene_node_t node = scene_add_node(scene, (scene_node_t)((size_t)rand()%scene_size(scene)));
+    scene_set_translation(scene, node, (GLfloat)(rand()%200-100)/10.0f, 0.0f, 0.0f);
+  }
+  scene_update(scene);
+  for(uint32_t j = 0; j < moved; j++) {
+    scene_node_t node = scene_parent(scene, (scene_node_t)(scene_size(scene)-1-(size_t)rand()%appended));
+    scene_set_rotation(scene, node, (GLfloat)(rand()%360), 0.0f, 0.0f, 1.0f);
+  }
+  size_t interleaved = scene_update(scene);
+  scene_stats_t interleaved_stats;
+  scene_stats(scene, &interleaved_stats);
+
+  // Recompute everything in order and compare
+  size_t total = scene_size(scene);
+  GLfloat *world = (GLfloat*)malloc(total*12*sizeof(GLfloat));
+  for(uint32_t k = 0; k < 12; k++) memcpy(&world[k*total], scene->world[k], total*sizeof(GLfloat));
+  for(size_t i = 0; i < total; i++) _scene_compose(scene, (scene_node_t)i);
+  bool match = true;
+  for(uint32_t k = 0; k < 12 && match; k++) match = (memcmp(&world[k*total], scene->world[k], total*sizeof(GLfloat)) == 0);
+
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Scene of %llu nodes: full update %.3f ms (%llu nodes), %u moved %.3f ms (%llu nodes in %llu ranges), unchanged %.3f ms, %u parents of %llu interleaved nodes moved %.3f ms (%llu nodes in %llu ranges), %s\n", (unsigned long long)count, full_stats.update_ms, (unsigned long long)full, moved, partial_stats.update_ms, (unsigned long long)partial, (unsigned long long)partial_stats.ranges, idle_stats.update_ms, moved, (unsigned long long)appended, interleaved_stats.update_ms, (unsigned long long)interleaved, (unsigned long long)interleaved_stats.ranges, match ? "results match" : "RESULTS DIFFER");
+
+  free(world);
+  scene_delete(scene);
+
+  return match;
+}
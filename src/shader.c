@@ -1,83 +1,247 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
-#include <SDL2/SDL_log.h>
+#include <sys/stat.h>
+
+#include <SDL2/SDL.h>
 
 #include "shader.h"
+#include "array.h"
+#include "hash.h"
+#include "glstate.h"
+#include "timer.h"
+
+// "GLB1", identifies a program binary file
+#define SHADER_BINARY_MAGIC 0x31424c47u
+
+// The header of a program binary file, followed by length bytes of binary
+typedef struct {
+  uint32_t magic;
+  GLenum format;
+  uint64_t key;
+  uint64_t length;
+} shader_binary_header_t;
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// glMaxShaderCompilerThreadsKHR, GL_KHR_parallel_shader_compile is not part of the core profile loader
+typedef void (APIENTRY *shader_max_compiler_threads_fn)(GLuint count);
+
+// A program that has been handed to the driver but whose compile and link status has not been checked yet
+typedef struct {
+  GLuint program;
+
+  // 0 for programs created from the binary cache
+  GLuint vshader;
+  GLuint fshader;
+
+  // Kept for the log and for compiling the shaders if the driver rejects a cached binary
+  char *vertfile;
+  char *fragfile;
+  char *vertcode;
+  char *fragcode;
+  uint32_t features;
+
+  uint64_t key;
+  bool cached;
+  bool binary_cache;
+  uint64_t start;
+} shader_pending_t;
+
+// An active uniform of a linked program along with the last value uploaded to it
+typedef struct {
+  GLuint program;
+  char *name;
+  GLint location;
+
+  // The CPU copy, large enough for a mat4. Not valid until the first upload
+  bool valid;
+  GLfloat value[16];
+} shader_uniform_info_t;
+
+// The uniforms of every loaded program. A shader_uniform_t is an index into it plus one
+static array_t *uniforms = NULL;
+
+static shader_stats_t stats;
+
+// Programs submitted but not finished yet
+static array_t *pending = NULL;
+
+// Whether the driver compiles on its own threads and can report completion without blocking
+static bool parallel_compile = false;
+
+// The define of each shader_feature_t, in bit order
+static const char *feature_names[SHADER_NUM_FEATURES] = {"TEXTURED", "TEXTURE_ARRAY", "HAS_NORMALS", "GAMMA", "INSTANCED", "CLUSTERED"};
+
+// Reads the active uniforms of the program into the uniform table
+void _shader_introspect(GLuint program) {
+  if(uniforms == NULL) uniforms = array_create(32, sizeof(shader_uniform_info_t));
+
+  GLint count, max_length;
+  glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+  glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+
+  char *name = (char*)malloc((size_t)(max_length+1));
+  for(GLuint i = 0; i < (GLuint)count; i++) {
+    GLint size;
+    GLenum type;
+    glGetActiveUniform(program, i, max_length+1, NULL, &size, &type, name);
+
+    // Members of uniform blocks have no location, their values come from a buffer
+    if(glGetUniformLocation(program, name) < 0) continue;
+
+    // Arrays are reported as their first element, they are looked up by the name without the subscript
+    size_t length = strlen(name);
+    if(length > 3 && strcmp(name+length-3, "[0]") == 0) name[length-3] = 0;
+
+    shader_uniform_info_t info;
+    info.program = program;
+    info.name = (char*)malloc(strlen(name)+1);
+    strcpy(info.name, name);
+    info.location = glGetUniformLocation(program, name);
+    info.valid = false;
+    memset(info.value, 0, sizeof(info.value));
+    array_append(uniforms, &info);
+  }
+
+  free(name);
+}
 
-GLuint _shader_compile(const char *shadercode, uint32_t shader_type) {
-  // Create the shader object
+// Size of the value of a uniform of the given type
+size_t _shader_uniform_size(shader_uniform_type_t uniform_type) {
+  switch(uniform_type) {
+  case SHADER_UNIFORM_MAT4:
+    return 16*sizeof(GLfloat);
+  case SHADER_UNIFORM_VEC3:
+    return 3*sizeof(GLfloat);
+  case SHADER_UNIFORM_FLOAT:
+    return sizeof(GLfloat);
+  case SHADER_UNIFORM_UINT:
+    return sizeof(GLuint);
+  case SHADER_UNIFORM_INT:
+    return sizeof(GLint);
+  }
+  return 0;
+}
+
+// Creates the shader object and starts compiling it. The status is checked by _shader_check_compile once the result is needed
+GLuint _shader_compile(const char *shadercode, GLenum shader_type) {
   GLuint shader = glCreateShader(shader_type);
   glShaderSource(shader, 1, &shadercode, NULL);
   glCompileShader(shader);
+  return shader;
+}
 
-  // Check if compilation went okay
+// Logs the compile errors of the shader, returns false if it did not compile. Blocks until the compile is done
+bool _shader_check_compile(GLuint shader, GLenum shader_type) {
   GLint status;
   glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if(status == GL_TRUE) return true;
 
-  if(status == GL_FALSE) {
-    GLint info_log_length;
-    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &info_log_length);
-
-    char *info_log = (char*)malloc((size_t)(info_log_length+1));
-    glGetShaderInfoLog(shader, info_log_length, NULL, info_log);
+  GLint info_log_length;
+  glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &info_log_length);
 
-    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Failed to compile %s shader:\n%s\n", (shader_type = GL_VERTEX_SHADER) ? "vertex" : "fragment", info_log);
+  char *info_log = (char*)malloc((size_t)(info_log_length+1));
+  glGetShaderInfoLog(shader, info_log_length, NULL, info_log);
 
-    glDeleteShader(shader);
-    free(info_log);
-    return 0;
-  }
+  SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Failed to compile %s shader:\n%s\n", (shader_type == GL_VERTEX_SHADER) ? "vertex" : "fragment", info_log);
 
-  return shader;
+  free(info_log);
+  return false;
 }
 
-GLuint _shader_link(GLuint vshader, GLuint fshader) {
-  // Link the shader objects to the program
-  GLuint program = glCreateProgram();
+// Attaches the shader objects to the program and starts linking it. The link status is only known once the compiles are done
+void _shader_link(GLuint program, GLuint vshader, GLuint fshader) {
   glAttachShader(program, vshader);
   glAttachShader(program, fshader);
+
+  // Ask for a binary that can be written to the program cache
+  glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   glLinkProgram(program);
+}
 
-  // Check if linking went okay
-  GLint status;
-  glGetProgramiv(program, GL_LINK_STATUS, &status);
-  if(status == GL_FALSE) {
-    GLint info_log_length;
-    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &info_log_length);
+// Logs the linker errors of the program
+void _shader_log_link_error(GLuint program) {
+  GLint info_log_length;
+  glGetProgramiv(program, GL_INFO_LOG_LENGTH, &info_log_length);
 
-    char *info_log = (char*)malloc((size_t)(info_log_length+1));
-    glGetProgramInfoLog(program, info_log_length, NULL, info_log);
+  char *info_log = (char*)malloc((size_t)(info_log_length+1));
+  glGetProgramInfoLog(program, info_log_length, NULL, info_log);
 
-    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Linker failure: %s\n", info_log);
+  SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Linker failure: %s\n", info_log);
 
-    // Cleanup
-    free(info_log);
-    glDetachShader(program, vshader);
-    glDeleteShader(vshader);
-    glDetachShader(program, fshader);
-    glDeleteShader(fshader);
-    glDeleteProgram(program);
-    return 0;
+  free(info_log);
+}
+
+// The shader objects aren't needed anymore after linking, so remove them
+void _shader_release_stages(shader_pending_t *p) {
+  if(p->vshader != 0) {
+    glDetachShader(p->program, p->vshader);
+    glDeleteShader(p->vshader);
+  }
+  if(p->fshader != 0) {
+    glDetachShader(p->program, p->fshader);
+    glDeleteShader(p->fshader);
   }
+  p->vshader = 0;
+  p->fshader = 0;
+}
 
-  // The shader objects aren't needed anymore after linking, so remove them
-  glDetachShader(program, vshader);
-  glDeleteShader(vshader);
-  glDetachShader(program, fshader);
-  glDeleteShader(fshader);
+// Frees the pending entry of a program and removes it from the list
+void _shader_remove_pending(uint64_t index) {
+  shader_pending_t *p = (shader_pending_t*)array_at(pending, index);
+  free(p->vertfile);
+  free(p->fragfile);
+  free(p->vertcode);
+  free(p->fragcode);
+
+  // Order does not matter, move the last entry into the hole
+  if(index+1 < array_size(pending)) array_set(pending, index, array_back(pending));
+  array_pop(pending);
+}
 
-  return program;
+// Index of the program in the pending list, -1 if it has been finished
+int64_t _shader_find_pending(GLuint program) {
+  if(pending == NULL) return -1;
+  for(uint64_t i = 0; i < array_size(pending); i++) {
+    if(((shader_pending_t*)array_at(pending, i))->program == program) return (int64_t)i;
+  }
+  return -1;
 }
- 
-shader_t shader_load(const char *vertfile, const char *fragfile) {
-  FILE *f = fopen(vertfile, "rb");
- 
+
+// Lets the driver compile and link on as many threads as it likes, if it can
+void _shader_init_parallel_compile() {
+  static bool initialized = false;
+  if(initialized) return;
+  initialized = true;
+
+  shader_max_compiler_threads_fn max_threads = NULL;
+  if(SDL_GL_ExtensionSupported("GL_KHR_parallel_shader_compile")) {
+    max_threads = (shader_max_compiler_threads_fn)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsKHR");
+  } else if(SDL_GL_ExtensionSupported("GL_ARB_parallel_shader_compile")) {
+    max_threads = (shader_max_compiler_threads_fn)SDL_GL_GetProcAddress("glMaxShaderCompilerThreadsARB");
+  }
+
+  if(max_threads != NULL) {
+    // 0xFFFFFFFF leaves the number of threads up to the driver
+    max_threads(0xFFFFFFFFu);
+    parallel_compile = true;
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Compiling shaders in parallel\n");
+  }
+}
+
+// Reads a whole shader file into a NULL terminated buffer
+char* _shader_read(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+
   // Make sure the file was opened
   if(f == NULL) {
-    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not open file: %s\n", vertfile);
-    return 0;
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not open file: %s\n", filename);
+    return NULL;
   }
 
   // Get the number of bytes in the file
@@ -85,104 +249,326 @@ shader_t shader_load(const char *vertfile, const char *fragfile) {
   size_t fsize = (size_t)ftell(f);
   fseek(f, 0, SEEK_SET);
 
-  // Read the vertex shader file into a buffer
-  char *vertcode = (char*)malloc(fsize+1);
-  fread(vertcode, fsize, 1, f);
+  // Read the file into a buffer
+  char *code = (char*)malloc(fsize+1);
+  fsize = fread(code, 1, fsize, f);
   fclose(f);
 
   // NULL terminated buffer
-  vertcode[fsize] = 0;
+  code[fsize] = 0;
 
-  // Compile the vertex shader
-  GLuint vshader = _shader_compile(vertcode, GL_VERTEX_SHADER);
-  if(vshader == 0) return 0;
-  
-  free(vertcode);
+  return code;
+}
 
-  f = fopen(fragfile, "rb");
-  
-  if(f == NULL) {
-    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not open file: %s\n", vertfile);
-    return 0;
+// Inserts the stage and feature defines and the common declarations after the #version line
+char* _shader_specialize(const char *code, const char *common, GLenum stage, uint32_t features) {
+  // Everything up to and including the end of the #version line stays first
+  const char *version = strstr(code, "#version");
+  const char *body = code;
+  if(version != NULL) {
+    body = strchr(version, '\n');
+    body = (body != NULL) ? body+1 : version+strlen(version);
   }
 
-  // Get the number of bytes in the file
-  fseek(f, 0, SEEK_END);
-  fsize = (size_t)ftell(f);
-  fseek(f, 0, SEEK_SET);
+  // The common declarations need to know which stage they are part of
+  char defines[256] = "";
+  strcat(defines, (stage == GL_VERTEX_SHADER) ? "#define VERTEX_SHADER\n" : "#define FRAGMENT_SHADER\n");
+  for(uint32_t i = 0; i < SHADER_NUM_FEATURES; i++) {
+    if(!(features & (1u << i))) continue;
+    strcat(defines, "#define ");
+    strcat(defines, feature_names[i]);
+    strcat(defines, "\n");
+  }
+
+  // Count the lines of the prefix so compile errors still point at the right line of the file
+  uint32_t line = 1;
+  for(const char *c = code; c < body; c++) line += (*c == '\n');
+
+  char line_directive[32];
+  snprintf(line_directive, 32, "\n#line %u\n", line);
+
+  size_t prefix = (size_t)(body-code);
+  char *out = (char*)malloc(prefix+strlen(defines)+strlen(common)+strlen(line_directive)+strlen(body)+1);
+  memcpy(out, code, prefix);
+  out[prefix] = 0;
+  strcat(out, defines);
+  strcat(out, common);
+  strcat(out, line_directive);
+  strcat(out, body);
+
+  return out;
+}
+
+// Key of a program in the binary cache. A binary is only valid for the exact sources and for the driver that produced it
+uint64_t _shader_cache_key(const char *vertcode, const char *fragcode) {
+  uint64_t key = hash_fnv1a_str(vertcode, HASH_FNV1A_SEED);
+  key = hash_fnv1a_str(fragcode, key);
+  key = hash_fnv1a_str((const char*)glGetString(GL_VENDOR), key);
+  key = hash_fnv1a_str((const char*)glGetString(GL_RENDERER), key);
+  return hash_fnv1a_str((const char*)glGetString(GL_VERSION), key);
+}
+
+// Hands the cached binary to the program, returns false if it is not cached. Whether the driver accepts it is only known from the link status
+bool _shader_load_binary(GLuint program, uint64_t key) {
+  char cache_file[256];
+  snprintf(cache_file, 256, "%s/%016llx.glb", SHADER_CACHE_DIR, (unsigned long long)key);
+
+  FILE *f = fopen(cache_file, "rb");
+  if(f == NULL) return false;
+
+  shader_binary_header_t header;
+  if(fread(&header, sizeof(shader_binary_header_t), 1, f) != 1 || header.magic != SHADER_BINARY_MAGIC || header.key != key) {
+    fclose(f);
+    return false;
+  }
 
-  // Read the fragment shader file into a buffer
-  char *fragcode = (char*)malloc(fsize+1);
-  fread(fragcode, fsize, 1, f);
+  void *binary = malloc(header.length);
+  bool ok = (fread(binary, header.length, 1, f) == 1);
   fclose(f);
 
-  // NULL terminated buffer
-  fragcode[fsize] = 0;
+  if(ok) glProgramBinary(program, header.format, binary, (GLsizei)header.length);
+  free(binary);
+
+  return ok;
+}
+
+// Writes the binary of a linked program to the binary cache
+void _shader_save_binary(GLuint program, uint64_t key) {
+  GLint length;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if(length <= 0) return;
+
+  shader_binary_header_t header = {SHADER_BINARY_MAGIC, 0, key, (uint64_t)length};
+  void *binary = malloc((size_t)length);
+  glGetProgramBinary(program, length, NULL, &header.format, binary);
+
+  char cache_file[256];
+  snprintf(cache_file, 256, "%s/%016llx.glb", SHADER_CACHE_DIR, (unsigned long long)key);
+
+  // A failure to write the cache only costs another compile next time
+  mkdir(SHADER_CACHE_DIR, 0755);
+  FILE *f = fopen(cache_file, "wb");
+  if(f != NULL) {
+    bool ok = (fwrite(&header, sizeof(shader_binary_header_t), 1, f) == 1 && fwrite(binary, (size_t)length, 1, f) == 1);
+    fclose(f);
+    if(!ok) SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not write file: %s\n", cache_file);
+  }
+
+  free(binary);
+}
+
+shader_t shader_submit(const char *vertfile, const char *fragfile, uint32_t features) {
+  _shader_init_parallel_compile();
+
+  char *common = _shader_read(SHADER_COMMON_FILE);
+  char *vertfile_code = _shader_read(vertfile);
+  char *fragfile_code = _shader_read(fragfile);
+
+  if(common == NULL || vertfile_code == NULL || fragfile_code == NULL) {
+    free(common);
+    free(vertfile_code);
+    free(fragfile_code);
+    return 0;
+  }
+
+  shader_pending_t p;
+  p.vshader = 0;
+  p.fshader = 0;
+  p.features = features;
+  p.start = SDL_GetPerformanceCounter();
+
+  p.vertfile = (char*)malloc(strlen(vertfile)+1);
+  strcpy(p.vertfile, vertfile);
+  p.fragfile = (char*)malloc(strlen(fragfile)+1);
+  strcpy(p.fragfile, fragfile);
+
+  // Specialize both stages for the variant, the binary cache key covers the defines since it hashes the result
+  p.vertcode = _shader_specialize(vertfile_code, common, GL_VERTEX_SHADER, features);
+  p.fragcode = _shader_specialize(fragfile_code, common, GL_FRAGMENT_SHADER, features);
+  free(common);
+  free(vertfile_code);
+  free(fragfile_code);
+
+  // Drivers are allowed to support no binary formats at all
+  GLint num_formats;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+  p.binary_cache = (num_formats > 0);
+
+  p.key = _shader_cache_key(p.vertcode, p.fragcode);
+  p.program = glCreateProgram();
+  p.cached = p.binary_cache && _shader_load_binary(p.program, p.key);
+
+  // Compile the shaders and link them. None of this waits for the driver, the status is checked by shader_finish
+  if(!p.cached) {
+    p.vshader = _shader_compile(p.vertcode, GL_VERTEX_SHADER);
+    p.fshader = _shader_compile(p.fragcode, GL_FRAGMENT_SHADER);
+    _shader_link(p.program, p.vshader, p.fshader);
+  }
+
+  if(pending == NULL) pending = array_create(SHADER_NUM_VARIANTS, sizeof(shader_pending_t));
+  array_append(pending, &p);
+
+  return p.program;
+}
+
+bool shader_finish(shader_t s_id) {
+  int64_t index = _shader_find_pending(s_id);
+  if(index < 0) return true;
+  shader_pending_t *p = (shader_pending_t*)array_at(pending, (uint64_t)index);
+
+  // With parallel compilation the driver can tell whether the program is done without blocking
+  GLint ready = GL_FALSE;
+  if(parallel_compile) glGetProgramiv(p->program, GL_COMPLETION_STATUS_KHR, &ready);
+
+  uint64_t start = SDL_GetPerformanceCounter();
+  GLint status;
+  glGetProgramiv(p->program, GL_LINK_STATUS, &status);
+
+  // A driver update can invalidate binaries even when the version string stays the same
+  if(p->cached && status == GL_FALSE) {
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Program binary %s/%016llx.glb was rejected, compiling the shaders\n", SHADER_CACHE_DIR, (unsigned long long)p->key);
+    p->cached = false;
+    p->vshader = _shader_compile(p->vertcode, GL_VERTEX_SHADER);
+    p->fshader = _shader_compile(p->fragcode, GL_FRAGMENT_SHADER);
+    _shader_link(p->program, p->vshader, p->fshader);
+    glGetProgramiv(p->program, GL_LINK_STATUS, &status);
+  }
+
+  if(status == GL_FALSE) {
+    // Compile errors explain most link failures
+    bool compiled = _shader_check_compile(p->vshader, GL_VERTEX_SHADER);
+    compiled = _shader_check_compile(p->fshader, GL_FRAGMENT_SHADER) && compiled;
+    if(compiled) _shader_log_link_error(p->program);
+
+    // Cleanup
+    _shader_release_stages(p);
+    glDeleteProgram(p->program);
+    _shader_remove_pending((uint64_t)index);
+    return false;
+  }
+
+  _shader_release_stages(p);
+  if(!p->cached && p->binary_cache) _shader_save_binary(p->program, p->key);
 
-  // Compile the fragment shader
-  GLuint fshader = _shader_compile(fragcode, GL_FRAGMENT_SHADER);
-  if(fshader == 0) return 0;
-    
-  free(fragcode);
+  uint64_t end = SDL_GetPerformanceCounter();
+  double ms = timer_ms(end-p->start);
+  double waited = timer_ms(end-start);
 
-  // Link the compiled shader objects
-  GLuint program = _shader_link(vshader, fshader);
-  if(program == 0) return 0;
+  char variant[256] = "";
+  for(uint32_t i = 0; i < SHADER_NUM_FEATURES; i++) {
+    if(!(p->features & (1u << i))) continue;
+    strcat(variant, " ");
+    strcat(variant, feature_names[i]);
+  }
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s \'%s\' and \'%s\' (%s) %.2f ms after submitting, %s %.2f ms\n", p->cached ? "Loaded program binary for" : "Compiled", p->vertfile, p->fragfile, (p->features != 0) ? variant+1 : "no features", ms, ready ? "already done, took" : "waited", waited);
+
+  // Build the location table once so setting a uniform never goes through a string lookup in the driver
+  _shader_introspect(p->program);
+  _shader_remove_pending((uint64_t)index);
 
-  // Unbind the shader program
-  glUseProgram(0);
+  return true;
+}
 
+shader_t shader_load(const char *vertfile, const char *fragfile, uint32_t features) {
+  shader_t program = shader_submit(vertfile, fragfile, features);
+  if(program == 0 || !shader_finish(program)) return 0;
   return program;
 }
 
 void shader_bind(shader_t s_id) {
-  glUseProgram(s_id);
+  glstate_use_program(s_id);
 }
 
-void shader_set_uniform(shader_t s_id, const char *uniform_name, shader_uniform_type_t uniform_type, void *data) {
-  glUseProgram(s_id);
+void shader_bind_block(shader_t s_id, const char *block_name, GLuint binding) {
+  // Not every shader uses every block
+  GLuint index = glGetUniformBlockIndex(s_id, block_name);
+  if(index != GL_INVALID_INDEX) glUniformBlockBinding(s_id, index, binding);
+}
+
+shader_uniform_t shader_uniform(shader_t s_id, const char *uniform_name) {
+  if(uniforms == NULL) return SHADER_UNIFORM_NONE;
+
+  for(uint64_t i = 0; i < array_size(uniforms); i++) {
+    shader_uniform_info_t *info = (shader_uniform_info_t*)array_at(uniforms, i);
+    if(info->program == s_id && info->name != NULL && strcmp(info->name, uniform_name) == 0) return (shader_uniform_t)(i+1);
+  }
+
+  return SHADER_UNIFORM_NONE;
+}
+
+void shader_set(shader_uniform_t uniform, shader_uniform_type_t uniform_type, const void *data) {
+  if(uniform == SHADER_UNIFORM_NONE) return;
+  stats.sets++;
+
+  // Nothing to do if the program already holds the value
+  shader_uniform_info_t *info = (shader_uniform_info_t*)array_at(uniforms, uniform-1);
+  size_t size = _shader_uniform_size(uniform_type);
+  if(info->valid && memcmp(info->value, data, size) == 0) return;
+
+  memcpy(info->value, data, size);
+  info->valid = true;
+  stats.uploads++;
+
+  // Uniforms are set on the current program
+  if(glstate_program() != info->program) {
+    glstate_use_program(info->program);
+    stats.program_binds++;
+  }
 
   switch(uniform_type) {
   case SHADER_UNIFORM_MAT4:
-    {
-      GLint uniform_loc = glGetUniformLocation(s_id, uniform_name);
-      if(uniform_loc >= 0) glUniformMatrix4fv(uniform_loc, 1, GL_FALSE, data);
-      break;
-    }
+    glUniformMatrix4fv(info->location, 1, GL_FALSE, data);
+    break;
   case SHADER_UNIFORM_VEC3:
-    {
-      GLint uniform_loc = glGetUniformLocation(s_id, uniform_name);
-      if(uniform_loc >= 0) glUniform3fv(uniform_loc, 1, data);
-      break;
-    }
+    glUniform3fv(info->location, 1, data);
+    break;
   case SHADER_UNIFORM_FLOAT:
-    {
-      GLint uniform_loc = glGetUniformLocation(s_id, uniform_name);
-      if(uniform_loc >= 0) glUniform1f(uniform_loc, *((GLfloat*)data));
-      break;
-    }
+    glUniform1f(info->location, *((const GLfloat*)data));
+    break;
   case SHADER_UNIFORM_UINT:
-    {
-      GLint uniform_loc = glGetUniformLocation(s_id, uniform_name);
-      if(uniform_loc >= 0) glUniform1ui(uniform_loc, *((GLuint*)data));
-      break;
-    }
+    glUniform1ui(info->location, *((const GLuint*)data));
+    break;
   case SHADER_UNIFORM_INT:
-    {
-      GLint uniform_loc = glGetUniformLocation(s_id, uniform_name);
-      if(uniform_loc >= 0) glUniform1i(uniform_loc, *((GLint*)data));
-      break;
-    }
-
+    glUniform1i(info->location, *((const GLint*)data));
+    break;
   }
 }
 
+void shader_set_uniform(shader_t s_id, const char *uniform_name, shader_uniform_type_t uniform_type, void *data) {
+  shader_set(shader_uniform(s_id, uniform_name), uniform_type, data);
+}
+
+void shader_stats(shader_stats_t *out) {
+  *out = stats;
+}
+
+void shader_reset_stats() {
+  memset(&stats, 0, sizeof(shader_stats_t));
+}
+
 void shader_unbind() {
-  glUseProgram(0);
+  glstate_use_program(0);
 }
 
 void shader_delete(shader_t s_id) {
-  glUseProgram(0);
+  // A program that was never finished still owns its shader objects
+  int64_t index = _shader_find_pending(s_id);
+  if(index >= 0) {
+    _shader_release_stages((shader_pending_t*)array_at(pending, (uint64_t)index));
+    _shader_remove_pending((uint64_t)index);
+  }
+
+  glstate_use_program(0);
   glDeleteProgram(s_id);
-}
 
+  // Handles stay valid indices, the entries of the program just never match a lookup again
+  if(uniforms == NULL) return;
+  for(uint64_t i = 0; i < array_size(uniforms); i++) {
+    shader_uniform_info_t *info = (shader_uniform_info_t*)array_at(uniforms, i);
+    if(info->program != s_id) continue;
+
+    free(info->name);
+    info->name = NULL;
+    info->program = 0;
+  }
+}
@@ -0,0 +1,1078 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include <SDL2/SDL.h>
+
+#include "texture.h"
+#include "hash.h"
+#include "array.h"
+#include "glstate.h"
+#include "timer.h"
+
+// S3TC formats are not part of the core profile
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#ifndef GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// Levels no larger than this are always resident for streamed textures, so there is something to sample right away
+#define TEXTURE_STREAM_TAIL_SIZE 64
+
+// States of the background load of a streamed texture
+#define TEXTURE_STREAM_LOADING 0
+#define TEXTURE_STREAM_DONE 1
+#define TEXTURE_STREAM_ABANDONED 2
+
+// Number of pixel buffer objects the uploads rotate through
+#define TEXTURE_PBO_RING_SIZE 4
+
+// Largest staging buffer the ring keeps. Bigger textures are staged in several batches, and a slot that had to grow
+// past this for a single level is shrunk again the next time it is used for something smaller
+#define TEXTURE_PBO_MAX_SIZE (16*1024*1024)
+
+// A staging buffer for uploads. The fence marks the end of the last transfers sourced from it
+typedef struct {
+  GLuint pbo;
+  GLsizeiptr capacity;
+  GLsync fence;
+} texture_pbo_t;
+
+// One level of one layer of a texture, staged right after the previous piece of its batch
+typedef struct {
+  uint32_t level;
+  uint32_t layer;
+  GLsizei width;
+  GLsizei height;
+  size_t size;
+  const uint8_t *data;
+} texture_piece_t;
+
+struct texture_stream {
+  // Where the levels come from
+  char cache_file[256];
+  uint64_t key;
+  bc_format_t format;
+
+  // Finest level requested by the groups drawn since the last update, and what the last update settled on
+  uint32_t wanted;
+  uint32_t needed;
+
+  // Always resident levels start here
+  uint32_t tail;
+
+  // A background load of the levels from loading up to end, the finest one resident. state goes from loading to done
+  // once bc holds them, or to abandoned if the texture went away first and the load has to free the stream itself
+  bool pending;
+  uint32_t loading;
+  uint32_t end;
+  SDL_atomic_t state;
+  bc_image_t bc;
+};
+
+struct texture_pending {
+  bool compressed;
+  image_t img;
+  bc_image_t bc;
+};
+
+static bool compression_enabled = false;
+static bool streaming_enabled = false;
+static size_t stream_budget = 0;
+static uint64_t stream_loads = 0, stream_evictions = 0;
+
+static bool residency_enabled = false;
+static size_t residency_budget = 0;
+static uint64_t frame = 0;
+static texture_residency_stats_t residency_stats;
+
+static texture_pbo_t pbo_ring[TEXTURE_PBO_RING_SIZE];
+static uint32_t pbo_next = 0;
+static size_t stage_size = 0;
+static bool stage_mapped = false;
+static uint8_t *stage_fallback = NULL;
+static size_t stage_fallback_size = 0;
+static texture_upload_stats_t upload_stats;
+
+// Every live texture, so an image is decoded and uploaded once no matter how many materials or meshes use it
+static array_t *registry = NULL;
+
+// Guards the registry and the reference counts, which loader threads touch while uploads are deferred. Textures
+// decoded or released meanwhile wait in the pending lists for the context thread
+static SDL_mutex *registry_lock = NULL;
+static SDL_cond *registry_cond = NULL;
+static bool uploads_deferred = false;
+static array_t *pending_uploads = NULL;
+static array_t *pending_deletes = NULL;
+
+// Created on the context thread, by its first texture or before any loader thread starts
+void _texture_init_registry() {
+  if(registry != NULL) return;
+  registry = array_create(16, sizeof(texture_t*));
+  registry_lock = SDL_CreateMutex();
+  registry_cond = SDL_CreateCond();
+  pending_uploads = array_create(16, sizeof(texture_t*));
+  pending_deletes = array_create(16, sizeof(texture_t*));
+}
+
+// Removes the texture from the registry by moving the last entry into its slot. The registry lock must be held
+void _texture_unregister(texture_t *tex) {
+  size_t size = array_size(registry);
+  for(uint64_t i = 0; i < size; i++) {
+    if(*((texture_t**)array_at(registry, i)) == tex) {
+      array_set(registry, i, array_at(registry, size-1));
+      array_pop(registry);
+      break;
+    }
+  }
+}
+
+// Counts the staging batches whose transfer finished while the CPU did something else. Checked without waiting each
+// time the ring is touched, so every batch is counted once, either here or as a stall when its slot comes around
+void _texture_poll_fences() {
+  for(uint32_t i = 0; i < TEXTURE_PBO_RING_SIZE; i++) {
+    texture_pbo_t *slot = &pbo_ring[i];
+    if(slot->fence == NULL || glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) == GL_TIMEOUT_EXPIRED) continue;
+    glDeleteSync(slot->fence);
+    slot->fence = NULL;
+    upload_stats.overlapped++;
+  }
+}
+
+// Maps size bytes of the next PBO of the ring for writing and leaves it bound to GL_PIXEL_UNPACK_BUFFER, so the
+// glTexSubImage calls issued after _texture_stage_unmap source from it and return without waiting for the transfer
+uint8_t* _texture_stage_map(size_t size) {
+  _texture_poll_fences();
+
+  texture_pbo_t *slot = &pbo_ring[pbo_next];
+  pbo_next = (pbo_next+1)%TEXTURE_PBO_RING_SIZE;
+
+  if(slot->pbo == 0) glGenBuffers(1, &slot->pbo);
+
+  // The last transfer out of this PBO has to be finished before it can be written again
+  if(slot->fence != NULL) {
+    uint64_t start = SDL_GetPerformanceCounter();
+    while(glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+    upload_stats.stall_ms += timer_elapsed_ms(start);
+    upload_stats.stalls++;
+    glDeleteSync(slot->fence);
+    slot->fence = NULL;
+  }
+
+  // Grow for a larger batch, and give back what an oversized one left behind
+  glstate_bind_buffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+  if((GLsizeiptr)size > slot->capacity || (slot->capacity > TEXTURE_PBO_MAX_SIZE && size <= TEXTURE_PBO_MAX_SIZE)) {
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)size, NULL, GL_STREAM_DRAW);
+    slot->capacity = (GLsizeiptr)size;
+  }
+  stage_size = size;
+
+  // The fence already guarantees the GPU is done with the buffer, so the map does not need to synchronize
+  uint8_t *ptr = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, (GLsizeiptr)size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  stage_mapped = (ptr != NULL);
+  if(stage_mapped) return ptr;
+
+  // Without a mapping the batch goes through client memory and glBufferSubData
+  if(size > stage_fallback_size) {
+    free(stage_fallback);
+    stage_fallback = (uint8_t*)malloc(size);
+    stage_fallback_size = size;
+  }
+  return stage_fallback;
+}
+
+void _texture_stage_unmap() {
+  if(stage_mapped) glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  else glBufferSubData(GL_PIXEL_UNPACK_BUFFER, 0, (GLsizeiptr)stage_size, stage_fallback);
+}
+
+// Fences the transfers just issued from the current PBO and unbinds it
+void _texture_stage_fence() {
+  texture_pbo_t *slot = &pbo_ring[(pbo_next+TEXTURE_PBO_RING_SIZE-1)%TEXTURE_PBO_RING_SIZE];
+  slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glstate_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+// Uploads the pieces staged back to back in the current PBO into the bound texture, then fences the PBO. A zero
+// internal format means uncompressed RGBA8
+void _texture_issue(texture_t *tex, const texture_piece_t *pieces, size_t count, GLenum internal_format) {
+  size_t offset = 0;
+  for(size_t i = 0; i < count; i++) {
+    const texture_piece_t *piece = &pieces[i];
+    GLint level = (GLint)piece->level;
+    if(tex->target == GL_TEXTURE_2D_ARRAY && internal_format != 0) {
+      glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, (GLint)piece->layer, piece->width, piece->height, 1, internal_format, (GLsizei)piece->size, (GLvoid*)offset);
+    } else if(tex->target == GL_TEXTURE_2D_ARRAY) {
+      glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, (GLint)piece->layer, piece->width, piece->height, 1, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)offset);
+    } else if(internal_format != 0) {
+      glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, piece->width, piece->height, internal_format, (GLsizei)piece->size, (GLvoid*)offset);
+    } else {
+      glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, piece->width, piece->height, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)offset);
+    }
+    offset += piece->size;
+    tex->bytes += piece->size;
+    upload_stats.uploads++;
+    upload_stats.bytes += piece->size;
+  }
+  _texture_stage_fence();
+}
+
+// Copies the pieces into as few staging batches as fit under the size cap, so a whole texture usually goes out
+// through a single PBO with a single fence and the ring only waits when it wraps around to it several textures later
+void _texture_upload_pieces(texture_t *tex, const texture_piece_t *pieces, size_t count, GLenum internal_format) {
+  for(size_t i = 0; i < count;) {
+    size_t size = pieces[i].size, end = i+1;
+    while(end < count && size+pieces[end].size <= TEXTURE_PBO_MAX_SIZE) size += pieces[end++].size;
+
+    uint8_t *dst = _texture_stage_map(size);
+    for(size_t p = i; p < end; p++) {
+      memcpy(dst, pieces[p].data, pieces[p].size);
+      dst += pieces[p].size;
+    }
+    _texture_stage_unmap();
+    _texture_issue(tex, pieces+i, end-i, internal_format);
+    i = end;
+  }
+}
+
+// Finest level that is always resident for a streamed texture
+uint32_t _texture_tail_level(uint32_t width, uint32_t height, uint32_t levels) {
+  uint32_t level = 0;
+  while(level+1 < levels && ((width >> level) > TEXTURE_STREAM_TAIL_SIZE || (height >> level) > TEXTURE_STREAM_TAIL_SIZE)) level++;
+  return level;
+}
+
+// Video memory a streamed texture needs to hold the levels from first down to the coarsest one
+size_t _texture_stream_bytes(const texture_t *tex, uint32_t first) {
+  size_t bytes = 0;
+  for(uint32_t level = first; level < tex->levels; level++) {
+    uint32_t width = (tex->width >> level) > 0 ? tex->width >> level : 1, height = (tex->height >> level) > 0 ? tex->height >> level : 1;
+    bytes += bc_level_size(tex->stream->format, width, height);
+  }
+  return bytes;
+}
+
+// Background job reading the levels of a streamed texture from the texture cache
+void _texture_stream_load(void *ctx, uint64_t index) {
+  texture_stream_t *stream = (texture_stream_t*)ctx;
+
+  // A failed read leaves bc empty, the update then keeps the levels already resident
+  bc_read_levels(&stream->bc, stream->cache_file, stream->key, stream->loading, stream->end);
+  if(SDL_AtomicCAS(&stream->state, TEXTURE_STREAM_LOADING, TEXTURE_STREAM_DONE)) return;
+
+  bc_free(&stream->bc);
+  free(stream);
+}
+
+// Drops the streaming state. A load still in flight is left to free it once it finishes, nothing waits for it
+void _texture_stream_free(texture_t *tex) {
+  texture_stream_t *stream = tex->stream;
+  if(stream == NULL) return;
+  tex->stream = NULL;
+
+  if(stream->pending && SDL_AtomicCAS(&stream->state, TEXTURE_STREAM_LOADING, TEXTURE_STREAM_ABANDONED)) return;
+  bc_free(&stream->bc);
+  free(stream);
+}
+
+// The cache file is named after the path, the key inside it also covers the size and modification time of the source.
+// False if the source cannot be read
+bool _texture_cache_key(const char *filename, char *cache_file, uint64_t *key) {
+  struct stat st;
+  if(stat(filename, &st) != 0) return false;
+
+  uint64_t path_hash = hash_fnv1a_str(filename, HASH_FNV1A_SEED);
+  int64_t stamp[2] = {(int64_t)st.st_size, (int64_t)st.st_mtime};
+  *key = hash_fnv1a(stamp, sizeof(stamp), path_hash);
+
+  snprintf(cache_file, 256, "%s/%016llx.bct", TEXTURE_CACHE_DIR, (unsigned long long)path_hash);
+  return true;
+}
+
+// Reads the block compressed version of the texture from the texture cache, encoding and caching it on a miss
+bool _texture_decode_compressed(texture_t *tex, const char *filename, bc_image_t *out) {
+  char cache_file[256];
+  uint64_t key;
+  if(!_texture_cache_key(filename, cache_file, &key)) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Error reading texture file: %s\n", filename);
+    return false;
+  }
+
+  // A streamed texture only reads the header and the always resident levels
+  bc_image_t bc;
+  bool cached = streaming_enabled ? bc_read_info(&bc, cache_file, key) : bc_read(&bc, cache_file, key);
+  if(cached && streaming_enabled) cached = bc_read_levels(&bc, cache_file, key, _texture_tail_level(bc.width, bc.height, bc.levels), IMAGE_MAX_LEVELS);
+
+  if(cached) {
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Loaded \'%s\' from the texture cache\n", filename);
+  } else {
+    image_t img;
+    if(!image_load(&img, filename)) return false;
+    image_generate_mipmaps(&img);
+
+    // Only pay for the alpha block if some pixel is not opaque
+    bc_format_t format = bc_image_has_alpha(&img) ? BC_FORMAT_BC3 : BC_FORMAT_BC1;
+
+    bc_encode(&bc, &img, format, threadpool_default());
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Encoded \'%s\' to %s\n", filename, (format == BC_FORMAT_BC1) ? "BC1" : "BC3");
+
+    image_free(&img);
+
+    // A failure to write the cache only costs another encode next time
+    mkdir(TEXTURE_CACHE_DIR, 0755);
+    bc_write(&bc, cache_file, key);
+  }
+
+  if(streaming_enabled) {
+    tex->stream = (texture_stream_t*)calloc(1, sizeof(texture_stream_t));
+    snprintf(tex->stream->cache_file, 256, "%s", cache_file);
+    tex->stream->key = key;
+    tex->stream->format = bc.format;
+    tex->stream->tail = _texture_tail_level(bc.width, bc.height, bc.levels);
+    tex->stream->wanted = bc.levels-1;
+    tex->stream->needed = tex->stream->tail;
+
+    // Freshly encoded textures start out with the tail only, like the ones read from the cache
+    for(uint32_t level = 0; level < tex->stream->tail; level++) {
+      free(bc.data[level]);
+      bc.data[level] = NULL;
+    }
+  }
+
+  *out = bc;
+
+  return true;
+}
+
+// Reads the image, or its block compressed version, without touching the GL so it can run on any thread
+bool _texture_decode(texture_t *tex, const char *filename, texture_pending_t *pending) {
+  pending->compressed = compression_enabled;
+  if(compression_enabled) return _texture_decode_compressed(tex, filename, &pending->bc);
+
+  if(!image_load(&pending->img, filename)) return false;
+
+  // Build the full mip chain on the CPU so minified surfaces sample a prefiltered level
+  image_generate_mipmaps(&pending->img);
+
+  return true;
+}
+
+void _texture_upload_pending(texture_t *tex, texture_pending_t *pending) {
+  if(pending->compressed) {
+    texture_upload_compressed(tex, &pending->bc);
+    bc_free(&pending->bc);
+  } else {
+    texture_upload(tex, &pending->img);
+    image_free(&pending->img);
+  }
+}
+
+// Frees a texture whose last reference is gone and that is out of the registry
+void _texture_destroy(texture_t *tex) {
+  if(tex->pending != NULL) {
+    if(tex->pending->compressed) bc_free(&tex->pending->bc);
+    else image_free(&tex->pending->img);
+    free(tex->pending);
+  }
+  _texture_stream_free(tex);
+  texture_delete(tex);
+  free(tex->path);
+  free(tex);
+}
+
+void texture_enable_compression(bool enable) {
+  compression_enabled = enable;
+  if(enable && !SDL_GL_ExtensionSupported("GL_EXT_texture_compression_s3tc")) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "GL_EXT_texture_compression_s3tc not supported, textures will not be compressed\n");
+    compression_enabled = false;
+  }
+}
+
+void texture_enable_streaming(size_t budget) {
+  // Levels are streamed out of the texture cache, which only holds compressed textures
+  if(!compression_enabled) texture_enable_compression(true);
+  if(!compression_enabled) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Texture streaming needs texture compression, textures will be fully resident\n");
+    return;
+  }
+
+  streaming_enabled = true;
+  stream_budget = budget;
+}
+
+void texture_enable_residency(size_t budget) {
+  residency_enabled = true;
+  residency_budget = budget;
+}
+
+// While deferred, textures acquired on any thread are only decoded, the GL side waits for texture_flush_uploads on
+// the context thread. Turning it off flushes what is left
+void texture_defer_uploads(bool defer) {
+  _texture_init_registry();
+  uploads_deferred = defer;
+  if(!defer) texture_flush_uploads();
+}
+
+// Uploads the textures decoded and deletes the ones released since the last flush, on the context thread. Returns the
+// number of textures uploaded
+size_t texture_flush_uploads() {
+  if(registry == NULL) return 0;
+
+  SDL_LockMutex(registry_lock);
+  array_t *uploads = pending_uploads, *deletes = pending_deletes;
+  pending_uploads = array_create(16, sizeof(texture_t*));
+  pending_deletes = array_create(16, sizeof(texture_t*));
+  SDL_UnlockMutex(registry_lock);
+
+  // A texture released before its upload is uploaded anyway, it is deleted right after
+  size_t num_uploads = array_size(uploads);
+  for(uint64_t i = 0; i < num_uploads; i++) {
+    texture_t *tex = *((texture_t**)array_at(uploads, i));
+    _texture_upload_pending(tex, tex->pending);
+    free(tex->pending);
+    tex->pending = NULL;
+  }
+  for(uint64_t i = 0; i < array_size(deletes); i++) _texture_destroy(*((texture_t**)array_at(deletes, i)));
+
+  array_delete(uploads);
+  array_delete(deletes);
+
+  return num_uploads;
+}
+
+texture_t* texture_acquire(const char *filename) {
+  // Different relative paths to the same file should share a texture
+  char path[PATH_MAX];
+  if(realpath(filename, path) == NULL) snprintf(path, PATH_MAX, "%s", filename);
+
+  _texture_init_registry();
+  SDL_LockMutex(registry_lock);
+
+  for(uint64_t i = 0; i < array_size(registry); i++) {
+    texture_t *tex = *((texture_t**)array_at(registry, i));
+    if(strcmp(tex->path, path) != 0) continue;
+
+    // Another thread may still be loading it. The last one holding a failed load frees it
+    tex->refs++;
+    while(tex->loading) SDL_CondWait(registry_cond, registry_lock);
+    if(tex->failed) {
+      if(--tex->refs == 0) _texture_destroy(tex);
+      tex = NULL;
+    }
+    SDL_UnlockMutex(registry_lock);
+    return tex;
+  }
+
+  // First reference, registered before it is loaded so other threads wait for this load instead of starting their
+  // own. Always load through the canonical path so a reload finds the same cache file
+  texture_t *tex = (texture_t*)calloc(1, sizeof(texture_t));
+  tex->refs = 1;
+  tex->reloadable = true;
+  tex->last_used = frame;
+  tex->loading = true;
+  tex->path = (char*)malloc(strlen(path)+1);
+  strcpy(tex->path, path);
+  array_append(registry, &tex);
+  SDL_UnlockMutex(registry_lock);
+
+  // Uploads are only ever immediate on the context thread
+  texture_pending_t pending;
+  memset(&pending, 0, sizeof(texture_pending_t));
+  bool decoded = uploads_deferred ? _texture_decode(tex, path, &pending) : texture_load(tex, path);
+
+  SDL_LockMutex(registry_lock);
+  tex->loading = false;
+  if(decoded && uploads_deferred) {
+    tex->pending = (texture_pending_t*)malloc(sizeof(texture_pending_t));
+    *tex->pending = pending;
+    array_append(pending_uploads, &tex);
+  } else if(!decoded) {
+    tex->failed = true;
+    _texture_unregister(tex);
+  }
+  SDL_CondBroadcast(registry_cond);
+
+  texture_t *result = tex;
+  if(!decoded) {
+    if(--tex->refs == 0) _texture_destroy(tex);
+    result = NULL;
+  }
+  SDL_UnlockMutex(registry_lock);
+
+  return result;
+}
+
+// Block compresses a generated image, or reads it from the texture cache if the same pixels were encoded before. The
+// cache file is named after the contents since generated images have no source file to stamp
+void _texture_encode_cached(bc_image_t *bc, const image_t *img, bc_format_t format) {
+  uint32_t info[3] = {img->width, img->height, (uint32_t)format};
+  uint64_t key = hash_fnv1a(info, sizeof(info), HASH_FNV1A_SEED);
+  key = hash_fnv1a(img->pixels[0], (size_t)img->width*img->height*4, key);
+
+  char cache_file[256];
+  snprintf(cache_file, 256, "%s/%016llx.bct", TEXTURE_CACHE_DIR, (unsigned long long)key);
+  if(bc_read(bc, cache_file, key)) {
+    if(bc->levels == img->levels) return;
+    bc_free(bc);
+  }
+
+  bc_encode(bc, img, format, threadpool_default());
+  mkdir(TEXTURE_CACHE_DIR, 0755);
+  bc_write(bc, cache_file, key);
+}
+
+texture_t* texture_create(const char *name, const image_t *img) {
+  texture_t *tex = (texture_t*)calloc(1, sizeof(texture_t));
+  tex->refs = 1;
+  tex->path = (char*)malloc(strlen(name)+1);
+  strcpy(tex->path, name);
+
+  if(compression_enabled) {
+    bc_image_t bc;
+    _texture_encode_cached(&bc, img, bc_image_has_alpha(img) ? BC_FORMAT_BC3 : BC_FORMAT_BC1);
+    texture_upload_compressed(tex, &bc);
+    bc_free(&bc);
+  } else {
+    texture_upload(tex, img);
+  }
+
+  _texture_init_registry();
+  SDL_LockMutex(registry_lock);
+  array_append(registry, &tex);
+  SDL_UnlockMutex(registry_lock);
+
+  return tex;
+}
+
+texture_t* texture_create_array(const char *name, const image_t *images, uint32_t count) {
+  texture_t *tex = (texture_t*)calloc(1, sizeof(texture_t));
+  tex->refs = 1;
+  tex->path = (char*)malloc(strlen(name)+1);
+  strcpy(tex->path, name);
+
+  // All the layers share a format, so they all pay for alpha if one of them has it
+  if(compression_enabled) {
+    bool alpha = false;
+    for(uint32_t i = 0; i < count && !alpha; i++) alpha = bc_image_has_alpha(&images[i]);
+
+    bc_image_t *bcs = (bc_image_t*)malloc(sizeof(bc_image_t)*count);
+    for(uint32_t i = 0; i < count; i++) _texture_encode_cached(&bcs[i], &images[i], alpha ? BC_FORMAT_BC3 : BC_FORMAT_BC1);
+    texture_upload_compressed_array(tex, bcs, count);
+    for(uint32_t i = 0; i < count; i++) bc_free(&bcs[i]);
+    free(bcs);
+  } else {
+    texture_upload_array(tex, images, count);
+  }
+
+  _texture_init_registry();
+  SDL_LockMutex(registry_lock);
+  array_append(registry, &tex);
+  SDL_UnlockMutex(registry_lock);
+
+  return tex;
+}
+
+void texture_retain(texture_t *tex) {
+  SDL_LockMutex(registry_lock);
+  tex->refs++;
+  SDL_UnlockMutex(registry_lock);
+}
+
+void texture_release(texture_t *tex) {
+  SDL_LockMutex(registry_lock);
+  if(--tex->refs > 0) {
+    SDL_UnlockMutex(registry_lock);
+    return;
+  }
+
+  // Last reference is gone. Released on a loader thread, the GL texture goes away with the next flush
+  _texture_unregister(tex);
+  if(uploads_deferred) {
+    array_append(pending_deletes, &tex);
+    SDL_UnlockMutex(registry_lock);
+    return;
+  }
+  SDL_UnlockMutex(registry_lock);
+
+  _texture_destroy(tex);
+}
+
+void texture_upload(texture_t *tex, const image_t *img) {
+  tex->target = GL_TEXTURE_2D;
+  tex->layers = 1;
+  tex->width = img->width;
+  tex->height = img->height;
+  tex->levels = img->levels;
+  tex->first = 0;
+  tex->bytes = 0;
+
+  // Generate the texture handle
+  glGenTextures(1, &tex->texID);
+  glstate_bind_texture(0, GL_TEXTURE_2D, tex->texID);
+
+  // Set the texture parameters, trilinear filtering over all the uploaded levels
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (img->levels > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)img->levels-1);
+
+  // Allocate the storage for every level, then upload the pixel data of all the levels through the PBO ring
+  texture_piece_t pieces[IMAGE_MAX_LEVELS];
+  for(uint32_t level = 0; level < img->levels; level++) {
+    GLsizei width = (GLsizei)image_level_width(img, level), height = (GLsizei)image_level_height(img, level);
+    glTexImage2D(GL_TEXTURE_2D, (GLint)level, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    pieces[level] = (texture_piece_t){level, 0, width, height, (size_t)width*(size_t)height*4, img->pixels[level]};
+  }
+  _texture_upload_pieces(tex, pieces, img->levels, 0);
+
+  // Unbind the texture
+  glstate_bind_texture(0, GL_TEXTURE_2D, 0);
+}
+
+GLenum _texture_compressed_format(bc_format_t format) {
+  return (format == BC_FORMAT_BC1) ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+}
+
+// Allocates the storage of the levels of bc from first up to end in the bound texture
+void _texture_alloc_compressed(const bc_image_t *bc, uint32_t first, uint32_t end) {
+  for(uint32_t level = first; level < end; level++) {
+    GLsizei width = (GLsizei)((bc->width >> level) > 0 ? bc->width >> level : 1);
+    GLsizei height = (GLsizei)((bc->height >> level) > 0 ? bc->height >> level : 1);
+    glCompressedTexImage2D(GL_TEXTURE_2D, (GLint)level, _texture_compressed_format(bc->format), width, height, 0, (GLsizei)bc->size[level], NULL);
+  }
+}
+
+// Creates the GL texture for the levels of bc from first down and allocates their storage, leaving it bound. The
+// levels keep their numbers, the finer ones a streamed texture does not hold are below the base level. Returns the
+// internal format to upload the blocks with
+GLenum _texture_init_compressed(texture_t *tex, const bc_image_t *bc, uint32_t first) {
+  GLenum internal_format = _texture_compressed_format(bc->format);
+
+  tex->target = GL_TEXTURE_2D;
+  tex->layers = 1;
+  tex->width = bc->width;
+  tex->height = bc->height;
+  tex->levels = bc->levels;
+  tex->first = first;
+  tex->bytes = 0;
+
+  // Generate the texture handle
+  glGenTextures(1, &tex->texID);
+  glstate_bind_texture(0, GL_TEXTURE_2D, tex->texID);
+
+  // Set the texture parameters, trilinear filtering over all the uploaded levels
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, (bc->levels > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, (GLint)first);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)bc->levels-1);
+  _texture_alloc_compressed(bc, first, bc->levels);
+
+  return internal_format;
+}
+
+// Pieces for the levels of bc from first up to end, with the data pointers of bc
+size_t _texture_compressed_pieces(const bc_image_t *bc, uint32_t first, uint32_t end, texture_piece_t *pieces) {
+  for(uint32_t level = first; level < end; level++) {
+    GLsizei width = (GLsizei)((bc->width >> level) > 0 ? bc->width >> level : 1);
+    GLsizei height = (GLsizei)((bc->height >> level) > 0 ? bc->height >> level : 1);
+    pieces[level-first] = (texture_piece_t){level, 0, width, height, bc->size[level], bc->data[level]};
+  }
+  return end-first;
+}
+
+void texture_upload_compressed(texture_t *tex, const bc_image_t *bc) {
+  // Levels finer than the first one that was read are left out, the base level of the GL texture is that level
+  uint32_t first = 0;
+  while(first+1 < bc->levels && bc->data[first] == NULL) first++;
+
+  // Allocate the storage for every level, then upload the blocks of all the levels through the PBO ring
+  GLenum internal_format = _texture_init_compressed(tex, bc, first);
+  texture_piece_t pieces[IMAGE_MAX_LEVELS];
+  _texture_upload_pieces(tex, pieces, _texture_compressed_pieces(bc, first, bc->levels, pieces), internal_format);
+
+  // Unbind the texture
+  glstate_bind_texture(0, GL_TEXTURE_2D, 0);
+}
+
+// Reads a fully resident texture from the texture cache straight into the mapped staging buffer, skipping the copy
+// through memory of its own. Returns false on a cache miss, for the caller to decode and encode it the usual way
+bool _texture_load_staged(texture_t *tex, const char *filename) {
+  char cache_file[256];
+  uint64_t key;
+  bc_image_t bc;
+  if(!_texture_cache_key(filename, cache_file, &key) || !bc_read_info(&bc, cache_file, key)) return false;
+
+  size_t size = 0;
+  for(uint32_t level = 0; level < bc.levels; level++) size += bc.size[level];
+
+  // The whole chain is one batch, even past the size cap, since the file is read in one go. The slot is trimmed when
+  // it comes around again
+  uint8_t *dst = _texture_stage_map(size);
+  bool ok = bc_read_blocks(cache_file, key, 0, dst);
+  _texture_stage_unmap();
+  if(!ok) {
+    _texture_stage_fence();
+    return false;
+  }
+
+  GLenum internal_format = _texture_init_compressed(tex, &bc, 0);
+  texture_piece_t pieces[IMAGE_MAX_LEVELS];
+  _texture_issue(tex, pieces, _texture_compressed_pieces(&bc, 0, bc.levels, pieces), internal_format);
+  glstate_bind_texture(0, GL_TEXTURE_2D, 0);
+
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Loaded \'%s\' from the texture cache\n", filename);
+
+  return true;
+}
+
+bool texture_load(texture_t *tex, const char *filename) {
+  // Blocks already in the texture cache go from the file straight into the staging buffer
+  if(compression_enabled && !streaming_enabled && _texture_load_staged(tex, filename)) return true;
+
+  texture_pending_t pending;
+  if(!_texture_decode(tex, filename, &pending)) return false;
+
+  _texture_upload_pending(tex, &pending);
+  return true;
+}
+
+void texture_upload_array(texture_t *tex, const image_t *images, uint32_t count) {
+  tex->target = GL_TEXTURE_2D_ARRAY;
+  tex->layers = count;
+  tex->width = images[0].width;
+  tex->height = images[0].height;
+  tex->levels = images[0].levels;
+  tex->first = 0;
+  tex->bytes = 0;
+
+  // Only the levels every image has can be used
+  for(uint32_t i = 1; i < count; i++) {
+    if(images[i].levels < tex->levels) tex->levels = images[i].levels;
+  }
+
+  // Generate the texture handle
+  glGenTextures(1, &tex->texID);
+  glstate_bind_texture(0, GL_TEXTURE_2D_ARRAY, tex->texID);
+
+  // Set the texture parameters, trilinear filtering over all the uploaded levels
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, (tex->levels > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, (GLint)tex->levels-1);
+
+  // Allocate the storage for every level of all the layers, then upload every level of every image through the PBO ring
+  texture_piece_t *pieces = (texture_piece_t*)malloc(sizeof(texture_piece_t)*tex->levels*count);
+  for(uint32_t level = 0; level < tex->levels; level++) {
+    GLsizei width = (GLsizei)image_level_width(&images[0], level), height = (GLsizei)image_level_height(&images[0], level);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, (GLint)level, GL_RGBA8, width, height, (GLsizei)count, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    for(uint32_t layer = 0; layer < count; layer++) {
+      pieces[level*count+layer] = (texture_piece_t){level, layer, width, height, (size_t)width*(size_t)height*4, images[layer].pixels[level]};
+    }
+  }
+  _texture_upload_pieces(tex, pieces, (size_t)tex->levels*count, 0);
+  free(pieces);
+
+  // Unbind the texture
+  glstate_bind_texture(0, GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void texture_upload_compressed_array(texture_t *tex, const bc_image_t *bcs, uint32_t count) {
+  GLenum internal_format = (bcs[0].format == BC_FORMAT_BC1) ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+
+  tex->target = GL_TEXTURE_2D_ARRAY;
+  tex->layers = count;
+  tex->width = bcs[0].width;
+  tex->height = bcs[0].height;
+  tex->levels = bcs[0].levels;
+  tex->first = 0;
+  tex->bytes = 0;
+
+  // Only the levels every image has can be used
+  for(uint32_t i = 1; i < count; i++) {
+    if(bcs[i].levels < tex->levels) tex->levels = bcs[i].levels;
+  }
+
+  // Generate the texture handle
+  glGenTextures(1, &tex->texID);
+  glstate_bind_texture(0, GL_TEXTURE_2D_ARRAY, tex->texID);
+
+  // Set the texture parameters, trilinear filtering over all the uploaded levels
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, (tex->levels > 1) ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, (GLint)tex->levels-1);
+
+  // Allocate the storage for every level of all the layers, then upload every level of every image through the PBO ring
+  texture_piece_t *pieces = (texture_piece_t*)malloc(sizeof(texture_piece_t)*tex->levels*count);
+  for(uint32_t level = 0; level < tex->levels; level++) {
+    GLsizei width = (GLsizei)((tex->width >> level) > 0 ? tex->width >> level : 1);
+    GLsizei height = (GLsizei)((tex->height >> level) > 0 ? tex->height >> level : 1);
+    glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, (GLint)level, internal_format, width, height, (GLsizei)count, 0, (GLsizei)(bcs[0].size[level]*count), NULL);
+    for(uint32_t layer = 0; layer < count; layer++) {
+      pieces[level*count+layer] = (texture_piece_t){level, layer, width, height, bcs[layer].size[level], bcs[layer].data[level]};
+    }
+  }
+  _texture_upload_pieces(tex, pieces, (size_t)tex->levels*count, internal_format);
+  free(pieces);
+
+  // Unbind the texture
+  glstate_bind_texture(0, GL_TEXTURE_2D_ARRAY, 0);
+}
+
+void texture_delete(texture_t *tex) {
+  // Delete the texture if it exists
+  if(tex->texID != 0) glstate_delete_textures(1, &tex->texID);
+  tex->texID = 0;
+  tex->bytes = 0;
+}
+
+void texture_request(texture_t *tex, float uv_per_pixel) {
+  if(tex->stream == NULL) return;
+
+  // One screen pixel covers this many texels of level 0 along the longer side, each level halves that
+  float texels = uv_per_pixel*(float)((tex->width > tex->height) ? tex->width : tex->height);
+  float levels = log2f(texels);
+  uint32_t level = (texels > 1.0f) ? (uint32_t)levels : 0;
+  if(level < tex->stream->wanted) tex->stream->wanted = level;
+}
+
+// Uploads the finer levels a background load has read into the texture and lowers its base level to the finest of
+// them. Only the new levels are allocated and uploaded, the ones already resident stay where they are
+void _texture_stream_add(texture_t *tex, const bc_image_t *bc) {
+  uint32_t first = tex->stream->loading;
+  GLenum internal_format = _texture_compressed_format(bc->format);
+
+  glstate_bind_texture(0, GL_TEXTURE_2D, tex->texID);
+  _texture_alloc_compressed(bc, first, tex->first);
+  texture_piece_t pieces[IMAGE_MAX_LEVELS];
+  _texture_upload_pieces(tex, pieces, _texture_compressed_pieces(bc, first, tex->first, pieces), internal_format);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, (GLint)first);
+  glstate_bind_texture(0, GL_TEXTURE_2D, 0);
+
+  tex->first = first;
+  stream_loads++;
+}
+
+// Drops the levels of a streamed texture finer than first. Raising the base level stops them from being sampled, and
+// redefining them as empty releases their storage
+void _texture_stream_evict(texture_t *tex, uint32_t first) {
+  GLenum internal_format = _texture_compressed_format(tex->stream->format);
+
+  glstate_bind_texture(0, GL_TEXTURE_2D, tex->texID);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, (GLint)first);
+  for(uint32_t level = tex->first; level < first; level++) glCompressedTexImage2D(GL_TEXTURE_2D, (GLint)level, internal_format, 0, 0, 0, 0, NULL);
+  glstate_bind_texture(0, GL_TEXTURE_2D, 0);
+
+  tex->bytes -= _texture_stream_bytes(tex, tex->first)-_texture_stream_bytes(tex, first);
+  tex->first = first;
+  stream_evictions++;
+}
+
+void texture_stream_update() {
+  if(!streaming_enabled || registry == NULL) return;
+
+  // Loader threads add textures to the registry and fill in the ones they are loading. Those are left alone until
+  // they are done
+  SDL_LockMutex(registry_lock);
+  size_t size = array_size(registry);
+  uint32_t *target = (uint32_t*)malloc(sizeof(uint32_t)*(size+1));
+  size_t total = 0;
+
+  for(uint64_t i = 0; i < size; i++) {
+    texture_t *tex = *((texture_t**)array_at(registry, i));
+    texture_stream_t *stream = tex->loading ? NULL : tex->stream;
+    target[i] = tex->first;
+
+    if(stream == NULL) {
+      total += tex->bytes;
+      continue;
+    }
+
+    // Add the levels a background load has finished reading, unless the texture was evicted in the meantime
+    if(stream->pending && SDL_AtomicGet(&stream->state) == TEXTURE_STREAM_DONE) {
+      if(stream->bc.levels > 0 && tex->texID != 0) _texture_stream_add(tex, &stream->bc);
+      bc_free(&stream->bc);
+      stream->pending = false;
+    }
+
+    // Load finer levels if the last frame needed them, never drop below the tail. Levels that are no longer
+    // needed stay resident until the budget runs out
+    stream->needed = (stream->wanted < stream->tail) ? stream->wanted : stream->tail;
+    if(stream->needed < target[i]) target[i] = stream->needed;
+    total += _texture_stream_bytes(tex, target[i]);
+  }
+
+  // Over budget, drop the finest level of the largest texture until everything fits. Levels nothing asked
+  // for go first, then the ones that are needed but do not fit
+  while(total > stream_budget) {
+    int64_t victim = -1;
+    bool victim_unused = false;
+    size_t victim_bytes = 0;
+
+    for(uint64_t i = 0; i < size; i++) {
+      texture_t *tex = *((texture_t**)array_at(registry, i));
+      if(tex->loading || tex->stream == NULL || target[i] >= tex->stream->tail) continue;
+
+      bool unused = target[i] < tex->stream->needed;
+      size_t bytes = _texture_stream_bytes(tex, target[i])-_texture_stream_bytes(tex, target[i]+1);
+      if(victim < 0 || (unused && !victim_unused) || (unused == victim_unused && bytes > victim_bytes)) {
+        victim = (int64_t)i;
+        victim_unused = unused;
+        victim_bytes = bytes;
+      }
+    }
+
+    if(victim < 0) break;
+    target[victim]++;
+    total -= victim_bytes;
+  }
+
+  // Drop the levels over budget right away. Kick off the loads of the finer levels on a worker thread, or right here
+  // if the pool has no workers, the update of a later frame uploads them
+  for(uint64_t i = 0; i < size; i++) {
+    texture_t *tex = *((texture_t**)array_at(registry, i));
+    texture_stream_t *stream = tex->stream;
+    if(tex->loading || stream == NULL) continue;
+
+    if(!stream->pending && tex->texID != 0 && target[i] > tex->first) {
+      _texture_stream_evict(tex, target[i]);
+    } else if(!stream->pending && tex->texID != 0 && target[i] < tex->first) {
+      stream->pending = true;
+      stream->loading = target[i];
+      stream->end = tex->first;
+      SDL_AtomicSet(&stream->state, TEXTURE_STREAM_LOADING);
+      threadpool_submit(threadpool_default(), _texture_stream_load, stream);
+    }
+
+    // Start collecting the requests of the next frame
+    stream->wanted = tex->levels-1;
+  }
+  SDL_UnlockMutex(registry_lock);
+
+  free(target);
+}
+
+void texture_use(texture_t *tex) {
+  tex->last_used = frame;
+  if(!residency_enabled) return;
+
+  if(tex->texID != 0) {
+    residency_stats.hits++;
+    return;
+  }
+
+  // Evicted, bring it back before it is bound
+  uint64_t start = SDL_GetPerformanceCounter();
+  if(!texture_load(tex, tex->path)) SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not reload texture: %s\n", tex->path);
+  double ms = timer_elapsed_ms(start);
+
+  residency_stats.misses++;
+  residency_stats.reload_ms += ms;
+  if(ms > residency_stats.reload_max_ms) residency_stats.reload_max_ms = ms;
+}
+
+void texture_residency_update() {
+  if(!residency_enabled || registry == NULL) {
+    frame++;
+    return;
+  }
+
+  // Textures still loading have no GL texture yet and are never picked
+  SDL_LockMutex(registry_lock);
+  size_t size = array_size(registry);
+  size_t total = 0;
+  for(uint64_t i = 0; i < size; i++) total += (*((texture_t**)array_at(registry, i)))->bytes;
+
+  // Over budget, evict the least recently drawn textures that can be loaded again. Textures drawn this frame stay
+  while(total > residency_budget) {
+    texture_t *victim = NULL;
+    for(uint64_t i = 0; i < size; i++) {
+      texture_t *tex = *((texture_t**)array_at(registry, i));
+      if(!tex->reloadable || tex->texID == 0 || tex->last_used == frame) continue;
+      if(victim == NULL || tex->last_used < victim->last_used) victim = tex;
+    }
+
+    if(victim == NULL) break;
+
+    total -= victim->bytes;
+    _texture_stream_free(victim);
+    texture_delete(victim);
+    residency_stats.evictions++;
+  }
+  SDL_UnlockMutex(registry_lock);
+
+  frame++;
+}
+
+void texture_residency_stats(texture_residency_stats_t *stats) {
+  *stats = residency_stats;
+}
+
+size_t texture_count() {
+  return (registry != NULL) ? array_size(registry) : 0;
+}
+
+void texture_memory(uint64_t index, texture_memory_t *mem) {
+  texture_t *tex = *((texture_t**)array_at(registry, index));
+  mem->path = tex->path;
+  mem->bytes = tex->bytes;
+  mem->resident = tex->first;
+  // A texture still loading is being filled in by its loader thread
+  const texture_stream_t *stream = tex->loading ? NULL : tex->stream;
+  mem->needed = (stream != NULL) ? stream->needed : 0;
+  mem->levels = tex->levels;
+  mem->streamed = (stream != NULL);
+}
+
+void texture_memory_report() {
+  // Loader threads may be adding textures while the report walks the registry
+  size_t total = 0, count = 0;
+  if(registry != NULL) {
+    SDL_LockMutex(registry_lock);
+    count = texture_count();
+    for(uint64_t i = 0; i < count; i++) {
+      texture_memory_t mem;
+      texture_memory(i, &mem);
+      total += mem.bytes;
+      SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Texture \'%s\': %.2f MB, levels %u-%u of %u resident, level %u needed%s%s\n", mem.path, (double)mem.bytes/(1024.0*1024.0), mem.resident, mem.levels-1, mem.levels, mem.needed, mem.streamed ? "" : " (not streamed)", (mem.bytes == 0) ? " (evicted)" : "");
+    }
+    SDL_UnlockMutex(registry_lock);
+  }
+
+  SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Texture memory: %.2f MB in %llu textures\n", (double)total/(1024.0*1024.0), (unsigned long long)count);
+  if(residency_enabled) {
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Texture residency: %.2f MB budget, %llu hits, %llu misses, %llu evictions, %.2f ms reloading (%.2f ms max)\n", (double)residency_budget/(1024.0*1024.0), (unsigned long long)residency_stats.hits, (unsigned long long)residency_stats.misses, (unsigned long long)residency_stats.evictions, residency_stats.reload_ms, residency_stats.reload_max_ms);
+  }
+  if(streaming_enabled) {
+    SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Texture streaming: %.2f MB budget, %llu loads, %llu evictions\n", (double)stream_budget/(1024.0*1024.0), (unsigned long long)stream_loads, (unsigned long long)stream_evictions);
+  }
+}
+
+void texture_upload_stats(texture_upload_stats_t *stats) {
+  *stats = upload_stats;
+}
+
+void texture_shutdown() {
+  // Release the staging buffers
+  for(uint32_t i = 0; i < TEXTURE_PBO_RING_SIZE; i++) {
+    if(pbo_ring[i].fence != NULL) glDeleteSync(pbo_ring[i].fence);
+    if(pbo_ring[i].pbo != 0) glstate_delete_buffers(1, &pbo_ring[i].pbo);
+    pbo_ring[i] = (texture_pbo_t){0, 0, NULL};
+  }
+  free(stage_fallback);
+  stage_fallback = NULL;
+  stage_fallback_size = 0;
+}
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include <SDL2/SDL.h>
+
+#include "threadpool.h"
+#include "array.h"
+
+// A group of jobs the submitting thread waits on
+typedef struct {
+  uint64_t remaining;
+} threadpool_batch_t;
+
+typedef struct {
+  threadpool_func_t func;
+  void *ctx;
+
+  // Range of iterations [begin, end) run by this job
+  uint64_t begin;
+  uint64_t end;
+
+  // NULL for fire and forget jobs
+  threadpool_batch_t *batch;
+} threadpool_job_t;
+
+struct threadpool {
+  SDL_Thread **threads;
+  uint32_t num_threads;
+
+  SDL_mutex *lock;
+  SDL_cond *work_cond;
+  SDL_cond *done_cond;
+
+  // FIFO of jobs, head is the next job to run
+  array_t *jobs;
+  size_t head;
+
+  // Jobs queued or running
+  uint64_t pending;
+  bool quit;
+};
+
+static threadpool_t *default_pool = NULL;
+
+// Pops a job off the queue and runs it, the first job of the batch if one is given. The pool lock must be held and is
+// held again on return
+bool _threadpool_run_one(threadpool_t *pool, threadpool_batch_t *batch) {
+  size_t index = pool->head;
+  while(batch != NULL && index < array_size(pool->jobs) && ((threadpool_job_t*)array_at(pool->jobs, index))->batch != batch) index++;
+  if(index >= array_size(pool->jobs)) return false;
+
+  // The jobs queued before it move up one so the others keep their order
+  threadpool_job_t job = *((threadpool_job_t*)array_at(pool->jobs, index));
+  for(; index > pool->head; index--) array_set(pool->jobs, index, array_at(pool->jobs, index-1));
+  pool->head++;
+  if(pool->head == array_size(pool->jobs)) {
+    array_clear(pool->jobs);
+    pool->head = 0;
+  }
+
+  SDL_UnlockMutex(pool->lock);
+  for(uint64_t i = job.begin; i < job.end; i++) job.func(job.ctx, i);
+  SDL_LockMutex(pool->lock);
+
+  if(job.batch != NULL) job.batch->remaining--;
+  pool->pending--;
+  SDL_CondBroadcast(pool->done_cond);
+
+  return true;
+}
+
+int _threadpool_worker(void *data) {
+  threadpool_t *pool = (threadpool_t*)data;
+
+  SDL_LockMutex(pool->lock);
+  while(!pool->quit) {
+    if(!_threadpool_run_one(pool, NULL)) SDL_CondWait(pool->work_cond, pool->lock);
+  }
+  SDL_UnlockMutex(pool->lock);
+
+  return 0;
+}
+
+void _threadpool_push(threadpool_t *pool, threadpool_job_t *job) {
+  array_append(pool->jobs, job);
+  pool->pending++;
+}
+
+threadpool_t* threadpool_create(uint32_t num_threads) {
+  threadpool_t *pool = (threadpool_t*)malloc(sizeof(threadpool_t));
+  assert(pool != NULL);
+
+  pool->num_threads = num_threads;
+  pool->lock = SDL_CreateMutex();
+  pool->work_cond = SDL_CreateCond();
+  pool->done_cond = SDL_CreateCond();
+  pool->jobs = array_create(64, sizeof(threadpool_job_t));
+  pool->head = 0;
+  pool->pending = 0;
+  pool->quit = false;
+
+  // A pool without workers runs everything on the calling thread, submitted jobs right as they are submitted
+  pool->threads = (SDL_Thread**)malloc(sizeof(SDL_Thread*)*(num_threads+1));
+  for(uint32_t i = 0; i < num_threads; i++) {
+    pool->threads[i] = SDL_CreateThread(_threadpool_worker, "worker", pool);
+  }
+
+  return pool;
+}
+
+threadpool_t* threadpool_default() {
+  // Leave one core for the thread driving OpenGL
+  if(default_pool == NULL) {
+    int32_t cpus = SDL_GetCPUCount();
+    default_pool = threadpool_create((cpus > 1) ? (uint32_t)(cpus-1) : 0);
+  }
+  return default_pool;
+}
+
+uint32_t threadpool_size(threadpool_t *pool) {
+  return pool->num_threads;
+}
+
+void threadpool_submit(threadpool_t *pool, threadpool_func_t func, void *ctx) {
+  // Without workers nothing would run the job until the pool is waited on
+  if(pool->num_threads == 0) {
+    func(ctx, 0);
+    return;
+  }
+
+  threadpool_job_t job = {func, ctx, 0, 1, NULL};
+
+  SDL_LockMutex(pool->lock);
+  _threadpool_push(pool, &job);
+  SDL_CondSignal(pool->work_cond);
+  SDL_UnlockMutex(pool->lock);
+}
+
+void threadpool_parallel_for(threadpool_t *pool, uint64_t count, threadpool_func_t func, void *ctx) {
+  if(count == 0) return;
+
+  // Split the range into a few chunks per thread so uneven iterations still balance out
+  uint64_t num_chunks = (uint64_t)(pool->num_threads+1)*4;
+  if(num_chunks > count) num_chunks = count;
+  uint64_t chunk_size = (count+num_chunks-1)/num_chunks;
+
+  threadpool_batch_t batch = {0};
+
+  SDL_LockMutex(pool->lock);
+  for(uint64_t begin = 0; begin < count; begin += chunk_size) {
+    threadpool_job_t job = {func, ctx, begin, (begin+chunk_size < count) ? begin+chunk_size : count, &batch};
+    _threadpool_push(pool, &job);
+    batch.remaining++;
+  }
+  SDL_CondBroadcast(pool->work_cond);
+
+  // The calling thread helps out instead of blocking, which also makes nested parallel_for calls from a job safe. It
+  // only runs chunks of its own batch: another job could wait on something the caller itself is in the middle of
+  while(batch.remaining > 0) {
+    if(!_threadpool_run_one(pool, &batch)) SDL_CondWait(pool->done_cond, pool->lock);
+  }
+  SDL_UnlockMutex(pool->lock);
+}
+
+void threadpool_wait(threadpool_t *pool) {
+  SDL_LockMutex(pool->lock);
+  while(pool->pending > 0) {
+    if(!_threadpool_run_one(pool, NULL)) SDL_CondWait(pool->done_cond, pool->lock);
+  }
+  SDL_UnlockMutex(pool->lock);
+}
+
+void threadpool_delete(threadpool_t *pool) {
+  // Let the workers drain the queue and exit
+  threadpool_wait(pool);
+
+  SDL_LockMutex(pool->lock);
+  pool->quit = true;
+  SDL_CondBroadcast(pool->work_cond);
+  SDL_UnlockMutex(pool->lock);
+
+  for(uint32_t i = 0; i < pool->num_threads; i++) SDL_WaitThread(pool->threads[i], NULL);
+
+  SDL_DestroyCond(pool->work_cond);
+  SDL_DestroyCond(pool->done_cond);
+  SDL_DestroyMutex(pool->lock);
+  array_delete(pool->jobs);
+  free(pool->threads);
+
+  if(pool == default_pool) default_pool = NULL;
+  free(pool);
+}
@@ -0,0 +1,13 @@
+#include <SDL2/SDL.h>
+
+#include "timer.h"
+
+double timer_ms(uint64_t ticks) {
+  Uint64 frequency = SDL_GetPerformanceFrequency();
+  return (double)ticks*1000.0/(double)frequency;
+}
+
+double timer_elapsed_ms(uint64_t start) {
+  Uint64 now = SDL_GetPerformanceCounter();
+  return timer_ms(now-start);
+}